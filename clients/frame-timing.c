@@ -0,0 +1,166 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <wayland-client.h>
+#include "frame-timing-client-protocol.h"
+
+/* Dumps the repaint timeline the compositor keeps for each output, one
+ * line per frame with the duration of every phase in milliseconds.  The
+ * compositor only exposes it with frame-timing-protocol=true in the core
+ * section of weston.ini. */
+
+static const char * const phase_names[] = {
+	"view_list",
+	"planes",
+	"damage",
+	"render",
+	"input",
+	"frame_callbacks",
+	"animations",
+	"present",
+};
+
+#define PHASE_COUNT (sizeof phase_names / sizeof phase_names[0])
+
+static struct weston_frame_timing *frame_timing;
+static struct wl_list output_list;
+static int timeline_done;
+
+struct timing_output {
+	struct wl_output *output;
+	int index;
+	struct wl_list link;
+};
+
+static int current_output;
+
+static void
+timing_handle_frame(void *data, struct weston_frame_timing *timing,
+		    uint32_t seq, uint32_t tv_sec, uint32_t tv_usec,
+		    struct wl_array *phases)
+{
+	uint32_t *phase_us = phases->data;
+	size_t i, count;
+
+	count = phases->size / sizeof *phase_us;
+	if (count > PHASE_COUNT)
+		count = PHASE_COUNT;
+
+	printf("%d %u %u.%06u", current_output, seq, tv_sec, tv_usec);
+	for (i = 0; i < PHASE_COUNT; i++)
+		printf(" %.3f", i < count ? phase_us[i] / 1000.0 : 0.0);
+	printf("\n");
+}
+
+static void
+timing_handle_done(void *data, struct weston_frame_timing *timing)
+{
+	timeline_done = 1;
+}
+
+static const struct weston_frame_timing_listener frame_timing_listener = {
+	timing_handle_frame,
+	timing_handle_done
+};
+
+static void
+handle_global(void *data, struct wl_registry *registry,
+	      uint32_t name, const char *interface, uint32_t version)
+{
+	static int output_count;
+	struct timing_output *output;
+
+	if (strcmp(interface, "wl_output") == 0) {
+		output = malloc(sizeof *output);
+		if (output == NULL)
+			return;
+		output->output = wl_registry_bind(registry, name,
+						  &wl_output_interface, 1);
+		output->index = output_count++;
+		wl_list_insert(output_list.prev, &output->link);
+	} else if (strcmp(interface, "weston_frame_timing") == 0) {
+		frame_timing =
+			wl_registry_bind(registry, name,
+					 &weston_frame_timing_interface, 1);
+	}
+}
+
+static void
+handle_global_remove(void *data, struct wl_registry *registry, uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	handle_global,
+	handle_global_remove
+};
+
+int main(int argc, char *argv[])
+{
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct timing_output *output;
+	size_t i;
+
+	display = wl_display_connect(NULL);
+	if (display == NULL) {
+		fprintf(stderr, "failed to create display: %m\n");
+		return -1;
+	}
+
+	wl_list_init(&output_list);
+	registry = wl_display_get_registry(display);
+	wl_registry_add_listener(registry, &registry_listener, NULL);
+	wl_display_roundtrip(display);
+	if (frame_timing == NULL) {
+		fprintf(stderr, "display doesn't support weston_frame_timing, "
+			"set frame-timing-protocol=true in weston.ini\n");
+		return -1;
+	}
+
+	weston_frame_timing_add_listener(frame_timing,
+					 &frame_timing_listener, NULL);
+
+	printf("# output seq start");
+	for (i = 0; i < PHASE_COUNT; i++)
+		printf(" %s", phase_names[i]);
+	printf("\n");
+
+	wl_list_for_each(output, &output_list, link) {
+		current_output = output->index;
+		timeline_done = 0;
+		weston_frame_timing_get_timeline(frame_timing, output->output);
+		while (!timeline_done)
+			if (wl_display_dispatch(display) < 0)
+				return -1;
+	}
+
+	return 0;
+}
@@ -174,6 +174,11 @@ frame_status(struct frame *frame);
 void
 frame_status_clear(struct frame *frame, enum frame_status status);
 
+/* Nonzero when no button is hovered or pressed, so the frame looks like
+ * any other frame of the same size, flags and title. */
+int
+frame_buttons_idle(struct frame *frame);
+
 /* May set FRAME_STATUS_REPAINT */
 enum theme_location
 frame_pointer_enter(struct frame *frame, void *pointer, int x, int y);
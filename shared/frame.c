@@ -598,6 +598,18 @@ frame_status_clear(struct frame *frame, enum frame_status status)
 	frame->status &= ~status;
 }
 
+int
+frame_buttons_idle(struct frame *frame)
+{
+	struct frame_button *button;
+
+	wl_list_for_each(button, &frame->buttons, link)
+		if (button->hover_count || button->press_count)
+			return 0;
+
+	return 1;
+}
+
 static struct frame_button *
 frame_find_button(struct frame *frame, int x, int y)
 {
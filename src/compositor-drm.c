@@ -55,6 +55,39 @@
 #define DRM_CAP_TIMESTAMP_MONOTONIC 0x6
 #endif
 
+#ifndef DRM_PLANE_TYPE_OVERLAY
+#define DRM_PLANE_TYPE_OVERLAY 0
+#define DRM_PLANE_TYPE_PRIMARY 1
+#define DRM_PLANE_TYPE_CURSOR 2
+#endif
+
+/* KMS properties used with atomic modesetting. */
+enum wdrm_plane_property {
+	WDRM_PLANE_TYPE,
+	WDRM_PLANE_SRC_X,
+	WDRM_PLANE_SRC_Y,
+	WDRM_PLANE_SRC_W,
+	WDRM_PLANE_SRC_H,
+	WDRM_PLANE_CRTC_X,
+	WDRM_PLANE_CRTC_Y,
+	WDRM_PLANE_CRTC_W,
+	WDRM_PLANE_CRTC_H,
+	WDRM_PLANE_FB_ID,
+	WDRM_PLANE_CRTC_ID,
+	WDRM_PLANE__COUNT
+};
+
+enum wdrm_crtc_property {
+	WDRM_CRTC_MODE_ID,
+	WDRM_CRTC_ACTIVE,
+	WDRM_CRTC__COUNT
+};
+
+enum wdrm_connector_property {
+	WDRM_CONNECTOR_CRTC_ID,
+	WDRM_CONNECTOR__COUNT
+};
+
 static int option_current_mode = 0;
 
 enum output_config {
@@ -103,6 +136,7 @@ struct drm_compositor {
 	int cursors_are_broken;
 
 	int use_pixman;
+	int atomic_modeset;
 
 	uint32_t prev_state;
 
@@ -168,11 +202,21 @@ struct drm_output {
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
+
+	/* Atomic modesetting state. */
+	struct drm_sprite *primary;
+	uint32_t crtc_props[WDRM_CRTC__COUNT];
+	uint32_t connector_props[WDRM_CONNECTOR__COUNT];
+	uint32_t mode_blob;
+	struct drm_mode *blob_mode;
+	int sprites_dropped;
 };
 
 /*
  * An output has a primary display plane plus zero or more sprites for
- * blending display contents.
+ * blending display contents.  With atomic modesetting the primary
+ * planes are listed as sprites too, of type DRM_PLANE_TYPE_PRIMARY, and
+ * each output claims one of them.
  */
 struct drm_sprite {
 	struct wl_list link;
@@ -185,6 +229,8 @@ struct drm_sprite {
 
 	uint32_t possible_crtcs;
 	uint32_t plane_id;
+	uint32_t type;
+	uint32_t props[WDRM_PLANE__COUNT];
 	uint32_t count_formats;
 
 	int32_t src_x, src_y;
@@ -200,6 +246,7 @@ struct drm_parameters {
 	int tty;
 	int use_pixman;
 	const char *seat_id;
+	const char *device;
 };
 
 static struct gl_renderer_interface *gl_renderer;
@@ -416,6 +463,397 @@ drm_output_release_fb(struct drm_output *output, struct drm_fb *fb)
 	}
 }
 
+#ifdef HAVE_DRM_ATOMIC
+static const char * const plane_prop_names[] = {
+	[WDRM_PLANE_TYPE] = "type",
+	[WDRM_PLANE_SRC_X] = "SRC_X",
+	[WDRM_PLANE_SRC_Y] = "SRC_Y",
+	[WDRM_PLANE_SRC_W] = "SRC_W",
+	[WDRM_PLANE_SRC_H] = "SRC_H",
+	[WDRM_PLANE_CRTC_X] = "CRTC_X",
+	[WDRM_PLANE_CRTC_Y] = "CRTC_Y",
+	[WDRM_PLANE_CRTC_W] = "CRTC_W",
+	[WDRM_PLANE_CRTC_H] = "CRTC_H",
+	[WDRM_PLANE_FB_ID] = "FB_ID",
+	[WDRM_PLANE_CRTC_ID] = "CRTC_ID",
+};
+
+static const char * const crtc_prop_names[] = {
+	[WDRM_CRTC_MODE_ID] = "MODE_ID",
+	[WDRM_CRTC_ACTIVE] = "ACTIVE",
+};
+
+static const char * const connector_prop_names[] = {
+	[WDRM_CONNECTOR_CRTC_ID] = "CRTC_ID",
+};
+
+/* Looks up the ids, and optionally the values, of the named properties
+ * of a KMS object.  Returns how many of them it has. */
+static int
+drm_object_get_props(int fd, uint32_t obj_id, uint32_t obj_type,
+		     const char * const *names, int count,
+		     uint32_t *ids, uint64_t *values)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i;
+	int j, found = 0;
+
+	memset(ids, 0, count * sizeof *ids);
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			if (strcmp(prop->name, names[j]) != 0)
+				continue;
+
+			ids[j] = prop->prop_id;
+			if (values)
+				values[j] = props->prop_values[i];
+			found++;
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return found;
+}
+
+static int
+drm_sprite_add_prop(drmModeAtomicReq *req, struct drm_sprite *s,
+		    enum wdrm_plane_property prop, uint64_t value)
+{
+	if (s->props[prop] == 0)
+		return -1;
+
+	if (drmModeAtomicAddProperty(req, s->plane_id,
+				     s->props[prop], value) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* Shows fb on the sprite with its current source and destination
+ * rectangles, or turns the sprite off for a NULL fb. */
+static int
+drm_sprite_add_atomic(drmModeAtomicReq *req, struct drm_sprite *s,
+		      struct drm_output *output, struct drm_fb *fb)
+{
+	int ret = 0;
+
+	if (!fb) {
+		ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_FB_ID, 0);
+		ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_CRTC_ID, 0);
+		return ret;
+	}
+
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_FB_ID, fb->fb_id);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_CRTC_ID,
+				   output->crtc_id);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_SRC_X, s->src_x);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_SRC_Y, s->src_y);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_SRC_W, s->src_w);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_SRC_H, s->src_h);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_CRTC_X, s->dest_x);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_CRTC_Y, s->dest_y);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_CRTC_W, s->dest_w);
+	ret |= drm_sprite_add_prop(req, s, WDRM_PLANE_CRTC_H, s->dest_h);
+
+	return ret;
+}
+
+static int
+drm_output_set_mode_blob(struct drm_output *output, struct drm_mode *mode)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+
+	if (output->mode_blob && output->blob_mode == mode)
+		return 0;
+
+	if (output->mode_blob)
+		drmModeDestroyPropertyBlob(c->drm.fd, output->mode_blob);
+	output->mode_blob = 0;
+	output->blob_mode = NULL;
+
+	if (drmModeCreatePropertyBlob(c->drm.fd, &mode->mode_info,
+				      sizeof mode->mode_info,
+				      &output->mode_blob) != 0)
+		return -1;
+
+	output->blob_mode = mode;
+
+	return 0;
+}
+
+/* Adds the complete configuration of the output to an atomic request:
+ * the primary plane, every sprite it shows or gives up and, when the
+ * mode has to be set, the mode.  The primary plane shows the frame
+ * being prepared, or the current one while the renderer has not
+ * produced it yet, which is as good for testing.  Before the first
+ * frame there is neither, and a test leaves the primary plane out so
+ * that the kernel checks the sprites against its present state. */
+static int
+drm_output_populate_atomic(struct drm_output *output,
+			   drmModeAtomicReq *req, uint32_t *flags)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_mode *mode =
+		container_of(output->base.current_mode, struct drm_mode, base);
+	struct drm_sprite *primary = output->primary, *s;
+	struct drm_fb *fb;
+	int ret = 0;
+
+	if (!primary)
+		return -1;
+
+	fb = output->next ? output->next : output->current;
+	if (!fb && !(*flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		return -1;
+
+	if (!output->current || output->current->stride != fb->stride) {
+		if (drm_output_set_mode_blob(output, mode) < 0)
+			return -1;
+
+		if (drmModeAtomicAddProperty(req, output->crtc_id,
+				output->crtc_props[WDRM_CRTC_MODE_ID],
+				output->mode_blob) < 0 ||
+		    drmModeAtomicAddProperty(req, output->crtc_id,
+				output->crtc_props[WDRM_CRTC_ACTIVE], 1) < 0 ||
+		    drmModeAtomicAddProperty(req, output->connector_id,
+				output->connector_props[WDRM_CONNECTOR_CRTC_ID],
+				output->crtc_id) < 0)
+			return -1;
+
+		*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	if (fb) {
+		primary->src_x = 0;
+		primary->src_y = 0;
+		primary->src_w = mode->base.width << 16;
+		primary->src_h = mode->base.height << 16;
+		primary->dest_x = 0;
+		primary->dest_y = 0;
+		primary->dest_w = mode->base.width;
+		primary->dest_h = mode->base.height;
+		ret |= drm_sprite_add_atomic(req, primary, output, fb);
+	}
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output)
+			continue;
+
+		ret |= drm_sprite_add_atomic(req, s, output,
+					     c->sprites_hidden ? NULL : s->next);
+	}
+
+	return ret;
+}
+
+static int
+drm_output_apply_atomic(struct drm_output *output, uint32_t flags)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_populate_atomic(output, req, &flags);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(c->drm.fd, req, flags,
+					  (flags & DRM_MODE_PAGE_FLIP_EVENT) ?
+					  output : NULL);
+
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/* Asks the kernel whether the configuration the output is about to
+ * get would work, without applying it. */
+static int
+drm_output_test_atomic(struct drm_output *output)
+{
+	return drm_output_apply_atomic(output, DRM_MODE_ATOMIC_TEST_ONLY);
+}
+
+/* Drops the sprite assignments of a frame that will not be shown.
+ * Returns how many sprites lost their view. */
+static int
+drm_output_drop_sprites(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+	int dropped = 0;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output)
+			continue;
+
+		if (s->next)
+			dropped++;
+
+		drm_output_release_fb(output, s->next);
+		s->next = NULL;
+		if (!s->current)
+			s->output = NULL;
+	}
+
+	return dropped;
+}
+
+/* Flips the primary plane and all sprites of the output in one
+ * nonblocking commit, completed by a single page flip event. */
+static int
+drm_output_commit_atomic(struct drm_output *output)
+{
+	uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	if (drm_output_apply_atomic(output, flags) == 0)
+		return 0;
+
+	weston_log("atomic commit failed: %m\n");
+
+	/* Sprites tested before the first frame were checked without
+	 * the primary plane and may not fit with it.  Show the frame
+	 * without them rather than not at all, and repaint the whole
+	 * output once it is up so that their views get drawn. */
+	if (drm_output_drop_sprites(output) == 0)
+		return -1;
+
+	if (drm_output_apply_atomic(output, flags) < 0) {
+		weston_log("atomic commit without sprites failed: %m\n");
+		return -1;
+	}
+
+	output->sprites_dropped = 1;
+
+	return 0;
+}
+
+/* The sprites of an output complete along with its primary plane. */
+static void
+drm_output_flip_sprites(struct drm_output *output)
+{
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output)
+			continue;
+
+		drm_output_release_fb(output, s->current);
+		s->current = s->next;
+		s->next = NULL;
+		if (!s->current)
+			s->output = NULL;
+	}
+}
+
+static int
+drm_output_init_atomic(struct drm_output *output, struct drm_compositor *c)
+{
+	struct drm_sprite *s;
+
+	if (drm_object_get_props(c->drm.fd, output->crtc_id,
+				 DRM_MODE_OBJECT_CRTC, crtc_prop_names,
+				 WDRM_CRTC__COUNT, output->crtc_props,
+				 NULL) != WDRM_CRTC__COUNT ||
+	    drm_object_get_props(c->drm.fd, output->connector_id,
+				 DRM_MODE_OBJECT_CONNECTOR,
+				 connector_prop_names, WDRM_CONNECTOR__COUNT,
+				 output->connector_props,
+				 NULL) != WDRM_CONNECTOR__COUNT) {
+		weston_log("missing atomic properties for crtc %d\n",
+			   output->crtc_id);
+		return -1;
+	}
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_PRIMARY || s->output ||
+		    !(s->possible_crtcs & (1 << output->pipe)))
+			continue;
+
+		s->output = output;
+		output->primary = s;
+
+		return 0;
+	}
+
+	weston_log("no primary plane for crtc %d\n", output->crtc_id);
+
+	return -1;
+}
+
+static void
+drm_output_fini_atomic(struct drm_output *output, struct drm_compositor *c)
+{
+	struct drm_sprite *s;
+
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (s->type != DRM_PLANE_TYPE_OVERLAY || s->output != output)
+			continue;
+
+		drmModeSetPlane(c->drm.fd, s->plane_id, output->crtc_id,
+				0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+		drm_output_release_fb(output, s->current);
+		drm_output_release_fb(output, s->next);
+		s->current = s->next = NULL;
+		s->output = NULL;
+	}
+
+	if (output->primary)
+		output->primary->output = NULL;
+	if (output->mode_blob)
+		drmModeDestroyPropertyBlob(c->drm.fd, output->mode_blob);
+}
+#else
+static int
+drm_output_test_atomic(struct drm_output *output)
+{
+	return -1;
+}
+
+static int
+drm_output_commit_atomic(struct drm_output *output)
+{
+	return -1;
+}
+
+static void
+drm_output_flip_sprites(struct drm_output *output)
+{
+}
+
+static int
+drm_output_init_atomic(struct drm_output *output, struct drm_compositor *c)
+{
+	return -1;
+}
+
+static void
+drm_output_fini_atomic(struct drm_output *output, struct drm_compositor *c)
+{
+}
+#endif
+
 static uint32_t
 drm_output_check_scanout_format(struct drm_output *output,
 				struct weston_surface *es, struct gbm_bo *bo)
@@ -489,6 +927,12 @@ drm_output_prepare_scanout_view(struct weston_output *_output,
 
 	drm_fb_set_buffer(output->next, buffer);
 
+	if (c->atomic_modeset && drm_output_test_atomic(output) < 0) {
+		drm_output_release_fb(output, output->next);
+		output->next = NULL;
+		return NULL;
+	}
+
 	return &output->fb_plane;
 }
 
@@ -596,6 +1040,16 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!output->next)
 		return -1;
 
+	if (compositor->atomic_modeset) {
+		if (drm_output_commit_atomic(output) < 0)
+			goto err_pageflip;
+
+		output->page_flip_pending = 1;
+		drm_output_set_cursor(output);
+
+		return 0;
+	}
+
 	mode = container_of(output->base.current_mode, struct drm_mode, base);
 	if (!output->current ||
 	    output->current->stride != output->next->stride) {
@@ -741,6 +1195,8 @@ page_flip_handler(int fd, unsigned int frame,
 		  unsigned int sec, unsigned int usec, void *data)
 {
 	struct drm_output *output = (struct drm_output *) data;
+	struct drm_compositor *c =
+		(struct drm_compositor *) output->base.compositor;
 	uint32_t msecs;
 
 	/* We don't set page_flip_pending on start_repaint_loop, in that case
@@ -750,6 +1206,9 @@ page_flip_handler(int fd, unsigned int frame,
 		drm_output_release_fb(output, output->current);
 		output->current = output->next;
 		output->next = NULL;
+
+		if (c->atomic_modeset)
+			drm_output_flip_sprites(output);
 	}
 
 	output->page_flip_pending = 0;
@@ -757,6 +1216,11 @@ page_flip_handler(int fd, unsigned int frame,
 	if (output->destroy_pending)
 		drm_output_destroy(&output->base);
 	else if (!output->vblank_pending) {
+		if (output->sprites_dropped) {
+			output->sprites_dropped = 0;
+			weston_output_damage(&output->base);
+		}
+
 		msecs = sec * 1000 + usec / 1000;
 		weston_output_finish_frame(&output->base, msecs);
 
@@ -803,90 +1267,24 @@ drm_view_transform_supported(struct weston_view *ev)
 		(ev->transform.matrix.type < WESTON_MATRIX_TRANSFORM_ROTATE);
 }
 
-static struct weston_plane *
-drm_output_prepare_overlay_view(struct weston_output *output_base,
-				struct weston_view *ev)
+/*
+ * Calculate the source & dest rects properly based on actual
+ * position (note the caller has called weston_surface_update_transform()
+ * for us already).
+ */
+static void
+drm_sprite_set_view_rects(struct drm_sprite *s,
+			  struct weston_output *output_base,
+			  struct weston_view *ev)
 {
-	struct weston_compositor *ec = output_base->compositor;
-	struct drm_compositor *c =(struct drm_compositor *) ec;
-	struct drm_sprite *s;
-	int found = 0;
-	struct gbm_bo *bo;
 	pixman_region32_t dest_rect, src_rect;
 	pixman_box32_t *box, tbox;
-	uint32_t format;
 	wl_fixed_t sx1, sy1, sx2, sy2;
 
-	if (c->gbm == NULL)
-		return NULL;
-
-	if (ev->surface->buffer_viewport.transform != output_base->transform)
-		return NULL;
-
-	if (ev->surface->buffer_viewport.scale != output_base->current_scale)
-		return NULL;
-
-	if (c->sprites_are_broken)
-		return NULL;
-
-	if (ev->output_mask != (1u << output_base->id))
-		return NULL;
-
-	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
-
-	if (ev->alpha != 1.0f)
-		return NULL;
-
-	if (wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource))
-		return NULL;
-
-	if (!drm_view_transform_supported(ev))
-		return NULL;
-
-	wl_list_for_each(s, &c->sprite_list, link) {
-		if (!drm_sprite_crtc_supported(output_base, s->possible_crtcs))
-			continue;
-
-		if (!s->next) {
-			found = 1;
-			break;
-		}
-	}
-
-	/* No sprites available */
-	if (!found)
-		return NULL;
-
-	bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
-			   ev->surface->buffer_ref.buffer->resource,
-			   GBM_BO_USE_SCANOUT);
-	if (!bo)
-		return NULL;
-
-	format = drm_output_check_sprite_format(s, ev, bo);
-	if (format == 0) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
-
-	s->next = drm_fb_get_from_bo(bo, c, format);
-	if (!s->next) {
-		gbm_bo_destroy(bo);
-		return NULL;
-	}
-
-	drm_fb_set_buffer(s->next, ev->surface->buffer_ref.buffer);
-
 	box = pixman_region32_extents(&ev->transform.boundingbox);
 	s->plane.x = box->x1;
 	s->plane.y = box->y1;
 
-	/*
-	 * Calculate the source & dest rects properly based on actual
-	 * position (note the caller has called weston_surface_update_transform()
-	 * for us already).
-	 */
 	pixman_region32_init(&dest_rect);
 	pixman_region32_intersect(&dest_rect, &ev->transform.boundingbox,
 				  &output_base->region);
@@ -942,8 +1340,115 @@ drm_output_prepare_overlay_view(struct weston_output *output_base,
 	s->src_w = (tbox.x2 - tbox.x1) << 8;
 	s->src_h = (tbox.y2 - tbox.y1) << 8;
 	pixman_region32_fini(&src_rect);
+}
+
+static int
+drm_sprite_available(struct drm_sprite *s, struct drm_output *output)
+{
+	struct drm_compositor *c = s->compositor;
+
+	if (s->type != DRM_PLANE_TYPE_OVERLAY || s->next)
+		return 0;
 
-	return &s->plane;
+	if (!drm_sprite_crtc_supported(&output->base, s->possible_crtcs))
+		return 0;
+
+	/* Still showing the last frame of another output. */
+	if (c->atomic_modeset && s->output && s->output != output)
+		return 0;
+
+	return 1;
+}
+
+static struct weston_plane *
+drm_output_prepare_overlay_view(struct weston_output *output_base,
+				struct weston_view *ev)
+{
+	struct weston_compositor *ec = output_base->compositor;
+	struct drm_compositor *c =(struct drm_compositor *) ec;
+	struct drm_output *output = (struct drm_output *) output_base;
+	struct drm_sprite *s;
+	struct drm_fb *fb = NULL;
+	struct gbm_bo *bo;
+	uint32_t format;
+
+	if (c->gbm == NULL)
+		return NULL;
+
+	if (ev->surface->buffer_viewport.transform != output_base->transform)
+		return NULL;
+
+	if (ev->surface->buffer_viewport.scale != output_base->current_scale)
+		return NULL;
+
+	if (c->sprites_are_broken)
+		return NULL;
+
+	if (ev->output_mask != (1u << output_base->id))
+		return NULL;
+
+	if (ev->surface->buffer_ref.buffer == NULL)
+		return NULL;
+
+	if (ev->alpha != 1.0f)
+		return NULL;
+
+	if (wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource))
+		return NULL;
+
+	if (!drm_view_transform_supported(ev))
+		return NULL;
+
+	/* Without atomic modesetting the first sprite that takes the
+	 * format gets the view.  With it, every sprite that takes it is
+	 * tried in turn against the configuration of the whole output
+	 * and the view goes to the first one the kernel accepts. */
+	bo = NULL;
+	wl_list_for_each(s, &c->sprite_list, link) {
+		if (!drm_sprite_available(s, output))
+			continue;
+
+		if (!bo) {
+			bo = gbm_bo_import(c->gbm, GBM_BO_IMPORT_WL_BUFFER,
+					   ev->surface->buffer_ref.buffer->resource,
+					   GBM_BO_USE_SCANOUT);
+			if (!bo)
+				return NULL;
+		}
+
+		format = drm_output_check_sprite_format(s, ev, bo);
+		if (format == 0)
+			continue;
+
+		if (!fb) {
+			fb = drm_fb_get_from_bo(bo, c, format);
+			if (!fb)
+				break;
+
+			drm_fb_set_buffer(fb, ev->surface->buffer_ref.buffer);
+		}
+
+		drm_sprite_set_view_rects(s, output_base, ev);
+		s->next = fb;
+
+		if (!c->atomic_modeset)
+			return &s->plane;
+
+		s->output = output;
+		if (drm_output_test_atomic(output) == 0)
+			return &s->plane;
+
+		s->next = NULL;
+		if (!s->current)
+			s->output = NULL;
+	}
+
+	if (fb)
+		drm_output_release_fb(output, fb);
+	else if (bo)
+		gbm_bo_destroy(bo);
+
+	return NULL;
 }
 
 static struct weston_plane *
@@ -1128,6 +1633,9 @@ drm_output_destroy(struct weston_output *output_base)
 	/* Turn off hardware cursor */
 	drmModeSetCursor(c->drm.fd, output->crtc_id, 0, 0, 0);
 
+	if (c->atomic_modeset)
+		drm_output_fini_atomic(output, c);
+
 	/* Restore original CRTC state */
 	drmModeSetCrtc(c->drm.fd, origcrtc->crtc_id, origcrtc->buffer_id,
 		       origcrtc->x, origcrtc->y,
@@ -1292,6 +1800,16 @@ init_drm(struct drm_compositor *ec, struct udev_device *device)
 	else
 		ec->clock = CLOCK_REALTIME;
 
+#ifdef HAVE_DRM_ATOMIC
+	/* Atomic implies universal planes, the primary and cursor planes
+	 * show up in the plane list too. */
+	if (!getenv("WESTON_DISABLE_ATOMIC") &&
+	    drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0)
+		ec->atomic_modeset = 1;
+#endif
+	weston_log("%s atomic modesetting\n",
+		   ec->atomic_modeset ? "using" : "not using");
+
 	return 0;
 }
 
@@ -1588,7 +2106,7 @@ drm_output_init_pixman(struct drm_output *output, struct drm_compositor *c)
 			goto err;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base, 0) < 0)
 		goto err;
 
 	pixman_region32_init_rect(&output->previous_damage,
@@ -2009,6 +2527,9 @@ create_output_for_connector(struct drm_compositor *ec,
 
 	output->base.current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
+	if (ec->atomic_modeset && drm_output_init_atomic(output, ec) < 0)
+		goto err_free;
+
 	weston_output_init(&output->base, &ec->base, x, y,
 			   connector->mmWidth, connector->mmHeight,
 			   transform, scale);
@@ -2080,6 +2601,9 @@ err_free:
 		free(drm_mode);
 	}
 
+	if (ec->atomic_modeset)
+		drm_output_fini_atomic(output, ec);
+
 	drmModeFreeCrtc(output->original_crtc);
 	ec->crtc_allocator &= ~(1 << output->crtc_id);
 	ec->connector_allocator &= ~(1 << output->connector_id);
@@ -2119,6 +2643,31 @@ create_sprites(struct drm_compositor *ec)
 
 		sprite->possible_crtcs = plane->possible_crtcs;
 		sprite->plane_id = plane->plane_id;
+		sprite->type = DRM_PLANE_TYPE_OVERLAY;
+#ifdef HAVE_DRM_ATOMIC
+		if (ec->atomic_modeset) {
+			uint64_t values[WDRM_PLANE__COUNT] = { 0 };
+			int found;
+
+			found = drm_object_get_props(ec->drm.fd,
+						     plane->plane_id,
+						     DRM_MODE_OBJECT_PLANE,
+						     plane_prop_names,
+						     WDRM_PLANE__COUNT,
+						     sprite->props, values);
+			sprite->type = values[WDRM_PLANE_TYPE];
+
+			if (found != WDRM_PLANE__COUNT &&
+			    sprite->type == DRM_PLANE_TYPE_OVERLAY) {
+				weston_log("missing atomic properties for "
+					   "plane %d, not using it\n",
+					   plane->plane_id);
+				drmModeFreePlane(plane);
+				free(sprite);
+				continue;
+			}
+		}
+#endif
 		sprite->current = NULL;
 		sprite->next = NULL;
 		sprite->compositor = ec;
@@ -2126,6 +2675,13 @@ create_sprites(struct drm_compositor *ec)
 		memcpy(sprite->formats, plane->formats,
 		       plane->count_formats * sizeof(plane->formats[0]));
 		drmModeFreePlane(plane);
+
+		/* The cursor is left to the legacy cursor ioctls. */
+		if (sprite->type == DRM_PLANE_TYPE_CURSOR) {
+			free(sprite);
+			continue;
+		}
+
 		weston_plane_init(&sprite->plane, &ec->base, 0, 0);
 		weston_compositor_stack_plane(&ec->base, &sprite->plane,
 					      &ec->base.primary_plane);
@@ -2146,10 +2702,11 @@ destroy_sprites(struct drm_compositor *compositor)
 			      struct drm_output, base.link);
 
 	wl_list_for_each_safe(sprite, next, &compositor->sprite_list, link) {
-		drmModeSetPlane(compositor->drm.fd,
-				sprite->plane_id,
-				output->crtc_id, 0, 0,
-				0, 0, 0, 0, 0, 0, 0, 0);
+		if (sprite->type == DRM_PLANE_TYPE_OVERLAY)
+			drmModeSetPlane(compositor->drm.fd,
+					sprite->plane_id,
+					output->crtc_id, 0, 0,
+					0, 0, 0, 0, 0, 0, 0, 0);
 		drm_output_release_fb(output, sprite->current);
 		drm_output_release_fb(output, sprite->next);
 		weston_plane_release(&sprite->plane);
@@ -2423,11 +2980,15 @@ session_notify(struct wl_listener *listener, void *data)
 		output = container_of(ec->base.output_list.next,
 				      struct drm_output, base.link);
 
-		wl_list_for_each(sprite, &ec->sprite_list, link)
+		wl_list_for_each(sprite, &ec->sprite_list, link) {
+			if (sprite->type != DRM_PLANE_TYPE_OVERLAY)
+				continue;
+
 			drmModeSetPlane(ec->drm.fd,
 					sprite->plane_id,
 					output->crtc_id, 0, 0,
 					0, 0, 0, 0, 0, 0, 0, 0);
+		}
 	};
 }
 
@@ -2447,7 +3008,8 @@ switch_vt_binding(struct weston_seat *seat, uint32_t time, uint32_t key, void *d
  * If no such device is found, the first DRM device reported by udev is used.
  */
 static struct udev_device*
-find_primary_gpu(struct drm_compositor *ec, const char *seat)
+find_primary_gpu(struct drm_compositor *ec, const char *seat,
+		 const char *name)
 {
 	struct udev_enumerate *e;
 	struct udev_list_entry *entry;
@@ -2473,6 +3035,17 @@ find_primary_gpu(struct drm_compositor *ec, const char *seat)
 			continue;
 		}
 
+		/* A device asked for by name is used whatever it is. */
+		if (name) {
+			if (strcmp(udev_device_get_sysname(device), name)) {
+				udev_device_unref(device);
+				continue;
+			}
+
+			drm_device = device;
+			break;
+		}
+
 		pci = udev_device_get_parent_with_subsystem_devtype(device,
 								"pci", NULL);
 		if (pci) {
@@ -2719,7 +3292,7 @@ drm_compositor_create(struct wl_display *display,
 	ec->session_listener.notify = session_notify;
 	wl_signal_add(&ec->base.session_signal, &ec->session_listener);
 
-	drm_device = find_primary_gpu(ec, param->seat_id);
+	drm_device = find_primary_gpu(ec, param->seat_id, param->device);
 	if (drm_device == NULL) {
 		weston_log("no drm device found\n");
 		goto err_udev;
@@ -2756,6 +3329,17 @@ drm_compositor_create(struct wl_display *display,
 	wl_list_init(&ec->sprite_list);
 	create_sprites(ec);
 
+	/* The legacy path shows a sprite without knowing whether the
+	 * hardware can, so sprites stay off there unless turned on with
+	 * the debug binding.  Only with atomic modesetting, where every
+	 * assignment is tried with a TEST_ONLY commit first and falls
+	 * back to the renderer when refused, are they enabled. */
+	if (ec->atomic_modeset) {
+		ec->sprites_are_broken = 0;
+		weston_log("sprites enabled, atomic modesetting tests "
+			   "their assignments\n");
+	}
+
 	if (create_outputs(ec, param->connector, drm_device) < 0) {
 		weston_log("failed to create output for %s\n", path);
 		goto err_sprite;
@@ -2841,6 +3425,7 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 		{ WESTON_OPTION_INTEGER, "tty", 0, &param.tty },
 		{ WESTON_OPTION_BOOLEAN, "current-mode", 0, &option_current_mode },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &param.use_pixman },
+		{ WESTON_OPTION_STRING, "drm-device", 0, &param.device },
 	};
 
 	param.seat_id = default_seat;
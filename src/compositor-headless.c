@@ -24,38 +24,190 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include "compositor.h"
+#include "pixman-renderer.h"
+
+/* How frames complete: paced by a real 60Hz timer, as soon as the
+ * compositor gets back to its event loop, or when a virtual clock moved
+ * by the test harness reaches the next refresh. */
+enum headless_clock {
+	HEADLESS_CLOCK_REALTIME,
+	HEADLESS_CLOCK_UNCAPPED,
+	HEADLESS_CLOCK_VIRTUAL,
+};
 
 struct headless_compositor {
 	struct weston_compositor base;
 	struct weston_seat fake_seat;
+	int use_pixman;
+
+	enum headless_clock clock;
+	uint64_t virtual_usec;
+	int finish_fd;
+	struct wl_event_source *finish_source;
 };
 
 struct headless_output {
 	struct weston_output base;
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	pixman_image_t *image;
+
+	int frame_pending;
+	uint64_t frame_due_usec;
+	uint64_t refresh_usec;
+
+	uint32_t frame_count;
+	uint64_t first_frame_usec;
 };
 
+struct headless_parameters {
+	int width;
+	int height;
+	int scale;
+	uint32_t transform;
+	int output_count;
+	int use_pixman;
+	enum headless_clock clock;
+};
 
-static void
-headless_output_start_repaint_loop(struct weston_output *output)
+
+static uint64_t
+headless_get_time_usec(void)
 {
-	uint32_t msec;
 	struct timeval tv;
 
 	gettimeofday(&tv, NULL);
-	msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	weston_output_finish_frame(output, msec);
+
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Completes the frames of all outputs whose refresh is due; with the
+ * uncapped clock that is every pending one. */
+static void
+headless_compositor_finish_frames(struct headless_compositor *c)
+{
+	struct headless_output *output, *next;
+	uint64_t usec;
+
+	wl_list_for_each_safe(output, next, &c->base.output_list, base.link) {
+		if (!output->frame_pending)
+			continue;
+
+		if (c->clock == HEADLESS_CLOCK_VIRTUAL) {
+			if (output->frame_due_usec > c->virtual_usec)
+				continue;
+			usec = output->frame_due_usec;
+		} else {
+			usec = headless_get_time_usec();
+		}
+
+		output->frame_pending = 0;
+		weston_output_finish_frame(&output->base, usec / 1000);
+	}
+}
+
+static int
+finish_fd_handler(int fd, uint32_t mask, void *data)
+{
+	struct headless_compositor *c = data;
+	uint64_t count;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		weston_log("headless: failed to read frame notification\n");
+
+	headless_compositor_finish_frames(c);
+
+	return 1;
+}
+
+static void
+headless_advance_clock(struct weston_compositor *ec, uint32_t msecs)
+{
+	struct headless_compositor *c = (struct headless_compositor *) ec;
+
+	c->virtual_usec += (uint64_t) msecs * 1000;
+	headless_compositor_finish_frames(c);
+}
+
+/* Refreshes fall on a fixed grid, the next one strictly after now
+ * becomes due. */
+static void
+headless_output_next_refresh(struct headless_output *output, uint64_t now)
+{
+	uint64_t missed;
+
+	if (output->frame_due_usec > now)
+		return;
+
+	missed = (now - output->frame_due_usec) / output->refresh_usec;
+	output->frame_due_usec += (missed + 1) * output->refresh_usec;
+}
+
+static void
+headless_output_schedule_finish(struct headless_output *output)
+{
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+	uint64_t one = 1, now;
+
+	switch (c->clock) {
+	case HEADLESS_CLOCK_REALTIME:
+		now = headless_get_time_usec();
+		headless_output_next_refresh(output, now);
+		wl_event_source_timer_update(output->finish_frame_timer,
+			(output->frame_due_usec - now + 999) / 1000);
+		break;
+	case HEADLESS_CLOCK_UNCAPPED:
+		/* Not from an idle callback, clients would starve. */
+		output->frame_pending = 1;
+		if (write(c->finish_fd, &one, sizeof one) < 0)
+			weston_log("headless: failed to queue frame\n");
+		break;
+	case HEADLESS_CLOCK_VIRTUAL:
+		output->frame_pending = 1;
+		headless_output_next_refresh(output, c->virtual_usec);
+		break;
+	}
+}
+
+static void
+headless_output_start_repaint_loop(struct weston_output *output_base)
+{
+	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+	uint64_t usec;
+
+	/* Like a real display, the realtime clock can only report the
+	 * next refresh. */
+	if (c->clock == HEADLESS_CLOCK_REALTIME) {
+		headless_output_schedule_finish(output);
+		return;
+	}
+
+	if (c->clock == HEADLESS_CLOCK_VIRTUAL)
+		usec = c->virtual_usec;
+	else
+		usec = headless_get_time_usec();
+
+	weston_output_finish_frame(&output->base, usec / 1000);
 }
 
 static int
 finish_frame_handler(void *data)
 {
-	headless_output_start_repaint_loop(data);
+	struct headless_output *output = data;
+
+	weston_output_finish_frame(&output->base,
+				   output->frame_due_usec / 1000);
 
 	return 1;
 }
@@ -67,12 +219,15 @@ headless_output_repaint(struct weston_output *output_base,
 	struct headless_output *output = (struct headless_output *) output_base;
 	struct weston_compositor *ec = output->base.compositor;
 
+	if (output->frame_count++ == 0)
+		output->first_frame_usec = headless_get_time_usec();
+
 	ec->renderer->repaint_output(&output->base, damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	headless_output_schedule_finish(output);
 
 	return 0;
 }
@@ -81,38 +236,87 @@ static void
 headless_output_destroy(struct weston_output *output_base)
 {
 	struct headless_output *output = (struct headless_output *) output_base;
+	struct headless_compositor *c =
+		(struct headless_compositor *) output->base.compositor;
+	uint64_t elapsed;
 
 	wl_event_source_remove(output->finish_frame_timer);
+
+	if (c->clock != HEADLESS_CLOCK_REALTIME && output->frame_count > 1) {
+		elapsed = headless_get_time_usec() - output->first_frame_usec;
+		weston_log("headless: %u frames in %.3f s, %.1f frames/s\n",
+			   output->frame_count, elapsed / 1000000.0,
+			   (output->frame_count - 1) * 1000000.0 /
+			   (elapsed ? elapsed : 1));
+	}
+
+	if (c->use_pixman) {
+		pixman_renderer_output_destroy(&output->base);
+		pixman_image_unref(output->image);
+	}
+
+	weston_output_destroy(&output->base);
+
 	free(output);
 
 	return;
 }
 
-static int
+static struct headless_output *
 headless_compositor_create_output(struct headless_compositor *c,
-				 int width, int height)
+				  int x, int y, int width, int height,
+				  const char *name, uint32_t transform,
+				  int32_t scale)
 {
 	struct headless_output *output;
 	struct wl_event_loop *loop;
 
 	output = zalloc(sizeof *output);
 	if (output == NULL)
-		return -1;
+		return NULL;
 
 	output->mode.flags =
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
-	output->mode.width = width;
-	output->mode.height = height;
-	output->mode.refresh = 60;
+	output->mode.width = width * scale;
+	output->mode.height = height * scale;
+	output->mode.refresh = 60000;
 	wl_list_init(&output->base.mode_list);
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
 	output->base.current_mode = &output->mode;
-	weston_output_init(&output->base, &c->base, 0, 0, width, height,
-			   WL_OUTPUT_TRANSFORM_NORMAL, 1);
+	weston_output_init(&output->base, &c->base, x, y, width, height,
+			   transform, scale);
+	wl_list_insert(c->base.output_list.prev, &output->base.link);
 
 	output->base.make = "weston";
 	output->base.model = "headless";
+	if (name)
+		output->base.name = strdup(name);
+
+	output->refresh_usec = 1000000000 / output->mode.refresh;
+	if (c->clock == HEADLESS_CLOCK_VIRTUAL)
+		output->frame_due_usec = c->virtual_usec;
+	else
+		output->frame_due_usec = headless_get_time_usec();
+
+	/* The pixman renderer draws into a plain in-memory buffer, in the
+	 * untransformed layout a real scanout buffer would have. */
+	if (c->use_pixman) {
+		output->image =
+			pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						 output->mode.width,
+						 output->mode.height,
+						 NULL,
+						 output->mode.width * 4);
+		if (output->image == NULL)
+			goto err_output;
+
+		if (pixman_renderer_output_create(&output->base, 0) < 0)
+			goto err_image;
+
+		pixman_renderer_output_set_buffer(&output->base,
+						  output->image);
+	}
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
 	output->finish_frame_timer =
@@ -126,7 +330,109 @@ headless_compositor_create_output(struct headless_compositor *c,
 	output->base.set_dpms = NULL;
 	output->base.switch_mode = NULL;
 
-	wl_list_insert(c->base.output_list.prev, &output->base.link);
+	return output;
+
+err_image:
+	pixman_image_unref(output->image);
+err_output:
+	weston_output_destroy(&output->base);
+	free(output);
+	return NULL;
+}
+
+static uint32_t
+parse_transform(const char *transform, const char *output_name)
+{
+	static const struct { const char *name; uint32_t token; } names[] = {
+		{ "normal",	WL_OUTPUT_TRANSFORM_NORMAL },
+		{ "90",		WL_OUTPUT_TRANSFORM_90 },
+		{ "180",	WL_OUTPUT_TRANSFORM_180 },
+		{ "270",	WL_OUTPUT_TRANSFORM_270 },
+		{ "flipped",	WL_OUTPUT_TRANSFORM_FLIPPED },
+		{ "flipped-90",	WL_OUTPUT_TRANSFORM_FLIPPED_90 },
+		{ "flipped-180", WL_OUTPUT_TRANSFORM_FLIPPED_180 },
+		{ "flipped-270", WL_OUTPUT_TRANSFORM_FLIPPED_270 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(names); i++)
+		if (strcmp(names[i].name, transform) == 0)
+			return names[i].token;
+
+	weston_log("Invalid transform \"%s\" for output %s\n",
+		   transform, output_name);
+
+	return WL_OUTPUT_TRANSFORM_NORMAL;
+}
+
+/* Outputs come from the [output] sections named headless*, then the
+ * command line fills up to the requested count; they are laid out left
+ * to right. */
+static int
+headless_compositor_create_outputs(struct headless_compositor *c,
+				   struct headless_parameters *param)
+{
+	struct weston_config_section *section;
+	struct headless_output *output;
+	const char *section_name;
+	char *name, *mode, *t;
+	int width, height, scale, x = 0, i, output_count = 0;
+	uint32_t transform;
+
+	section = NULL;
+	while (weston_config_next_section(c->base.config,
+					  &section, &section_name)) {
+		if (strcmp(section_name, "output") != 0)
+			continue;
+		weston_config_section_get_string(section, "name", &name, NULL);
+		if (name == NULL || strncmp(name, "headless", 8) != 0) {
+			free(name);
+			continue;
+		}
+
+		weston_config_section_get_string(section,
+						 "mode", &mode, "1024x640");
+		if (sscanf(mode, "%dx%d", &width, &height) != 2) {
+			weston_log("Invalid mode \"%s\" for output %s\n",
+				   mode, name);
+			width = 1024;
+			height = 640;
+		}
+		free(mode);
+
+		weston_config_section_get_int(section, "scale", &scale, 1);
+		weston_config_section_get_string(section,
+						 "transform", &t, "normal");
+		transform = parse_transform(t, name);
+		free(t);
+
+		output = headless_compositor_create_output(c, x, 0,
+							   width, height,
+							   name, transform,
+							   scale);
+		free(name);
+		if (output == NULL)
+			return -1;
+
+		x = pixman_region32_extents(&output->base.region)->x2;
+
+		output_count++;
+		if (output_count >= param->output_count)
+			break;
+	}
+
+	for (i = output_count; i < param->output_count; i++) {
+		output = headless_compositor_create_output(c, x, 0,
+							   param->width,
+							   param->height,
+							   NULL,
+							   param->transform,
+							   param->scale);
+		if (output == NULL)
+			return -1;
+
+		x = pixman_region32_extents(&output->base.region)->x2;
+	}
 
 	return 0;
 }
@@ -144,16 +450,23 @@ headless_destroy(struct weston_compositor *ec)
 	weston_seat_release(&c->fake_seat);
 	weston_compositor_shutdown(ec);
 
+	if (c->finish_source) {
+		wl_event_source_remove(c->finish_source);
+		close(c->finish_fd);
+	}
+
 	free(ec);
 }
 
 static struct weston_compositor *
 headless_compositor_create(struct wl_display *display,
-			   int width, int height, const char *display_name,
+			   struct headless_parameters *param,
+			   const char *display_name,
 			   int *argc, char *argv[],
 			   struct weston_config *config)
 {
 	struct headless_compositor *c;
+	struct wl_event_loop *loop;
 
 	c = zalloc(sizeof *c);
 	if (c == NULL)
@@ -167,16 +480,43 @@ headless_compositor_create(struct wl_display *display,
 	c->base.destroy = headless_destroy;
 	c->base.restore = headless_restore;
 
-	if (headless_compositor_create_output(c, width, height) < 0)
+	c->clock = param->clock;
+	if (c->clock == HEADLESS_CLOCK_UNCAPPED) {
+		c->finish_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (c->finish_fd < 0)
+			goto err_compositor;
+		loop = wl_display_get_event_loop(c->base.wl_display);
+		c->finish_source = wl_event_loop_add_fd(loop, c->finish_fd,
+							WL_EVENT_READABLE,
+							finish_fd_handler, c);
+		if (c->finish_source == NULL) {
+			close(c->finish_fd);
+			goto err_compositor;
+		}
+	} else if (c->clock == HEADLESS_CLOCK_VIRTUAL) {
+		c->base.advance_clock = headless_advance_clock;
+	}
+
+	c->use_pixman = param->use_pixman;
+	if (c->use_pixman) {
+		if (pixman_renderer_init(&c->base) < 0)
+			goto err_compositor;
+	} else if (noop_renderer_init(&c->base) < 0) {
 		goto err_compositor;
+	}
+	weston_log("Using %s renderer\n", c->use_pixman ? "pixman" : "noop");
 
-	if (noop_renderer_init(&c->base) < 0)
+	if (headless_compositor_create_outputs(c, param) < 0)
 		goto err_compositor;
 
 	return &c->base;
 
 err_compositor:
 	weston_compositor_shutdown(&c->base);
+	if (c->finish_source) {
+		wl_event_source_remove(c->finish_source);
+		close(c->finish_fd);
+	}
 err_free:
 	free(c);
 	return NULL;
@@ -186,17 +526,50 @@ WL_EXPORT struct weston_compositor *
 backend_init(struct wl_display *display, int *argc, char *argv[],
 	     struct weston_config *config)
 {
-	int width = 1024, height = 640;
+	struct headless_parameters param = { 0, };
 	char *display_name = NULL;
+	char *transform = NULL;
+	char *clock = NULL;
 
 	const struct weston_option headless_options[] = {
-		{ WESTON_OPTION_INTEGER, "width", 0, &width },
-		{ WESTON_OPTION_INTEGER, "height", 0, &height },
+		{ WESTON_OPTION_INTEGER, "width", 0, &param.width },
+		{ WESTON_OPTION_INTEGER, "height", 0, &param.height },
+		{ WESTON_OPTION_INTEGER, "scale", 0, &param.scale },
+		{ WESTON_OPTION_STRING, "transform", 0, &transform },
+		{ WESTON_OPTION_INTEGER, "output-count", 0, &param.output_count },
+		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &param.use_pixman },
+		{ WESTON_OPTION_STRING, "clock", 0, &clock },
 	};
 
+	param.width = 1024;
+	param.height = 640;
+	param.scale = 1;
+	param.output_count = 1;
+
 	parse_options(headless_options,
 		      ARRAY_LENGTH(headless_options), argc, argv);
 
-	return headless_compositor_create(display, width, height, display_name,
+	param.transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	if (transform) {
+		param.transform = parse_transform(transform, "headless");
+		free(transform);
+	}
+
+	if (param.scale < 1)
+		param.scale = 1;
+
+	param.clock = HEADLESS_CLOCK_REALTIME;
+	if (clock) {
+		if (strcmp(clock, "uncapped") == 0)
+			param.clock = HEADLESS_CLOCK_UNCAPPED;
+		else if (strcmp(clock, "virtual") == 0)
+			param.clock = HEADLESS_CLOCK_VIRTUAL;
+		else if (strcmp(clock, "realtime") != 0)
+			weston_log("headless: unknown clock \"%s\", "
+				   "using realtime\n", clock);
+		free(clock);
+	}
+
+	return headless_compositor_create(display, &param, display_name,
 					  argc, argv, config);
 }
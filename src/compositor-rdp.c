@@ -25,6 +25,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -49,6 +53,17 @@
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE wl_fixed_from_int(10)
+#define RFX_TILE_SIZE 64
+#define RFX_MAX_FRAMES_IN_FLIGHT 2
+#define RFX_MAX_AUTO_THREADS 4
+
+/* Frames a peer may have unacknowledged before we wait for it, and how
+ * long before a missing acknowledgement is given up on. */
+#define RDP_MAX_UNACKED_FRAMES 2
+#define RDP_ACK_TIMEOUT_MS 1000
+#define RDP_FRAME_HISTORY 8
+#define RDP_MIN_FRAME_INTERVAL 16
+#define RDP_MAX_FRAME_INTERVAL 1000
 
 struct rdp_compositor_config {
 	int width;
@@ -60,6 +75,7 @@ struct rdp_compositor_config {
 	char *server_key;
 	char *extra_modes;
 	int env_socket;
+	int rfx_threads;
 };
 
 struct rdp_output;
@@ -75,6 +91,7 @@ struct rdp_compositor {
 	char *server_key;
 	char *rdp_key;
 	int tls_enabled;
+	int rfx_threads;
 };
 
 enum peer_item_flags {
@@ -82,18 +99,90 @@ enum peer_item_flags {
 	RDP_PEER_OUTPUT_ENABLED = (1 << 1),
 };
 
+struct rdp_frame_record {
+	uint32_t frame_id;
+	uint32_t bytes;
+	uint64_t time_us;
+};
+
 struct rdp_peers_item {
 	int flags;
 	freerdp_peer *peer;
 	struct weston_seat seat;
+	uint32_t rfx_generation;
+	uint32_t rfx_frame_serial;	/* shared frame being encoded for it */
+
+	/* Flow control: damage not sent yet, and what we learned from the
+	 * frame acknowledgements of the peer. */
+	pixman_region32_t damage;
+	uint32_t frame_id;
+	uint32_t acked_frame_id;
+	int acks_seen;
+	uint32_t frame_bytes;
+	uint64_t last_send_us;
+	uint64_t last_ack_us;
+	uint32_t avg_frame_bytes;
+	uint32_t bytes_per_ms;
+	int interval_ms;
+	struct rdp_frame_record history[RDP_FRAME_HISTORY];
+
+	struct wl_list link;
+};
 
+/* A horizontal slice of a frame's damage, encoded as one RFX message. */
+struct rfx_band {
+	pixman_box32_t extents;
+	RFX_RECT *rects;
+	int nrects, rects_alloc;
+	wStream *stream;
+};
+
+struct rfx_frame {
 	struct wl_list link;
+	pixman_image_t *image;
+	int width, height;
+	uint32_t generation;
+	uint32_t serial;
+
+	struct rfx_band *bands;
+	int band_count, band_alloc;
+	int next_band;		/* protected by the encoder mutex */
+	int bands_done;		/* protected by the encoder mutex */
+};
+
+struct rfx_encoder;
+
+struct rfx_worker {
+	struct rfx_encoder *encoder;
+	pthread_t thread;
+	RFX_CONTEXT *rfx_context;
+	uint32_t generation;
+};
+
+struct rfx_encoder {
+	struct rfx_worker *workers;
+	int worker_count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct wl_list queue;		/* newest first */
+	struct wl_list free_list;
+	int in_flight;
+	int finish_pending;
+	uint32_t generation;
+	uint32_t serial;
+	int quit;
+
+	int notify_fd;
+	struct wl_event_source *notify_source;
 };
 
 struct rdp_output {
 	struct weston_output base;
 	struct wl_event_source *finish_frame_timer;
+	struct wl_event_source *flush_timer;
 	pixman_image_t *shadow_surface;
+	struct rfx_encoder *rfx_encoder;
 
 	struct wl_list peers;
 };
@@ -106,7 +195,10 @@ struct rdp_peer_context {
 	RFX_CONTEXT *rfx_context;
 	wStream *encode_stream;
 	RFX_RECT *rfx_rects;
+	int rfx_rects_alloc;
 	NSC_CONTEXT *nsc_context;
+	BYTE *raw_buffer;
+	int raw_buffer_size;
 
 	struct rdp_peers_item item;
 };
@@ -123,6 +215,57 @@ rdp_compositor_config_init(struct rdp_compositor_config *config) {
 	config->server_key = NULL;
 	config->extra_modes = NULL;
 	config->env_socket = 0;
+	config->rfx_threads = -1;
+}
+
+static uint64_t
+rdp_get_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+rdp_peer_begin_frame(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+
+	context->item.frame_bytes = 0;
+
+	marker->frameId = ++context->item.frame_id;
+	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	update->SurfaceFrameMarker(peer->context, marker);
+}
+
+static void
+rdp_peer_end_frame(freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_peers_item *item = &context->item;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+	struct rdp_frame_record *record;
+
+	marker->frameAction = SURFACECMD_FRAMEACTION_END;
+	update->SurfaceFrameMarker(peer->context, marker);
+
+	item->last_send_us = rdp_get_time_us();
+
+	record = &item->history[item->frame_id % RDP_FRAME_HISTORY];
+	record->frame_id = item->frame_id;
+	record->bytes = item->frame_bytes;
+	record->time_us = item->last_send_us;
+
+	if (item->avg_frame_bytes)
+		item->avg_frame_bytes =
+			(item->avg_frame_bytes * 7 + item->frame_bytes) / 8;
+	else
+		item->avg_frame_bytes = item->frame_bytes;
 }
 
 static void
@@ -155,7 +298,13 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
 	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	if (nrects > context->rfx_rects_alloc) {
+		rfxRect = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+		if (!rfxRect)
+			return;
+		context->rfx_rects = rfxRect;
+		context->rfx_rects_alloc = nrects;
+	}
 
 	for (i = 0; i < nrects; i++) {
 		region = &rects[i];
@@ -176,6 +325,7 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	cmd->bitmapData = Stream_Buffer(context->encode_stream);
 
 	update->SurfaceBits(update->context, cmd);
+	context->item.frame_bytes += cmd->bitmapDataLength;
 }
 
 
@@ -212,6 +362,7 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
 	cmd->bitmapData = Stream_Buffer(context->encode_stream);
 	update->SurfaceBits(update->context, cmd);
+	context->item.frame_bytes += cmd->bitmapDataLength;
 }
 
 static void
@@ -232,19 +383,16 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	pixman_box32_t *rect, subrect;
-	int nrects, i;
+	int nrects, i, size;
 	int heightIncrement, remainingHeight, top;
+	BYTE *buffer;
 
 	rect = pixman_region32_rectangles(region, &nrects);
 	if (!nrects)
 		return;
 
-	marker->frameId++;
-	marker->frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, marker);
-
 	cmd->bpp = 32;
 	cmd->codecID = 0;
 
@@ -261,12 +409,23 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 		subrect.x1 = rect->x1;
 		subrect.x2 = rect->x2;
 
+		/* one buffer for all the strips, kept across frames */
+		size = cmd->width * 4 * ((remainingHeight > heightIncrement) ?
+					 heightIncrement : remainingHeight);
+		if (size > context->raw_buffer_size) {
+			buffer = realloc(context->raw_buffer, size);
+			if (!buffer)
+				break;
+			context->raw_buffer = buffer;
+			context->raw_buffer_size = size;
+		}
+		cmd->bitmapData = context->raw_buffer;
+
 		while (remainingHeight) {
 			   cmd->height = (remainingHeight > heightIncrement) ? heightIncrement : remainingHeight;
 			   cmd->destTop = top;
 			   cmd->destBottom = top + cmd->height;
 			   cmd->bitmapDataLength = cmd->width * cmd->height * 4;
-			   cmd->bitmapData = (BYTE *)realloc(cmd->bitmapData, cmd->bitmapDataLength);
 
 			   subrect.y1 = top;
 			   subrect.y2 = top + cmd->height;
@@ -274,14 +433,15 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 
 			   /*weston_log("*  sending (%d,%d, %d,%d)\n", subrect.x1, subrect.y1, subrect.x2, subrect.y2); */
 			   update->SurfaceBits(peer->context, cmd);
+			   context->item.frame_bytes += cmd->bitmapDataLength;
 
 			   remainingHeight -= cmd->height;
 			   top += cmd->height;
 		}
 	}
 
-	marker->frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, marker);
+	/* the buffer is ours, don't let FreeRDP free it */
+	cmd->bitmapData = NULL;
 }
 
 static void
@@ -291,12 +451,16 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 	struct rdp_output *output = context->rdpCompositor->output;
 	rdpSettings *settings = peer->settings;
 
+	rdp_peer_begin_frame(peer);
+
 	if (settings->RemoteFxCodec)
 		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
 	else if (settings->NSCodec)
 		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
 	else
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+
+	rdp_peer_end_frame(peer);
 }
 
 static void
@@ -310,6 +474,657 @@ rdp_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, msec);
 }
 
+/* RemoteFX frames for all peers using the codec are encoded once, on a
+ * pool of threads.  The compositor thread copies the damaged part of
+ * the shadow surface into the frame, splits the damage into bands of
+ * tile rows and goes on; each worker encodes whole bands with its own
+ * RFX context.  Finished frames are sent to the peers from the
+ * compositor thread, in order. */
+
+static void
+rfx_band_set_rects(struct rfx_band *band, pixman_region32_t *region)
+{
+	pixman_box32_t *rects, *extents;
+	RFX_RECT *rfxRect;
+	int i, nrects;
+
+	extents = pixman_region32_extents(region);
+	band->extents = *extents;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	if (nrects > band->rects_alloc) {
+		rfxRect = realloc(band->rects, nrects * sizeof *rfxRect);
+		if (!rfxRect) {
+			band->nrects = 0;
+			return;
+		}
+		band->rects = rfxRect;
+		band->rects_alloc = nrects;
+	}
+
+	for (i = 0; i < nrects; i++) {
+		rfxRect = &band->rects[i];
+		rfxRect->x = rects[i].x1 - extents->x1;
+		rfxRect->y = rects[i].y1 - extents->y1;
+		rfxRect->width = rects[i].x2 - rects[i].x1;
+		rfxRect->height = rects[i].y2 - rects[i].y1;
+	}
+	band->nrects = nrects;
+}
+
+static void
+rfx_encode_band(RFX_CONTEXT *rfx_context, struct rfx_frame *frame,
+		struct rfx_band *band)
+{
+	int stride = pixman_image_get_stride(frame->image);
+	uint32_t *ptr;
+
+	ptr = pixman_image_get_data(frame->image) + band->extents.x1 +
+		band->extents.y1 * (stride / sizeof(uint32_t));
+
+	Stream_Clear(band->stream);
+	Stream_SetPosition(band->stream, 0);
+	rfx_compose_message(rfx_context, band->stream, band->rects,
+			    band->nrects, (BYTE *)ptr,
+			    band->extents.x2 - band->extents.x1,
+			    band->extents.y2 - band->extents.y1,
+			    stride);
+}
+
+static void *
+rfx_encoder_worker(void *data)
+{
+	struct rfx_worker *worker = data;
+	struct rfx_encoder *encoder = worker->encoder;
+	struct rfx_frame *frame, *found;
+	struct rfx_band *band;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&encoder->mutex);
+	for (;;) {
+		found = NULL;
+		wl_list_for_each_reverse(frame, &encoder->queue, link) {
+			if (frame->next_band < frame->band_count) {
+				found = frame;
+				break;
+			}
+		}
+
+		if (!found) {
+			if (encoder->quit)
+				break;
+			pthread_cond_wait(&encoder->cond, &encoder->mutex);
+			continue;
+		}
+
+		frame = found;
+		band = &frame->bands[frame->next_band++];
+		pthread_mutex_unlock(&encoder->mutex);
+
+		/* A new generation starts with the codec headers again,
+		 * for peers that (re)activated in the meantime. */
+		if (worker->generation != frame->generation) {
+			worker->rfx_context->width = frame->width;
+			worker->rfx_context->height = frame->height;
+			rfx_context_reset(worker->rfx_context);
+			worker->generation = frame->generation;
+		}
+
+		rfx_encode_band(worker->rfx_context, frame, band);
+
+		pthread_mutex_lock(&encoder->mutex);
+		if (++frame->bands_done == frame->band_count)
+			if (write(encoder->notify_fd, &one, sizeof one) < 0)
+				weston_log("rfx encoder: failed to notify\n");
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+static struct rfx_frame *
+rfx_encoder_get_frame(struct rfx_encoder *encoder, int width, int height)
+{
+	struct rfx_frame *frame;
+
+	if (!wl_list_empty(&encoder->free_list)) {
+		frame = container_of(encoder->free_list.next,
+				     struct rfx_frame, link);
+		wl_list_remove(&frame->link);
+	} else {
+		frame = zalloc(sizeof *frame);
+		if (!frame)
+			return NULL;
+	}
+
+	if (frame->image && (frame->width != width ||
+			     frame->height != height)) {
+		pixman_image_unref(frame->image);
+		frame->image = NULL;
+	}
+
+	if (!frame->image) {
+		frame->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+							width, height,
+							NULL, width * 4);
+		if (!frame->image) {
+			wl_list_insert(&encoder->free_list, &frame->link);
+			return NULL;
+		}
+		frame->width = width;
+		frame->height = height;
+	}
+
+	return frame;
+}
+
+static struct rfx_band *
+rfx_frame_add_band(struct rfx_frame *frame)
+{
+	struct rfx_band *bands, *band;
+	int alloc;
+
+	if (frame->band_count == frame->band_alloc) {
+		alloc = frame->band_alloc ? frame->band_alloc * 2 : 8;
+		bands = realloc(frame->bands, alloc * sizeof *bands);
+		if (!bands)
+			return NULL;
+		memset(bands + frame->band_alloc, 0,
+		       (alloc - frame->band_alloc) * sizeof *bands);
+		frame->bands = bands;
+		frame->band_alloc = alloc;
+	}
+
+	band = &frame->bands[frame->band_count];
+	if (!band->stream) {
+		band->stream = Stream_New(NULL, 65536);
+		if (!band->stream)
+			return NULL;
+	}
+	frame->band_count++;
+
+	return band;
+}
+
+/* Hand the damaged part of the shadow surface to the encoder.  Only the
+ * copy and the band split happen on the compositor thread.  Returns the
+ * serial of the queued frame, 0 if nothing was queued. */
+static uint32_t
+rfx_encoder_submit(struct rfx_encoder *encoder, pixman_region32_t *damage,
+		   pixman_image_t *shadow)
+{
+	struct rfx_frame *frame;
+	struct rfx_band *band;
+	pixman_box32_t *rects, *extents;
+	pixman_region32_t region;
+	int i, nrects, y, band_height;
+
+	rects = pixman_region32_rectangles(damage, &nrects);
+	if (nrects == 0)
+		return 0;
+
+	frame = rfx_encoder_get_frame(encoder,
+				      pixman_image_get_width(shadow),
+				      pixman_image_get_height(shadow));
+	if (!frame)
+		return 0;
+
+	for (i = 0; i < nrects; i++)
+		pixman_image_composite32(PIXMAN_OP_SRC, shadow, NULL,
+					 frame->image,
+					 rects[i].x1, rects[i].y1, 0, 0,
+					 rects[i].x1, rects[i].y1,
+					 rects[i].x2 - rects[i].x1,
+					 rects[i].y2 - rects[i].y1);
+
+	/* A couple of bands per worker, in whole tile rows. */
+	extents = pixman_region32_extents(damage);
+	band_height = (extents->y2 - extents->y1) /
+		(encoder->worker_count * 2);
+	band_height = (band_height + RFX_TILE_SIZE - 1) & ~(RFX_TILE_SIZE - 1);
+	if (band_height < RFX_TILE_SIZE)
+		band_height = RFX_TILE_SIZE;
+
+	frame->band_count = 0;
+	pixman_region32_init(&region);
+	for (y = extents->y1; y < extents->y2; y += band_height) {
+		pixman_region32_intersect_rect(&region, damage,
+					       extents->x1, y,
+					       extents->x2 - extents->x1,
+					       band_height);
+		if (!pixman_region32_not_empty(&region))
+			continue;
+
+		band = rfx_frame_add_band(frame);
+		if (!band)
+			break;
+		rfx_band_set_rects(band, &region);
+		if (band->nrects == 0)
+			frame->band_count--;
+	}
+	pixman_region32_fini(&region);
+
+	if (frame->band_count == 0) {
+		wl_list_insert(&encoder->free_list, &frame->link);
+		return 0;
+	}
+
+	frame->next_band = 0;
+	frame->bands_done = 0;
+
+	if (++encoder->serial == 0)
+		encoder->serial = 1;
+	frame->serial = encoder->serial;
+
+	pthread_mutex_lock(&encoder->mutex);
+	frame->generation = encoder->generation;
+	wl_list_insert(&encoder->queue, &frame->link);
+	encoder->in_flight++;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return frame->serial;
+}
+
+static void
+rfx_frame_send(struct rfx_frame *frame, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
+	struct rfx_band *band;
+	int i;
+
+	rdp_peer_begin_frame(peer);
+
+	for (i = 0; i < frame->band_count; i++) {
+		band = &frame->bands[i];
+
+		cmd->destLeft = band->extents.x1;
+		cmd->destTop = band->extents.y1;
+		cmd->destRight = band->extents.x2;
+		cmd->destBottom = band->extents.y2;
+		cmd->bpp = 32;
+		cmd->codecID = peer->settings->RemoteFxCodecId;
+		cmd->width = band->extents.x2 - band->extents.x1;
+		cmd->height = band->extents.y2 - band->extents.y1;
+		cmd->bitmapDataLength = Stream_GetPosition(band->stream);
+		cmd->bitmapData = Stream_Buffer(band->stream);
+
+		update->SurfaceBits(update->context, cmd);
+		context->item.frame_bytes += cmd->bitmapDataLength;
+	}
+
+	rdp_peer_end_frame(peer);
+}
+
+static int
+rdp_peer_wants_output(struct rdp_peers_item *item)
+{
+	return (item->flags & RDP_PEER_ACTIVATED) &&
+		(item->flags & RDP_PEER_OUTPUT_ENABLED);
+}
+
+static int
+rdp_peer_uses_shared_rfx(struct rdp_output *output,
+			 struct rdp_peers_item *item)
+{
+	return output->rfx_encoder && item->peer->settings->RemoteFxCodec;
+}
+
+/* Estimate the throughput to the peer from the rate its frames get
+ * acknowledged, and space the frames so an average one can get through
+ * before the next. */
+static void
+rdp_peer_frame_acked(struct rdp_peers_item *item, uint32_t frame_id)
+{
+	struct rdp_frame_record *record;
+	uint64_t now, start;
+	uint32_t rate;
+
+	now = rdp_get_time_us();
+	item->acks_seen = 1;
+	if ((int32_t)(frame_id - item->acked_frame_id) > 0)
+		item->acked_frame_id = frame_id;
+
+	record = &item->history[frame_id % RDP_FRAME_HISTORY];
+	if (record->frame_id != frame_id || record->bytes == 0) {
+		item->last_ack_us = now;
+		return;
+	}
+
+	/* The peer was still busy with the previous frame until its ack
+	 * came in, don't count that time against this one. */
+	start = record->time_us;
+	if (item->last_ack_us > start)
+		start = item->last_ack_us;
+	item->last_ack_us = now;
+
+	rate = (uint64_t)record->bytes * 1000 / (now - start + 1);
+	record->bytes = 0;
+	if (rate == 0)
+		rate = 1;
+
+	if (item->bytes_per_ms)
+		item->bytes_per_ms = (item->bytes_per_ms * 7 + rate) / 8;
+	else
+		item->bytes_per_ms = rate;
+
+	item->interval_ms = item->avg_frame_bytes / item->bytes_per_ms;
+	if (item->interval_ms < RDP_MIN_FRAME_INTERVAL)
+		item->interval_ms = RDP_MIN_FRAME_INTERVAL;
+	else if (item->interval_ms > RDP_MAX_FRAME_INTERVAL)
+		item->interval_ms = RDP_MAX_FRAME_INTERVAL;
+}
+
+/* How long before the peer can take another frame: 0 when it can now,
+ * -1 when something else than time has to happen first. */
+static int
+rdp_peer_wait_ms(struct rdp_peers_item *item, uint64_t now)
+{
+	uint64_t next;
+
+	if (!rdp_peer_wants_output(item) || item->rfx_frame_serial)
+		return -1;
+
+	/* Peers that never acknowledge frames only get the rate limit. */
+	if (item->acks_seen &&
+	    item->frame_id - item->acked_frame_id >= RDP_MAX_UNACKED_FRAMES) {
+		next = item->last_send_us + RDP_ACK_TIMEOUT_MS * 1000;
+		if (now < next)
+			return (next - now + 999) / 1000;
+		item->acked_frame_id = item->frame_id;
+	}
+
+	next = item->last_send_us + item->interval_ms * 1000;
+	if (now >= next)
+		return 0;
+
+	return (next - now + 999) / 1000;
+}
+
+/* Send their pending damage to the peers ready for a frame.  RemoteFX
+ * peers ready at the same time share one encoding of the union of their
+ * damage. */
+static void
+rdp_output_flush(struct rdp_output *output)
+{
+	struct rdp_peers_item *item;
+	pixman_region32_t shared;
+	uint64_t now;
+	uint32_t serial = 0;
+	int wait, next_wait = -1;
+
+	now = rdp_get_time_us();
+	pixman_region32_init(&shared);
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!pixman_region32_not_empty(&item->damage))
+			continue;
+
+		wait = rdp_peer_wait_ms(item, now);
+		if (wait > 0 && (next_wait < 0 || wait < next_wait))
+			next_wait = wait;
+		if (wait != 0)
+			continue;
+
+		if (rdp_peer_uses_shared_rfx(output, item))
+			pixman_region32_union(&shared, &shared, &item->damage);
+	}
+
+	if (pixman_region32_not_empty(&shared))
+		serial = rfx_encoder_submit(output->rfx_encoder, &shared,
+					    output->shadow_surface);
+	pixman_region32_fini(&shared);
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!pixman_region32_not_empty(&item->damage) ||
+		    rdp_peer_wait_ms(item, now) != 0)
+			continue;
+
+		if (serial && rdp_peer_uses_shared_rfx(output, item))
+			item->rfx_frame_serial = serial;
+		else
+			rdp_peer_refresh_region(&item->damage, item->peer);
+
+		pixman_region32_clear(&item->damage);
+	}
+
+	if (next_wait > 0)
+		wl_event_source_timer_update(output->flush_timer, next_wait);
+}
+
+static int
+flush_timer_handler(void *data)
+{
+	rdp_output_flush(data);
+
+	return 1;
+}
+
+/* The output repaints as fast as the fastest peer takes frames. */
+static int
+rdp_output_frame_interval(struct rdp_output *output)
+{
+	struct rdp_peers_item *item;
+	int interval = -1;
+
+	wl_list_for_each(item, &output->peers, link) {
+		if (!rdp_peer_wants_output(item))
+			continue;
+		if (interval < 0 || item->interval_ms < interval)
+			interval = item->interval_ms;
+	}
+
+	if (interval < RDP_MIN_FRAME_INTERVAL)
+		interval = RDP_MIN_FRAME_INTERVAL;
+
+	return interval;
+}
+
+static void
+rdp_peer_damage_all(struct rdp_peers_item *item, struct rdp_output *output)
+{
+	pixman_region32_union_rect(&item->damage, &item->damage, 0, 0,
+				   output->base.width, output->base.height);
+}
+
+/* Send the frames that finished encoding, oldest first. */
+static int
+rfx_encoder_notify(int fd, uint32_t mask, void *data)
+{
+	struct rdp_output *output = data;
+	struct rfx_encoder *encoder = output->rfx_encoder;
+	struct rdp_peers_item *item;
+	struct rfx_frame *frame;
+	uint64_t count;
+	int resume;
+
+	if (read(fd, &count, sizeof count) < 0 && errno != EAGAIN)
+		weston_log("rfx encoder: failed to read notification\n");
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (!wl_list_empty(&encoder->queue)) {
+		frame = container_of(encoder->queue.prev,
+				     struct rfx_frame, link);
+		if (frame->bands_done < frame->band_count)
+			break;
+
+		wl_list_remove(&frame->link);
+		pthread_mutex_unlock(&encoder->mutex);
+
+		wl_list_for_each(item, &output->peers, link) {
+			if (item->rfx_frame_serial != frame->serial)
+				continue;
+
+			item->rfx_frame_serial = 0;
+			if (rdp_peer_wants_output(item) &&
+			    frame->generation >= item->rfx_generation)
+				rfx_frame_send(frame, item->peer);
+		}
+
+		pthread_mutex_lock(&encoder->mutex);
+		wl_list_insert(&encoder->free_list, &frame->link);
+		encoder->in_flight--;
+	}
+	resume = encoder->finish_pending &&
+		encoder->in_flight < RFX_MAX_FRAMES_IN_FLIGHT;
+	if (resume)
+		encoder->finish_pending = 0;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	/* peers without acknowledgements may be ready again */
+	rdp_output_flush(output);
+
+	if (resume)
+		rdp_output_start_repaint_loop(&output->base);
+
+	return 0;
+}
+
+/* Make the next frames start over with codec headers and the current
+ * output size.  Returns the generation those frames will carry. */
+static uint32_t
+rfx_encoder_reset(struct rfx_encoder *encoder)
+{
+	uint32_t generation;
+
+	pthread_mutex_lock(&encoder->mutex);
+	generation = ++encoder->generation;
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return generation;
+}
+
+static void
+rfx_frame_free(struct rfx_frame *frame)
+{
+	int i;
+
+	for (i = 0; i < frame->band_alloc; i++) {
+		if (frame->bands[i].stream)
+			Stream_Free(frame->bands[i].stream, TRUE);
+		free(frame->bands[i].rects);
+	}
+	free(frame->bands);
+	if (frame->image)
+		pixman_image_unref(frame->image);
+	free(frame);
+}
+
+static void
+rfx_encoder_destroy(struct rfx_encoder *encoder)
+{
+	struct rfx_frame *frame, *next;
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->quit = 1;
+	pthread_cond_broadcast(&encoder->cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->worker_count; i++)
+		pthread_join(encoder->workers[i].thread, NULL);
+	for (i = 0; i < encoder->worker_count; i++)
+		rfx_context_free(encoder->workers[i].rfx_context);
+
+	wl_list_for_each_safe(frame, next, &encoder->queue, link)
+		rfx_frame_free(frame);
+	wl_list_for_each_safe(frame, next, &encoder->free_list, link)
+		rfx_frame_free(frame);
+
+	if (encoder->notify_source)
+		wl_event_source_remove(encoder->notify_source);
+	close(encoder->notify_fd);
+	pthread_cond_destroy(&encoder->cond);
+	pthread_mutex_destroy(&encoder->mutex);
+	free(encoder->workers);
+	free(encoder);
+}
+
+static RFX_CONTEXT *
+rdp_rfx_context_new(int width, int height)
+{
+	RFX_CONTEXT *rfx_context;
+
+#if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
+	rfx_context = rfx_context_new();
+#else
+	rfx_context = rfx_context_new(TRUE);
+#endif
+	if (!rfx_context)
+		return NULL;
+
+	rfx_context->mode = RLGR3;
+	rfx_context->width = width;
+	rfx_context->height = height;
+	rfx_context_set_pixel_format(rfx_context, RDP_PIXEL_FORMAT_B8G8R8A8);
+
+	return rfx_context;
+}
+
+static struct rfx_encoder *
+rfx_encoder_create(struct rdp_output *output, int thread_count)
+{
+	struct rfx_encoder *encoder;
+	struct rfx_worker *worker;
+	struct wl_event_loop *loop;
+
+	encoder = zalloc(sizeof *encoder);
+	if (!encoder)
+		return NULL;
+
+	encoder->workers = calloc(thread_count, sizeof *encoder->workers);
+	encoder->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (!encoder->workers || encoder->notify_fd < 0) {
+		if (encoder->notify_fd >= 0)
+			close(encoder->notify_fd);
+		free(encoder->workers);
+		free(encoder);
+		return NULL;
+	}
+
+	wl_list_init(&encoder->queue);
+	wl_list_init(&encoder->free_list);
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->cond, NULL);
+
+	loop = wl_display_get_event_loop(output->base.compositor->wl_display);
+	encoder->notify_source =
+		wl_event_loop_add_fd(loop, encoder->notify_fd,
+				     WL_EVENT_READABLE,
+				     rfx_encoder_notify, output);
+	if (!encoder->notify_source) {
+		rfx_encoder_destroy(encoder);
+		return NULL;
+	}
+
+	for (encoder->worker_count = 0;
+	     encoder->worker_count < thread_count;
+	     encoder->worker_count++) {
+		worker = &encoder->workers[encoder->worker_count];
+		worker->encoder = encoder;
+		worker->rfx_context =
+			rdp_rfx_context_new(output->base.width,
+					    output->base.height);
+		if (!worker->rfx_context)
+			break;
+
+		if (pthread_create(&worker->thread, NULL,
+				   rfx_encoder_worker, worker) != 0) {
+			rfx_context_free(worker->rfx_context);
+			break;
+		}
+	}
+
+	if (encoder->worker_count == 0) {
+		rfx_encoder_destroy(encoder);
+		return NULL;
+	}
+
+	return encoder;
+}
+
 static int
 rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 {
@@ -320,18 +1135,21 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage)
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
+	/* Peers get the damage once ready for it, in as few frames as
+	 * their link allows. */
 	wl_list_for_each(outputPeer, &output->peers, link) {
-		if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-				(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-		{
-			rdp_peer_refresh_region(damage, outputPeer->peer);
-		}
+		if (rdp_peer_wants_output(outputPeer))
+			pixman_region32_union(&outputPeer->damage,
+					      &outputPeer->damage, damage);
 	}
 
+	rdp_output_flush(output);
+
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	wl_event_source_timer_update(output->finish_frame_timer,
+				     rdp_output_frame_interval(output));
 	return 0;
 }
 
@@ -340,6 +1158,9 @@ rdp_output_destroy(struct weston_output *output_base)
 {
 	struct rdp_output *output = (struct rdp_output *)output_base;
 
+	if (output->rfx_encoder)
+		rfx_encoder_destroy(output->rfx_encoder);
+	wl_event_source_remove(output->flush_timer);
 	wl_event_source_remove(output->finish_frame_timer);
 	free(output);
 }
@@ -347,7 +1168,22 @@ rdp_output_destroy(struct weston_output *output_base)
 static int
 finish_frame_handler(void *data)
 {
-	rdp_output_start_repaint_loop(data);
+	struct rdp_output *output = data;
+	struct rfx_encoder *encoder = output->rfx_encoder;
+
+	/* Don't let the encoder fall behind; the frame finishes once it
+	 * caught up instead. */
+	if (encoder) {
+		pthread_mutex_lock(&encoder->mutex);
+		if (encoder->in_flight >= RFX_MAX_FRAMES_IN_FLIGHT) {
+			encoder->finish_pending = 1;
+			pthread_mutex_unlock(&encoder->mutex);
+			return 1;
+		}
+		pthread_mutex_unlock(&encoder->mutex);
+	}
+
+	rdp_output_start_repaint_loop(&output->base);
 
 	return 1;
 }
@@ -387,7 +1223,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
 	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output);
+	pixman_renderer_output_create(output, 0);
 
 	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
 			target_mode->height, 0, target_mode->width * 4);
@@ -396,7 +1232,13 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode) {
 	pixman_image_unref(rdpOutput->shadow_surface);
 	rdpOutput->shadow_surface = new_shadow_buffer;
 
+	if (rdpOutput->rfx_encoder)
+		rfx_encoder_reset(rdpOutput->rfx_encoder);
+
 	wl_list_for_each(rdpPeer, &rdpOutput->peers, link) {
+		/* the peer gets a full refresh once reactivated */
+		pixman_region32_clear(&rdpPeer->damage);
+
 		settings = rdpPeer->peer->settings;
 		if(!settings->DesktopResize) {
 			/* too bad this peer does not support desktop resize */
@@ -491,11 +1333,22 @@ rdp_compositor_create_output(struct rdp_compositor *c, int width, int height,
 		goto out_output;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base, 0) < 0)
 		goto out_shadow_surface;
 
 	loop = wl_display_get_event_loop(c->base.wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
+	output->flush_timer = wl_event_loop_add_timer(loop, flush_timer_handler, output);
+
+	if (c->rfx_threads > 0) {
+		output->rfx_encoder = rfx_encoder_create(output, c->rfx_threads);
+		if (output->rfx_encoder)
+			weston_log("RemoteFX encoding on %d threads\n",
+				   output->rfx_encoder->worker_count);
+		else
+			weston_log("failed to start RemoteFX encoder threads, "
+				   "encoding per peer\n");
+	}
 
 	output->base.start_repaint_loop = rdp_output_start_repaint_loop;
 	output->base.repaint = rdp_output_repaint;
@@ -578,6 +1431,8 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 {
 	context->item.peer = client;
 	context->item.flags = RDP_PEER_OUTPUT_ENABLED;
+	context->item.interval_ms = RDP_MIN_FRAME_INTERVAL;
+	pixman_region32_init(&context->item.damage);
 
 #if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
 	context->rfx_context = rfx_context_new();
@@ -617,6 +1472,8 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
 	free(context->rfx_rects);
+	free(context->raw_buffer);
+	pixman_region32_fini(&context->item.damage);
 }
 
 
@@ -683,8 +1540,6 @@ xf_peer_post_connect(freerdp_peer* client)
 	struct xkb_rule_names xkbRuleNames;
 	struct xkb_keymap *keymap;
 	int i;
-	pixman_box32_t box;
-	pixman_region32_t damage;
 
 
 	peerCtx = (RdpPeerContext *)client->context;
@@ -749,15 +1604,8 @@ xf_peer_post_connect(freerdp_peer* client)
 	pointer->PointerSystem(client->context, &pointer->pointer_system);
 
 	/* sends a full refresh */
-	box.x1 = 0;
-	box.y1 = 0;
-	box.x2 = output->base.width;
-	box.y2 = output->base.height;
-	pixman_region32_init_with_extents(&damage, &box);
-
-	rdp_peer_refresh_region(&damage, client);
-
-	pixman_region32_fini(&damage);
+	rdp_peer_damage_all(&peerCtx->item, output);
+	rdp_output_flush(output);
 
 	return TRUE;
 }
@@ -766,7 +1614,18 @@ static BOOL
 xf_peer_activate(freerdp_peer *client)
 {
 	RdpPeerContext *context = (RdpPeerContext *)client->context;
+	struct rdp_output *output = context->rdpCompositor->output;
+
 	rfx_context_reset(context->rfx_context);
+
+	/* Start this peer on fresh codec state with a full frame. */
+	if (output->rfx_encoder)
+		context->item.rfx_generation =
+			rfx_encoder_reset(output->rfx_encoder);
+	context->item.rfx_frame_serial = 0;
+	rdp_peer_damage_all(&context->item, output);
+	rdp_output_flush(output);
+
 	return TRUE;
 }
 
@@ -836,22 +1695,12 @@ xf_extendedMouseEvent(rdpInput *input, UINT16 flags, UINT16 x, UINT16 y) {
 static void
 xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 {
-	freerdp_peer *client = input->context->peer;
 	RdpPeerContext *peerCtx = (RdpPeerContext *)input->context;
 	struct rdp_output *output = peerCtx->rdpCompositor->output;
-	pixman_box32_t box;
-	pixman_region32_t damage;
 
 	/* sends a full refresh */
-	box.x1 = 0;
-	box.y1 = 0;
-	box.x2 = output->base.width;
-	box.y2 = output->base.height;
-	pixman_region32_init_with_extents(&damage, &box);
-
-	rdp_peer_refresh_region(&damage, client);
-
-	pixman_region32_fini(&damage);
+	rdp_peer_damage_all(&peerCtx->item, output);
+	rdp_output_flush(output);
 }
 
 extern DWORD KEYCODE_TO_VKCODE_EVDEV[];
@@ -912,10 +1761,33 @@ xf_input_unicode_keyboard_event(rdpInput *input, UINT16 flags, UINT16 code)
 static void
 xf_suppress_output(rdpContext *context, BYTE allow, RECTANGLE_16 *area) {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
-	if(allow)
+	struct rdp_output *output = peerContext->rdpCompositor->output;
+
+	if(allow) {
+		/* nothing was kept for it while suppressed */
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
-	else
+		rdp_peer_damage_all(&peerContext->item, output);
+		rdp_output_flush(output);
+	} else {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+		pixman_region32_clear(&peerContext->item.damage);
+	}
+}
+
+#if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
+static void
+#else
+static BOOL
+#endif
+xf_peer_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+
+	rdp_peer_frame_acked(&peerContext->item, frameId);
+	rdp_output_flush(peerContext->rdpCompositor->output);
+#if !(FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1)
+	return TRUE;
+#endif
 }
 
 static int
@@ -954,6 +1826,7 @@ rdp_peer_init(freerdp_peer *client, struct rdp_compositor *c)
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = xf_suppress_output;
+	client->update->SurfaceFrameAcknowledge = xf_peer_frame_acknowledge;
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1017,6 +1890,13 @@ rdp_compositor_create(struct wl_display *display,
 	c->base.restore = rdp_restore;
 	c->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 
+	c->rfx_threads = config->rfx_threads;
+	if (c->rfx_threads < 0) {
+		c->rfx_threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (c->rfx_threads > RFX_MAX_AUTO_THREADS)
+			c->rfx_threads = RFX_MAX_AUTO_THREADS;
+	}
+
 	/* activate TLS only if certificate/key are available */
 	if(config->server_cert && config->server_key) {
 		weston_log("TLS support activated\n");
@@ -1098,7 +1978,8 @@ backend_init(struct wl_display *display, int *argc, char *argv[],
 		{ WESTON_OPTION_INTEGER, "port", 0, &config.port },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
-		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
+		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key },
+		{ WESTON_OPTION_INTEGER, "rfx-threads", 0, &config.rfx_threads }
 	};
 
 	parse_options(rdp_options, ARRAY_LENGTH(rdp_options), argc, argv);
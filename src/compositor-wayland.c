@@ -640,7 +640,11 @@ cleanup_window:
 static int
 wayland_output_init_pixman_renderer(struct wayland_output *output)
 {
-	return pixman_renderer_output_create(&output->base);
+	/* The shm buffers are a8r8g8b8 for the decorations, rendering
+	 * straight into them would leave the output translucent in the
+	 * parent compositor.  The x8r8g8b8 shadow keeps it opaque. */
+	return pixman_renderer_output_create(&output->base,
+					     PIXMAN_RENDERER_OUTPUT_USE_SHADOW);
 }
 
 static void
@@ -762,6 +762,7 @@ x11_compositor_create_output(struct x11_compositor *c, int x, int y,
 	struct wl_event_loop *loop;
 	int output_width, output_height;
 	int ret;
+	uint32_t flags;
 	uint32_t mask = XCB_CW_EVENT_MASK | XCB_CW_CURSOR;
 	xcb_atom_t atom_list[1];
 	uint32_t values[2] = {
@@ -883,7 +884,14 @@ x11_compositor_create_output(struct x11_compositor *c, int x, int y,
 					output->mode.width,
 					output->mode.height) < 0)
 			return NULL;
-		if (pixman_renderer_output_create(&output->base) < 0) {
+		/* Blend at 32 bpp whatever the visual, into the window's
+		 * image only when it is x8r8g8b8 itself. */
+		if (pixman_image_get_format(output->hw_surface) ==
+		    PIXMAN_x8r8g8b8)
+			flags = 0;
+		else
+			flags = PIXMAN_RENDERER_OUTPUT_USE_SHADOW;
+		if (pixman_renderer_output_create(&output->base, flags) < 0) {
 			x11_output_deinit_shm(c, output);
 			return NULL;
 		}
@@ -381,6 +381,8 @@ weston_view_create(struct weston_surface *surface)
 
 	view->output = NULL;
 
+	wl_list_init(&view->pick_index.link);
+
 	return view;
 }
 
@@ -983,6 +985,8 @@ weston_view_update_transform(struct weston_view *view)
 
 	weston_view_assign_output(view);
 
+	weston_view_index_update(&view->surface->compositor->view_index, view);
+
 	wl_signal_emit(&view->surface->compositor->transform_signal,
 		       view->surface);
 }
@@ -1227,14 +1231,17 @@ weston_surface_set_size_from_buffer(struct weston_surface *surface)
 	surface_set_size(surface, width, height);
 }
 
+/* Input event times in milliseconds.  On CLOCK_MONOTONIC, like the
+ * evdev devices report them, so that synthesized events compare with
+ * the ones from the kernel. */
 WL_EXPORT uint32_t
 weston_compositor_get_time(void)
 {
-       struct timeval tv;
+       struct timespec ts;
 
-       gettimeofday(&tv, NULL);
+       clock_gettime(CLOCK_MONOTONIC, &ts);
 
-       return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+       return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 WL_EXPORT struct weston_view *
@@ -1242,18 +1249,8 @@ weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
-
-	wl_list_for_each(view, &compositor->view_list, link) {
-		weston_view_from_global_fixed(view, x, y, vx, vy);
-		if (pixman_region32_contains_point(&view->surface->input,
-						   wl_fixed_to_int(*vx),
-						   wl_fixed_to_int(*vy),
-						   NULL))
-			return view;
-	}
-
-	return NULL;
+	return weston_view_index_pick(&compositor->view_index,
+				      x, y, vx, vy);
 }
 
 static void
@@ -1283,6 +1280,8 @@ weston_view_unmap(struct weston_view *view)
 	wl_list_init(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	weston_view_index_remove(&view->surface->compositor->view_index, view);
+	weston_compositor_view_list_dirty(view->surface->compositor);
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1327,10 +1326,13 @@ weston_view_destroy(struct weston_view *view)
 	if (weston_view_is_mapped(view)) {
 		weston_view_unmap(view);
 		weston_compositor_build_view_list(view->surface->compositor);
+	} else {
+		weston_compositor_view_list_dirty(view->surface->compositor);
 	}
 
 	wl_list_remove(&view->link);
 	wl_list_remove(&view->layer_link);
+	weston_view_index_remove(&view->surface->compositor->view_index, view);
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->transform.boundingbox);
@@ -1543,8 +1545,23 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/* Surface damage is consumed once every view of the surface has added it
+ * to its plane, so the damage pass works per surface: a surface shown on
+ * the output being repainted is handled with all its views, the others
+ * keep their damage until their own outputs repaint.  Surfaces on no
+ * output are always flushed so their buffers are still released early.
+ */
+static int
+surface_on_output(struct weston_surface *surface,
+		  struct weston_output *output)
+{
+	return surface->output_mask == 0 ||
+	       (surface->output_mask & (1 << output->id));
+}
+
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+compositor_accumulate_damage(struct weston_compositor *ec,
+			     struct weston_output *output)
 {
 	struct weston_plane *plane;
 	struct weston_view *ev;
@@ -1561,6 +1578,9 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 			if (ev->plane != plane)
 				continue;
 
+			if (!surface_on_output(ev->surface, output))
+				continue;
+
 			view_accumulate_damage(ev, &opaque);
 		}
 
@@ -1576,6 +1596,8 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 	wl_list_for_each(ev, &ec->view_list, link) {
 		if (ev->surface->touched)
 			continue;
+		if (!surface_on_output(ev->surface, output))
+			continue;
 		ev->surface->touched = 1;
 
 		surface_flush_damage(ev->surface);
@@ -1626,6 +1648,14 @@ surface_free_unused_subsurface_views(struct weston_surface *surface)
 	}
 }
 
+static void
+view_list_insert(struct weston_compositor *compositor,
+		 struct weston_view *view)
+{
+	wl_list_insert(compositor->view_list.prev, &view->link);
+	weston_view_index_add(&compositor->view_index, view);
+}
+
 static void
 view_list_add_subsurface_view(struct weston_compositor *compositor,
 			      struct weston_subsurface *sub,
@@ -1656,13 +1686,13 @@ view_list_add_subsurface_view(struct weston_compositor *compositor,
 	weston_view_update_transform(view);
 
 	if (wl_list_empty(&sub->surface->subsurface_list)) {
-		wl_list_insert(compositor->view_list.prev, &view->link);
+		view_list_insert(compositor, view);
 		return;
 	}
 
 	wl_list_for_each(child, &sub->surface->subsurface_list, parent_link) {
 		if (child->surface == sub->surface)
-			wl_list_insert(compositor->view_list.prev, &view->link);
+			view_list_insert(compositor, view);
 		else
 			view_list_add_subsurface_view(compositor, child, view);
 	}
@@ -1677,40 +1707,98 @@ view_list_add(struct weston_compositor *compositor,
 	weston_view_update_transform(view);
 
 	if (wl_list_empty(&view->surface->subsurface_list)) {
-		wl_list_insert(compositor->view_list.prev, &view->link);
+		view_list_insert(compositor, view);
 		return;
 	}
 
 	wl_list_for_each(sub, &view->surface->subsurface_list, parent_link) {
 		if (sub->surface == view->surface)
-			wl_list_insert(compositor->view_list.prev, &view->link);
+			view_list_insert(compositor, view);
 		else
 			view_list_add_subsurface_view(compositor, sub, view);
 	}
 }
 
+/* Mark the view list as needing a full rebuild on the next repaint.
+ * Changes to the layer lists are detected on their own, this is only
+ * needed for changes that do not show in the layers, like sub-surface
+ * stacking or views leaving the view list. */
+WL_EXPORT void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor)
+{
+	compositor->view_list_dirty = 1;
+}
+
+static int
+view_list_layers_changed(struct weston_compositor *compositor)
+{
+	struct weston_layer *layer;
+	struct weston_view *view, **views;
+	size_t i = 0, count;
+
+	views = compositor->view_list_layer_views.data;
+	count = compositor->view_list_layer_views.size / sizeof *views;
+
+	wl_list_for_each(layer, &compositor->layer_list, link) {
+		wl_list_for_each(view, &layer->view_list, layer_link) {
+			if (i == count || views[i] != view)
+				return 1;
+			i++;
+		}
+	}
+
+	return i != count;
+}
+
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
-	struct weston_view *view;
+	struct weston_view *view, **entry;
 	struct weston_layer *layer;
 
+	/* Nothing was restacked since the last build, only bring the
+	 * transforms up to date like the rebuild would. */
+	if (!compositor->view_list_dirty &&
+	    !view_list_layers_changed(compositor)) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+		compositor->view_list_rebuilds_skipped++;
+		return;
+	}
+
+	compositor->view_list_dirty = 0;
+	compositor->view_list_rebuilds++;
+	compositor->view_list_layer_views.size = 0;
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list, layer_link)
 			surface_stash_subsurface_views(view->surface);
 
 	wl_list_init(&compositor->view_list);
+	weston_view_index_begin(&compositor->view_index);
 	wl_list_for_each(layer, &compositor->layer_list, link) {
 		wl_list_for_each(view, &layer->view_list, layer_link) {
 			view_list_add(compositor, view);
+
+			entry = wl_array_add(&compositor->view_list_layer_views,
+					     sizeof *entry);
+			if (entry)
+				*entry = view;
+			else
+				compositor->view_list_dirty = 1;
 		}
 	}
+	weston_view_index_end(&compositor->view_index);
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list, layer_link)
 			surface_free_unused_subsurface_views(view->surface);
 }
 
+/* Frames repainted right after a refresh once a predicted repaint
+ * missed its deadline. */
+#define WESTON_REPAINT_FALLBACK_FRAMES 60
+
 static int
 weston_output_repaint(struct weston_output *output, uint32_t msecs)
 {
@@ -1725,14 +1813,24 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 	if (output->destroying)
 		return 0;
 
+	weston_frame_timing_begin(output);
+
+	/* Motion merged since the last frame lands in this one. */
+	if (ec->coalesce_motion) {
+		weston_compositor_flush_motion(ec);
+		weston_frame_timing_mark(output, WESTON_FRAME_PHASE_INPUT);
+	}
+
 	/* Rebuild the surface list and update surface transforms up front. */
 	weston_compositor_build_view_list(ec);
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_VIEW_LIST);
 
 	if (output->assign_planes && !output->disable_planes)
 		output->assign_planes(output);
 	else
 		wl_list_for_each(ev, &ec->view_list, link)
 			weston_view_move_to_plane(ev, &ec->primary_plane);
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_PLANES);
 
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
@@ -1745,8 +1843,9 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 			wl_list_init(&ev->surface->frame_callback_list);
 		}
 	}
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_FRAME_CALLBACKS);
 
-	compositor_accumulate_damage(ec);
+	compositor_accumulate_damage(ec, output);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -1756,8 +1855,12 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 
 	if (output->dirty)
 		weston_output_update_matrix(output);
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_DAMAGE);
 
 	r = output->repaint(output, &output_damage);
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_RENDER);
+	if (r == 0)
+		weston_frame_timing_submit(output);
 
 	pixman_region32_fini(&output_damage);
 
@@ -1765,16 +1868,19 @@ weston_output_repaint(struct weston_output *output, uint32_t msecs)
 
 	weston_compositor_repick(ec);
 	wl_event_loop_dispatch(ec->input_loop, 0);
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_INPUT);
 
 	wl_list_for_each_safe(cb, cnext, &frame_callback_list, link) {
 		wl_callback_send_done(cb->resource, msecs);
 		wl_resource_destroy(cb->resource);
 	}
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_FRAME_CALLBACKS);
 
 	wl_list_for_each_safe(animation, next, &output->animation_list, link) {
 		animation->frame_counter++;
 		animation->frame(animation, output, msecs);
 	}
+	weston_frame_timing_mark(output, WESTON_FRAME_PHASE_ANIMATIONS);
 
 	return r;
 }
@@ -1789,32 +1895,113 @@ weston_compositor_read_input(int fd, uint32_t mask, void *data)
 	return 1;
 }
 
+static void
+weston_compositor_watch_input(struct weston_compositor *compositor)
+{
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(compositor->wl_display);
+	int fd;
+
+	if (compositor->input_loop_source)
+		return;
+
+	fd = wl_event_loop_get_fd(compositor->input_loop);
+	compositor->input_loop_source =
+		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+				     weston_compositor_read_input, compositor);
+}
+
+/* How long to hold back the repaint after a refresh so it completes
+ * just before the next one, in ms; 0 to repaint right away. */
+static int
+weston_output_repaint_delay(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t period, predicted, budget;
+
+	if (!compositor->predictive_repaint || !output->current_mode ||
+	    output->current_mode->refresh <= 0)
+		return 0;
+
+	if (output->repaint_fallback > 0) {
+		output->repaint_fallback--;
+		return 0;
+	}
+
+	predicted = weston_frame_timing_predict_repaint(output);
+	if (predicted == 0)
+		return 0;
+
+	period = 1000000000 / output->current_mode->refresh;
+	budget = predicted + compositor->repaint_margin_us;
+	if (budget >= period)
+		return 0;
+
+	return (period - budget) / 1000;
+}
+
+static int
+output_repaint_timer_handler(void *data)
+{
+	struct weston_output *output = data;
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t period;
+	int r;
+
+	if (output->repaint_needed &&
+	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
+	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN) {
+		/* Input that arrived while waiting makes it into this
+		 * frame, that is the point of waiting. */
+		wl_event_loop_dispatch(compositor->input_loop, 0);
+
+		r = weston_output_repaint(output, output->frame_time);
+
+		/* Missed the refresh we aimed for, most likely the
+		 * prediction was off; repaint at once for a while. */
+		period = 1000000000 / output->current_mode->refresh;
+		if (weston_frame_timing_now_us() > output->vblank_us + period)
+			output->repaint_fallback =
+				WESTON_REPAINT_FALLBACK_FRAMES;
+
+		if (!r)
+			return 0;
+	}
+
+	output->repaint_scheduled = 0;
+	weston_compositor_watch_input(compositor);
+
+	return 0;
+}
+
 WL_EXPORT void
 weston_output_finish_frame(struct weston_output *output, uint32_t msecs)
 {
 	struct weston_compositor *compositor = output->compositor;
-	struct wl_event_loop *loop =
-		wl_display_get_event_loop(compositor->wl_display);
-	int fd, r;
+	int r, delay;
+
+	weston_frame_timing_present(output);
 
 	output->frame_time = msecs;
+	output->vblank_us = weston_frame_timing_now_us();
 
 	if (output->repaint_needed &&
 	    compositor->state != WESTON_COMPOSITOR_SLEEPING &&
 	    compositor->state != WESTON_COMPOSITOR_OFFSCREEN) {
+		delay = weston_output_repaint_delay(output);
+		if (delay > 0) {
+			wl_event_source_timer_update(output->repaint_timer,
+						     delay);
+			return;
+		}
+
 		r = weston_output_repaint(output, msecs);
 		if (!r)
 			return;
 	}
 
 	output->repaint_scheduled = 0;
-	if (compositor->input_loop_source)
-		return;
-
-	fd = wl_event_loop_get_fd(compositor->input_loop);
-	compositor->input_loop_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     weston_compositor_read_input, compositor);
+	weston_compositor_watch_input(compositor);
 }
 
 static void
@@ -1986,11 +2173,37 @@ surface_set_input_region(struct wl_client *client,
 	}
 }
 
+static int
+subsurface_order_changed(struct weston_surface *surface)
+{
+	struct wl_list *cur, *pending;
+	struct weston_subsurface *sub;
+
+	cur = surface->subsurface_list.next;
+	pending = surface->subsurface_list_pending.next;
+	while (pending != &surface->subsurface_list_pending) {
+		sub = container_of(pending, struct weston_subsurface,
+				   parent_link_pending);
+		if (cur != &sub->parent_link)
+			return 1;
+
+		cur = cur->next;
+		pending = pending->next;
+	}
+
+	return cur != &surface->subsurface_list;
+}
+
 static void
 weston_surface_commit_subsurface_order(struct weston_surface *surface)
 {
 	struct weston_subsurface *sub;
 
+	if (!subsurface_order_changed(surface))
+		return;
+
+	weston_compositor_view_list_dirty(surface->compositor);
+
 	wl_list_for_each_reverse(sub, &surface->subsurface_list_pending,
 				 parent_link_pending) {
 		wl_list_remove(&sub->parent_link);
@@ -2618,6 +2831,7 @@ weston_subsurface_cache_fini(struct weston_subsurface *sub)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	weston_compositor_view_list_dirty(sub->surface->compositor);
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -2681,6 +2895,8 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_signal_add(&parent->destroy_signal,
 		      &sub->parent_destroy_listener);
 
+	weston_compositor_view_list_dirty(parent->compositor);
+
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
@@ -2722,6 +2938,7 @@ weston_subsurface_destroy(struct weston_subsurface *sub)
 	} else {
 		/* the dummy weston_subsurface for the parent itself */
 		assert(sub->parent_destroy_listener.notify == NULL);
+		weston_compositor_view_list_dirty(sub->surface->compositor);
 		wl_list_remove(&sub->parent_link);
 		wl_list_remove(&sub->parent_link_pending);
 	}
@@ -2784,6 +3001,7 @@ weston_subsurface_create_for_parent(struct weston_surface *parent)
 
 	weston_subsurface_link_surface(sub, parent);
 	sub->parent = parent;
+	weston_compositor_view_list_dirty(parent->compositor);
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
@@ -3086,6 +3304,7 @@ weston_output_destroy(struct weston_output *output)
 	pixman_region32_fini(&output->previous_damage);
 	output->compositor->output_id_pool &= ~(1 << output->id);
 
+	wl_event_source_remove(output->repaint_timer);
 	wl_global_destroy(output->global);
 }
 
@@ -3262,6 +3481,8 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 		   int x, int y, int mm_width, int mm_height, uint32_t transform,
 		   int32_t scale)
 {
+	struct wl_event_loop *loop;
+
 	output->compositor = c;
 	output->x = x;
 	output->y = y;
@@ -3280,6 +3501,12 @@ weston_output_init(struct weston_output *output, struct weston_compositor *c,
 	wl_signal_init(&output->destroy_signal);
 	wl_list_init(&output->animation_list);
 	wl_list_init(&output->resource_list);
+	weston_frame_timeline_init(&output->timeline);
+
+	loop = wl_display_get_event_loop(c->wl_display);
+	output->repaint_timer =
+		wl_event_loop_add_timer(loop, output_repaint_timer_handler,
+					output);
 
 	output->id = ffs(~output->compositor->output_id_pool) - 1;
 	output->compositor->output_id_pool |= 1 << output->id;
@@ -3516,6 +3743,16 @@ weston_environment_get_fd(const char *env)
 	return fd;
 }
 
+static void
+view_list_stats_binding(struct weston_seat *seat, uint32_t time,
+			uint32_t key, void *data)
+{
+	struct weston_compositor *ec = data;
+
+	weston_log("view list: %u rebuilds, %u rebuilds avoided\n",
+		   ec->view_list_rebuilds, ec->view_list_rebuilds_skipped);
+}
+
 WL_EXPORT int
 weston_compositor_init(struct weston_compositor *ec,
 		       struct wl_display *display,
@@ -3559,6 +3796,9 @@ weston_compositor_init(struct weston_compositor *ec,
 		return -1;
 
 	wl_list_init(&ec->view_list);
+	weston_view_index_init(&ec->view_index);
+	wl_array_init(&ec->view_list_layer_views);
+	ec->view_list_dirty = 1;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -3573,6 +3813,9 @@ weston_compositor_init(struct weston_compositor *ec,
 	weston_plane_init(&ec->primary_plane, ec, 0, 0);
 	weston_compositor_stack_plane(ec, &ec->primary_plane, NULL);
 
+	weston_compositor_add_debug_binding(ec, KEY_L,
+					    view_list_stats_binding, ec);
+
 	s = weston_config_get_section(ec->config, "keyboard", NULL, NULL);
 	weston_config_section_get_string(s, "keymap_rules",
 					 (char **) &xkb_names.rules, NULL);
@@ -3588,9 +3831,18 @@ weston_compositor_init(struct weston_compositor *ec,
 	if (weston_compositor_xkb_init(ec, &xkb_names) < 0)
 		return -1;
 
+	s = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(s, "predictive-repaint",
+				       &ec->predictive_repaint, 0);
+	weston_config_section_get_uint(s, "repaint-margin",
+				       &ec->repaint_margin_us, 2000);
+	weston_config_section_get_bool(s, "coalesce-motion",
+				       &ec->coalesce_motion, 0);
+
 	ec->ping_handler = NULL;
 
 	screenshooter_create(ec);
+	frame_timing_create(ec);
 	text_backend_init(ec);
 
 	wl_data_device_manager_init(ec->wl_display);
@@ -3635,6 +3887,9 @@ weston_compositor_shutdown(struct weston_compositor *ec)
 
 	weston_plane_release(&ec->primary_plane);
 
+	weston_view_index_release(&ec->view_index);
+	wl_array_release(&ec->view_list_layer_views);
+
 	wl_event_loop_destroy(ec->input_loop);
 
 	weston_config_destroy(ec->config);
@@ -3931,7 +4186,8 @@ usage(int error_code)
 		"  --seat=SEAT\t\tThe seat that weston should run on\n"
 		"  --tty=TTY\t\tThe tty to use\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
-		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n\n");
+		"  --current-mode\tPrefer current KMS mode over EDID preferred mode\n"
+		"  --drm-device=CARD\tThe DRM device to use, e.g. card0\n\n");
 
 	fprintf(stderr,
 		"Options for fbdev-backend.so:\n\n"
@@ -3958,6 +4214,20 @@ usage(int error_code)
 		"  --sprawl\t\tCreate one fullscreen output for every parent output\n"
 		"  --display=DISPLAY\tWayland display to connect to\n\n");
 
+	fprintf(stderr,
+		"Options for headless-backend.so:\n\n"
+		"  --width=WIDTH\t\tWidth of memory surface\n"
+		"  --height=HEIGHT\tHeight of memory surface\n"
+		"  --scale=SCALE\t\tScale factor of output\n"
+		"  --transform=TR\tThe output transformation, TR is one of:\n"
+		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
+		"  --output-count=COUNT\tCreate multiple outputs\n"
+		"  --use-pixman\t\tRender into the outputs with the pixman "
+		"renderer\n"
+		"  --clock=CLOCK\t\tHow frames complete, CLOCK is one of:\n"
+		"\trealtime, at 60Hz; uncapped, as fast as possible;\n"
+		"\tvirtual, when a test advances the clock\n\n");
+
 #if defined(BUILD_RPI_COMPOSITOR) && defined(HAVE_BCM_HOST)
 	fprintf(stderr,
 		"Options for rpi-backend.so:\n\n"
@@ -3982,6 +4252,7 @@ usage(int error_code)
        "  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
        "  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
        "  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
+       "  --rfx-threads=N\tRemoteFX encoder threads, 0 to encode per peer\n"
        "\n");
 #endif
 
@@ -172,6 +172,39 @@ enum weston_mode_switch_op {
 	WESTON_MODE_SWITCH_RESTORE_NATIVE
 };
 
+/* Matches the phase enum of the weston_frame_timing protocol. */
+enum weston_frame_phase {
+	WESTON_FRAME_PHASE_VIEW_LIST,
+	WESTON_FRAME_PHASE_PLANES,
+	WESTON_FRAME_PHASE_DAMAGE,
+	WESTON_FRAME_PHASE_RENDER,
+	WESTON_FRAME_PHASE_INPUT,
+	WESTON_FRAME_PHASE_FRAME_CALLBACKS,
+	WESTON_FRAME_PHASE_ANIMATIONS,
+	WESTON_FRAME_PHASE_PRESENT,
+	WESTON_FRAME_PHASE_COUNT
+};
+
+/* Must be a power of two. */
+#define WESTON_FRAME_TIMELINE_SIZE 256
+
+struct weston_frame_timing {
+	uint32_t seq;
+	uint64_t start_us;
+	uint32_t repaint_us;	/* from start until submitted, 0 if not */
+	uint32_t input_us;	/* oldest input event until start, 0 if none */
+	uint32_t phase_us[WESTON_FRAME_PHASE_COUNT];
+};
+
+struct weston_frame_timeline {
+	struct weston_frame_timing frames[WESTON_FRAME_TIMELINE_SIZE];
+	uint32_t seq;
+	uint64_t mark_us;
+	uint64_t submit_us;
+	struct weston_frame_timing *current;
+	struct weston_frame_timing *submitted;
+};
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -197,6 +230,12 @@ struct weston_output {
 	struct wl_signal move_signal;
 	int move_x, move_y;
 	uint32_t frame_time;
+	struct weston_frame_timeline timeline;
+
+	/* Predictive repaint, see weston_output_finish_frame(). */
+	struct wl_event_source *repaint_timer;
+	uint64_t vblank_us;
+	uint32_t repaint_fallback;	/* frames left repainting at once */
 	int disable_planes;
 	int destroying;
 
@@ -480,6 +519,29 @@ struct weston_keyboard {
 	struct xkb_keymap *pending_keymap;
 };
 
+enum weston_motion_pending {
+	WESTON_MOTION_NONE,
+	WESTON_MOTION_RELATIVE,
+	WESTON_MOTION_ABSOLUTE
+};
+
+#define WESTON_MOTION_MAX_TOUCH 32
+
+/* Motion merged between frames when [core] coalesce-motion is set. */
+struct weston_seat_motion {
+	enum weston_motion_pending pending;
+	uint32_t time;
+	wl_fixed_t x, y;	/* absolute position, if any */
+	wl_fixed_t dx, dy;	/* relative motion on top of it */
+
+	uint32_t touch_mask;	/* touch points with a pending motion */
+	int flushing;
+	struct {
+		uint32_t time;
+		wl_fixed_t x, y;
+	} touch[WESTON_MOTION_MAX_TOUCH];
+};
+
 struct weston_seat {
 	struct wl_list base_resource_list;
 
@@ -511,6 +573,13 @@ struct weston_seat {
 	void (*led_update)(struct weston_seat *ws, enum weston_led leds);
 
 	uint32_t slot_map;
+
+	/* CLOCK_MONOTONIC time in microseconds of the input event being
+	 * handled, 0 if the backend does not provide one.  Set around
+	 * the notify_*() calls, which read it. */
+	uint64_t event_usec;
+
+	struct weston_seat_motion motion;
 	struct input_method *input_method;
 	char *seat_name;
 };
@@ -551,6 +620,25 @@ struct weston_renderer {
 	void (*destroy)(struct weston_compositor *ec);
 };
 
+/* Uniform grid over global coordinates used to find the candidate views
+ * for weston_compositor_pick_view() without walking the whole view_list.
+ * Cells are hashed into a fixed number of buckets, so the grid covers
+ * any coordinate range.
+ */
+#define WESTON_VIEW_INDEX_CELL_SHIFT	8
+#define WESTON_VIEW_INDEX_BUCKETS	1024
+
+struct weston_view_index {
+	struct wl_list bucket[WESTON_VIEW_INDEX_BUCKETS];
+	struct wl_list unbounded_list;	/* weston_view::pick_index.link */
+	struct wl_list view_list;	/* weston_view::pick_index.link */
+
+	/* Incremented on every view list rebuild; views not re-added
+	 * with the current serial are no longer pickable. */
+	uint32_t serial;
+	uint32_t next_order;
+};
+
 enum weston_capability {
 	/* backend/renderer supports arbitrary rotation */
 	WESTON_CAP_ROTATION_ANY			= 0x0001,
@@ -596,6 +684,11 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;
 	struct wl_list view_list;
+	struct weston_view_index view_index;
+	int view_list_dirty;
+	struct wl_array view_list_layer_views; /* layer views at last build */
+	uint32_t view_list_rebuilds;
+	uint32_t view_list_rebuilds_skipped;
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -609,6 +702,16 @@ struct weston_compositor {
 	uint32_t idle_inhibit;
 	int idle_time;			/* timeout, s */
 
+	int predictive_repaint;
+	uint32_t repaint_margin_us;
+
+	/* CLOCK_MONOTONIC time of the oldest input event passed to
+	 * notify_*() since the last repaint started, 0 if none. */
+	uint64_t input_pending_usec;
+
+	int coalesce_motion;
+	uint64_t motion_events_merged;
+
 	const struct weston_pointer_grab_interface *default_pointer_grab;
 
 	/* Repaint state. */
@@ -622,6 +725,8 @@ struct weston_compositor {
 	void (*destroy)(struct weston_compositor *ec);
 	void (*restore)(struct weston_compositor *ec);
 	int (*authenticate)(struct weston_compositor *c, uint32_t id);
+	/* Only set by backends running on a simulated clock. */
+	void (*advance_clock)(struct weston_compositor *ec, uint32_t msecs);
 
 	void (*ping_handler)(struct weston_surface *surface, uint32_t serial);
 
@@ -821,6 +926,16 @@ struct weston_view {
 	 * displayed on.
 	 */
 	uint32_t output_mask;
+
+	/* Registration in weston_compositor::view_index, see view-index.c */
+	struct {
+		struct wl_list link;
+		struct weston_view_index_entry *entries;
+		int entry_count;
+		pixman_box32_t box;
+		uint32_t serial;
+		uint32_t order;	/* position in weston_compositor::view_list */
+	} pick_index;
 };
 
 struct weston_surface {
@@ -1018,6 +1133,8 @@ weston_output_damage(struct weston_output *output);
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
+weston_compositor_view_list_dirty(struct weston_compositor *compositor);
+void
 weston_compositor_fade(struct weston_compositor *compositor, float tint);
 void
 weston_compositor_damage_all(struct weston_compositor *compositor);
@@ -1035,6 +1152,28 @@ weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t *sx, wl_fixed_t *sy);
 
 
+void
+weston_view_index_init(struct weston_view_index *index);
+void
+weston_view_index_release(struct weston_view_index *index);
+void
+weston_view_index_begin(struct weston_view_index *index);
+void
+weston_view_index_add(struct weston_view_index *index,
+		      struct weston_view *view);
+void
+weston_view_index_update(struct weston_view_index *index,
+			 struct weston_view *view);
+void
+weston_view_index_remove(struct weston_view_index *index,
+			 struct weston_view *view);
+void
+weston_view_index_end(struct weston_view_index *index);
+struct weston_view *
+weston_view_index_pick(struct weston_view_index *index,
+		       wl_fixed_t x, wl_fixed_t y,
+		       wl_fixed_t *vx, wl_fixed_t *vy);
+
 struct weston_binding;
 typedef void (*weston_key_binding_handler_t)(struct weston_seat *seat,
 					     uint32_t time, uint32_t key,
@@ -1238,6 +1377,10 @@ weston_seat_release_touch(struct weston_seat *seat);
 void
 weston_seat_repick(struct weston_seat *seat);
 void
+weston_seat_flush_motion(struct weston_seat *seat);
+void
+weston_compositor_flush_motion(struct weston_compositor *compositor);
+void
 weston_seat_update_keymap(struct weston_seat *seat, struct xkb_keymap *keymap);
 
 void
@@ -1286,6 +1429,24 @@ tty_activate_vt(struct tty *tty, int vt);
 void
 screenshooter_create(struct weston_compositor *ec);
 
+void
+weston_frame_timeline_init(struct weston_frame_timeline *timeline);
+void
+weston_frame_timing_begin(struct weston_output *output);
+void
+weston_frame_timing_mark(struct weston_output *output,
+			 enum weston_frame_phase phase);
+void
+weston_frame_timing_submit(struct weston_output *output);
+void
+weston_frame_timing_present(struct weston_output *output);
+uint64_t
+weston_frame_timing_now_us(void);
+uint32_t
+weston_frame_timing_predict_repaint(struct weston_output *output);
+void
+frame_timing_create(struct weston_compositor *ec);
+
 struct clipboard *
 clipboard_create(struct weston_seat *seat);
 
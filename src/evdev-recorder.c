@@ -0,0 +1,165 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compositor.h"
+#include "evdev.h"
+
+/* Records the raw events of every evdev device, together with what the
+ * device told about itself, in a line based text format that
+ * input-replay.so plays back:
+ *
+ *   weston-input-recording 1
+ *   device <id> <name>
+ *   id <id> <bustype> <vendor> <product> <version>
+ *   prop|ev|key|rel <id> <bit>...
+ *   abs <id> <code> <value> <minimum> <maximum> <fuzz> <flat> <resolution>
+ *   added <id>
+ *   event <id> <sec> <usec> <type> <code> <value>
+ *   removed <id>
+ */
+
+struct evdev_recorder {
+	FILE *fp;
+	char *filename;
+	uint32_t next_id;
+	uint64_t events;
+};
+
+struct evdev_recorder *
+evdev_recorder_create(const char *filename)
+{
+	struct evdev_recorder *recorder;
+
+	recorder = zalloc(sizeof *recorder);
+	if (recorder == NULL)
+		return NULL;
+
+	recorder->fp = fopen(filename, "w");
+	if (recorder->fp == NULL) {
+		weston_log("failed to open input recording %s: %m\n",
+			   filename);
+		free(recorder);
+		return NULL;
+	}
+
+	recorder->filename = strdup(filename);
+	fprintf(recorder->fp, "weston-input-recording 1\n");
+	weston_log("recording input to %s\n", filename);
+
+	return recorder;
+}
+
+void
+evdev_recorder_destroy(struct evdev_recorder *recorder)
+{
+	weston_log("recorded %llu input events to %s\n",
+		   (unsigned long long) recorder->events,
+		   recorder->filename);
+
+	fclose(recorder->fp);
+	free(recorder->filename);
+	free(recorder);
+}
+
+static void
+write_bits(FILE *fp, const char *tag, uint32_t id,
+	   const unsigned long *bits, unsigned int count)
+{
+	unsigned int i;
+
+	fprintf(fp, "%s %u", tag, id);
+	for (i = 0; i < count; i++)
+		if (TEST_BIT(bits, i))
+			fprintf(fp, " %u", i);
+	fprintf(fp, "\n");
+}
+
+void
+evdev_recorder_add_device(struct evdev_recorder *recorder,
+			  struct evdev_device *device)
+{
+	struct evdev_device_info info;
+	struct input_absinfo *abs;
+	FILE *fp = recorder->fp;
+	unsigned int i;
+
+	evdev_device_info_read(device->fd, &info);
+
+	/* Events are recorded after mtdev turned them into protocol B,
+	 * so the replayed device has to look slotted. */
+	if (device->mtdev) {
+		info.abs_bits[LONG(ABS_MT_SLOT)] |= BIT(ABS_MT_SLOT);
+		info.absinfo[ABS_MT_SLOT].value = device->mt.slot;
+		info.absinfo[ABS_MT_SLOT].maximum = MAX_SLOTS - 1;
+	}
+
+	device->recorder = recorder;
+	device->record_id = recorder->next_id++;
+
+	fprintf(fp, "device %u %s\n", device->record_id, info.name);
+	fprintf(fp, "id %u %u %u %u %u\n", device->record_id,
+		info.id.bustype, info.id.vendor,
+		info.id.product, info.id.version);
+	write_bits(fp, "prop", device->record_id,
+		   info.prop_bits, INPUT_PROP_CNT);
+	write_bits(fp, "ev", device->record_id, info.ev_bits, EV_CNT);
+	write_bits(fp, "key", device->record_id, info.key_bits, KEY_CNT);
+	write_bits(fp, "rel", device->record_id, info.rel_bits, REL_CNT);
+	for (i = 0; i < ABS_CNT; i++) {
+		if (!TEST_BIT(info.abs_bits, i))
+			continue;
+		abs = &info.absinfo[i];
+		fprintf(fp, "abs %u %u %d %d %d %d %d %d\n",
+			device->record_id, i, abs->value,
+			abs->minimum, abs->maximum,
+			abs->fuzz, abs->flat, abs->resolution);
+	}
+	fprintf(fp, "added %u\n", device->record_id);
+	fflush(fp);
+}
+
+void
+evdev_recorder_remove_device(struct evdev_recorder *recorder,
+			     struct evdev_device *device)
+{
+	fprintf(recorder->fp, "removed %u\n", device->record_id);
+	fflush(recorder->fp);
+
+	device->recorder = NULL;
+}
+
+void
+evdev_recorder_event(struct evdev_recorder *recorder,
+		     struct evdev_device *device, struct input_event *e)
+{
+	fprintf(recorder->fp, "event %u %ld %ld %u %u %d\n",
+		device->record_id,
+		(long) e->time.tv_sec, (long) e->time.tv_usec,
+		e->type, e->code, e->value);
+	recorder->events++;
+}
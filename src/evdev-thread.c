@@ -0,0 +1,406 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mtdev.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "compositor.h"
+#include "evdev.h"
+
+/* Reading evdev devices on their own thread keeps input from waiting
+ * behind a long repaint; the events are handed to the compositor thread
+ * through a single producer, single consumer ring.  Must be a power of
+ * two. */
+#define INPUT_QUEUE_SIZE 4096
+
+struct input_queue_entry {
+	struct evdev_device *device;	/* NULL once the device is gone */
+	struct input_event event;
+};
+
+struct evdev_input_thread {
+	struct weston_compositor *compositor;
+	pthread_t thread;
+
+	/* Held by the input thread while it reads devices, taken by the
+	 * compositor to remove one. */
+	pthread_mutex_t device_mutex;
+	int devices_removed;
+
+	int epoll_fd;
+	int quit_fd;		/* wakes the input thread to exit */
+	int notify_fd;		/* events were queued */
+	int space_fd;		/* the compositor drained a full queue */
+	struct wl_event_source *notify_source;
+
+	uint32_t head;		/* written by the input thread only */
+	uint32_t tail;		/* written by the compositor only */
+	int producer_waiting;
+	struct input_queue_entry queue[INPUT_QUEUE_SIZE];
+};
+
+static uint32_t
+input_queue_space(struct evdev_input_thread *thread)
+{
+	uint32_t tail = __atomic_load_n(&thread->tail, __ATOMIC_ACQUIRE);
+
+	return INPUT_QUEUE_SIZE - (thread->head - tail);
+}
+
+static void
+input_thread_read_device(struct evdev_input_thread *thread,
+			 struct evdev_device *device)
+{
+	struct input_event ev[32];
+	struct input_queue_entry *entry;
+	struct timespec ts;
+	uint32_t space;
+	int i, len, count;
+
+	space = input_queue_space(thread);
+	count = space < ARRAY_LENGTH(ev) ? space : ARRAY_LENGTH(ev);
+	if (count == 0)
+		return;
+
+	if (device->mtdev)
+		len = mtdev_get(device->mtdev, device->fd, ev, count) *
+			sizeof (struct input_event);
+	else
+		len = read(device->fd, ev, count * sizeof ev[0]);
+
+	if (len < 0 || len % sizeof ev[0] != 0) {
+		/* The device is gone; stop polling it until udev
+		 * reports the removal. */
+		if (len < 0 && errno != EAGAIN && errno != EINTR)
+			epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL,
+				  device->fd, NULL);
+		return;
+	}
+
+	count = len / sizeof ev[0];
+
+	/* Without kernel support for monotonic event times, stamp the
+	 * events when they are read, still well before the compositor
+	 * gets to them. */
+	if (!device->monotonic_time) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		for (i = 0; i < count; i++) {
+			ev[i].time.tv_sec = ts.tv_sec;
+			ev[i].time.tv_usec = ts.tv_nsec / 1000;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		entry = &thread->queue[(thread->head + i) &
+				       (INPUT_QUEUE_SIZE - 1)];
+		entry->device = device;
+		entry->event = ev[i];
+	}
+
+	__atomic_store_n(&thread->head, thread->head + count,
+			 __ATOMIC_RELEASE);
+}
+
+/* Sleep until the compositor made room in the queue.  Returns -1 when
+ * asked to quit instead. */
+static int
+input_thread_wait_for_space(struct evdev_input_thread *thread)
+{
+	struct pollfd fds[2];
+	uint64_t value;
+	int ret;
+
+	__atomic_store_n(&thread->producer_waiting, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	while (input_queue_space(thread) == 0) {
+		fds[0].fd = thread->space_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = thread->quit_fd;
+		fds[1].events = POLLIN;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ret = poll(fds, 2, -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (ret < 0 && errno != EINTR)
+			return -1;
+		if (fds[1].revents)
+			return -1;
+		if (fds[0].revents &&
+		    read(thread->space_fd, &value, sizeof value) < 0 &&
+		    errno != EAGAIN)
+			return -1;
+	}
+
+	__atomic_store_n(&thread->producer_waiting, 0, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+static void *
+input_thread_func(void *data)
+{
+	struct evdev_input_thread *thread = data;
+	struct epoll_event ep[16];
+	uint64_t value = 1;
+	int i, count, quit = 0;
+
+	/* Can only be cancelled while waiting, see
+	 * evdev_input_thread_destroy(). */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (!quit) {
+		if (input_queue_space(thread) == 0 &&
+		    input_thread_wait_for_space(thread) < 0)
+			break;
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		count = epoll_wait(thread->epoll_fd, ep, ARRAY_LENGTH(ep), -1);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		pthread_mutex_lock(&thread->device_mutex);
+
+		/* A device removed while we were waiting may be among
+		 * the results; the level triggered epoll reports the
+		 * remaining ones again. */
+		if (thread->devices_removed) {
+			thread->devices_removed = 0;
+			pthread_mutex_unlock(&thread->device_mutex);
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (ep[i].data.ptr == NULL)
+				quit = 1;
+			else
+				input_thread_read_device(thread,
+							 ep[i].data.ptr);
+		}
+
+		pthread_mutex_unlock(&thread->device_mutex);
+
+		/* EAGAIN means the counter is saturated, so a dispatch is
+		 * pending anyway. */
+		if (write(thread->notify_fd, &value, sizeof value) < 0 &&
+		    errno != EAGAIN)
+			break;
+	}
+
+	return NULL;
+}
+
+static int
+input_thread_dispatch(int fd, uint32_t mask, void *data)
+{
+	struct evdev_input_thread *thread = data;
+	struct weston_compositor *ec = thread->compositor;
+	struct input_queue_entry *entry;
+	struct evdev_device *device;
+	struct input_event event;
+	uint32_t head, tail;
+	uint64_t value;
+
+	if (read(fd, &value, sizeof value) < 0 && errno != EAGAIN)
+		weston_log("evdev: failed to read input notification\n");
+
+	head = __atomic_load_n(&thread->head, __ATOMIC_ACQUIRE);
+	tail = thread->tail;
+
+	while (tail != head) {
+		entry = &thread->queue[tail & (INPUT_QUEUE_SIZE - 1)];
+		device = entry->device;
+		event = entry->event;
+
+		/* Release the slot before handling the event, which may
+		 * end up removing devices. */
+		__atomic_store_n(&thread->tail, ++tail, __ATOMIC_RELEASE);
+
+		if (device && ec->session_active)
+			evdev_device_process_event(device, &event, 1);
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&thread->producer_waiting, __ATOMIC_SEQ_CST)) {
+		value = 1;
+		if (write(thread->space_fd, &value, sizeof value) < 0 &&
+		    errno != EAGAIN)
+			weston_log("evdev: failed to wake input thread\n");
+	}
+
+	return 1;
+}
+
+struct evdev_input_thread *
+evdev_input_thread_create(struct weston_compositor *ec)
+{
+	struct evdev_input_thread *thread;
+	struct epoll_event ep;
+	struct wl_event_loop *loop;
+	sigset_t all, saved;
+
+	thread = zalloc(sizeof *thread);
+	if (thread == NULL)
+		return NULL;
+
+	thread->compositor = ec;
+	thread->epoll_fd = -1;
+	thread->quit_fd = -1;
+	thread->notify_fd = -1;
+	thread->space_fd = -1;
+	pthread_mutex_init(&thread->device_mutex, NULL);
+
+	thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	thread->quit_fd = eventfd(0, EFD_CLOEXEC);
+	thread->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	thread->space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (thread->epoll_fd < 0 || thread->quit_fd < 0 ||
+	    thread->notify_fd < 0 || thread->space_fd < 0)
+		goto err;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = NULL;
+	if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD,
+		      thread->quit_fd, &ep) < 0)
+		goto err;
+
+	loop = wl_display_get_event_loop(ec->wl_display);
+	thread->notify_source =
+		wl_event_loop_add_fd(loop, thread->notify_fd,
+				     WL_EVENT_READABLE,
+				     input_thread_dispatch, thread);
+	if (thread->notify_source == NULL)
+		goto err;
+
+	/* Signals are handled on the compositor thread only. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	if (pthread_create(&thread->thread, NULL,
+			   input_thread_func, thread) != 0) {
+		pthread_sigmask(SIG_SETMASK, &saved, NULL);
+		wl_event_source_remove(thread->notify_source);
+		goto err;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	weston_log("reading input on a dedicated thread\n");
+
+	return thread;
+
+err:
+	if (thread->epoll_fd >= 0)
+		close(thread->epoll_fd);
+	if (thread->quit_fd >= 0)
+		close(thread->quit_fd);
+	if (thread->notify_fd >= 0)
+		close(thread->notify_fd);
+	if (thread->space_fd >= 0)
+		close(thread->space_fd);
+	pthread_mutex_destroy(&thread->device_mutex);
+	free(thread);
+	return NULL;
+}
+
+/* All devices must have been removed already. */
+void
+evdev_input_thread_destroy(struct evdev_input_thread *thread)
+{
+	uint64_t value = 1;
+
+	/* The thread can only be cancelled in poll and epoll_wait, where
+	 * it holds nothing. */
+	if (write(thread->quit_fd, &value, sizeof value) < 0) {
+		weston_log("evdev: failed to stop input thread: %m\n");
+		pthread_cancel(thread->thread);
+	}
+	pthread_join(thread->thread, NULL);
+
+	wl_event_source_remove(thread->notify_source);
+	close(thread->epoll_fd);
+	close(thread->quit_fd);
+	close(thread->notify_fd);
+	close(thread->space_fd);
+	pthread_mutex_destroy(&thread->device_mutex);
+	free(thread);
+}
+
+/* Move reading the device from the input loop to the input thread. */
+int
+evdev_input_thread_add_device(struct evdev_input_thread *thread,
+			      struct evdev_device *device)
+{
+	struct epoll_event ep;
+
+	memset(&ep, 0, sizeof ep);
+	ep.events = EPOLLIN;
+	ep.data.ptr = device;
+	if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, device->fd, &ep) < 0)
+		return -1;
+
+	if (device->source) {
+		wl_event_source_remove(device->source);
+		device->source = NULL;
+	}
+	device->thread = thread;
+
+	return 0;
+}
+
+void
+evdev_input_thread_remove_device(struct evdev_input_thread *thread,
+				 struct evdev_device *device)
+{
+	uint32_t i;
+
+	pthread_mutex_lock(&thread->device_mutex);
+
+	epoll_ctl(thread->epoll_fd, EPOLL_CTL_DEL, device->fd, NULL);
+	thread->devices_removed = 1;
+
+	/* The input thread only queues events with the mutex held, so
+	 * nothing is added behind our back here. */
+	for (i = thread->tail; i != thread->head; i++)
+		if (thread->queue[i & (INPUT_QUEUE_SIZE - 1)].device == device)
+			thread->queue[i & (INPUT_QUEUE_SIZE - 1)].device =
+				NULL;
+
+	pthread_mutex_unlock(&thread->device_mutex);
+
+	device->thread = NULL;
+}
@@ -30,12 +30,17 @@
 #include <fcntl.h>
 #include <mtdev.h>
 #include <assert.h>
+#include <time.h>
 
 #include "compositor.h"
 #include "evdev.h"
 
 #define DEFAULT_AXIS_STEP_DISTANCE wl_fixed_from_int(10)
 
+#ifndef EVIOCSCLOCKID
+#define EVIOCSCLOCKID _IOW('E', 0xa0, int)
+#endif
+
 void
 evdev_led_update(struct evdev_device *device, enum weston_led leds)
 {
@@ -405,21 +410,49 @@ fallback_dispatch_create(void)
 	return dispatch;
 }
 
+/* Dispatches one event.  When monotonic is set the event time is on
+ * CLOCK_MONOTONIC and is also made available in microseconds through
+ * weston_seat::event_usec while the event is being handled. */
+void
+evdev_device_process_event(struct evdev_device *device,
+			   struct input_event *e, int monotonic)
+{
+	struct evdev_dispatch *dispatch = device->dispatch;
+	struct weston_seat *seat = device->seat;
+	uint64_t usec;
+
+	usec = (uint64_t) e->time.tv_sec * 1000000 + e->time.tv_usec;
+	seat->event_usec = monotonic ? usec : 0;
+
+	if (device->recorder)
+		evdev_recorder_event(device->recorder, device, e);
+
+	dispatch->interface->process(dispatch, device, e, usec / 1000);
+
+	seat->event_usec = 0;
+}
+
 static void
 evdev_process_events(struct evdev_device *device,
 		     struct input_event *ev, int count)
 {
-	struct evdev_dispatch *dispatch = device->dispatch;
 	struct input_event *e, *end;
-	uint32_t time = 0;
-
-	e = ev;
-	end = e + count;
-	for (e = ev; e < end; e++) {
-		time = e->time.tv_sec * 1000 + e->time.tv_usec / 1000;
-
-		dispatch->interface->process(dispatch, device, e, time);
+	struct timespec ts;
+
+	/* Without kernel support for monotonic event times, stamp the
+	 * events when they are read, as the input thread does, to stay
+	 * on the clock of weston_compositor_get_time(). */
+	if (!device->monotonic_time) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		for (e = ev; e < ev + count; e++) {
+			e->time.tv_sec = ts.tv_sec;
+			e->time.tv_usec = ts.tv_nsec / 1000;
+		}
 	}
+
+	end = ev + count;
+	for (e = ev; e < end; e++)
+		evdev_device_process_event(device, e, 1);
 }
 
 static int
@@ -463,14 +496,44 @@ evdev_device_data(int fd, uint32_t mask, void *data)
 	return 1;
 }
 
+/* Query everything evdev_configure_device() and the touchpad code look
+ * at, so that a recording can stand in for the kernel. */
+void
+evdev_device_info_read(int fd, struct evdev_device_info *info)
+{
+	unsigned int i;
+
+	memset(info, 0, sizeof *info);
+	strcpy(info->name, "unknown");
+
+	ioctl(fd, EVIOCGNAME(sizeof(info->name)), info->name);
+	info->name[sizeof(info->name) - 1] = '\0';
+	ioctl(fd, EVIOCGID, &info->id);
+	ioctl(fd, EVIOCGPROP(sizeof(info->prop_bits)), info->prop_bits);
+	ioctl(fd, EVIOCGBIT(0, sizeof(info->ev_bits)), info->ev_bits);
+	if (TEST_BIT(info->ev_bits, EV_ABS)) {
+		ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(info->abs_bits)),
+		      info->abs_bits);
+		for (i = 0; i < ABS_CNT; i++)
+			if (TEST_BIT(info->abs_bits, i))
+				ioctl(fd, EVIOCGABS(i), &info->absinfo[i]);
+	}
+	if (TEST_BIT(info->ev_bits, EV_REL))
+		ioctl(fd, EVIOCGBIT(EV_REL, sizeof(info->rel_bits)),
+		      info->rel_bits);
+	if (TEST_BIT(info->ev_bits, EV_KEY))
+		ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(info->key_bits)),
+		      info->key_bits);
+}
+
 static int
-evdev_configure_device(struct evdev_device *device)
+evdev_configure_device(struct evdev_device *device,
+		       const struct evdev_device_info *info)
 {
-	struct input_absinfo absinfo;
-	unsigned long ev_bits[NBITS(EV_MAX)];
-	unsigned long abs_bits[NBITS(ABS_MAX)];
-	unsigned long rel_bits[NBITS(REL_MAX)];
-	unsigned long key_bits[NBITS(KEY_MAX)];
+	const unsigned long *ev_bits = info->ev_bits;
+	const unsigned long *abs_bits = info->abs_bits;
+	const unsigned long *rel_bits = info->rel_bits;
+	const unsigned long *key_bits = info->key_bits;
 	int has_abs, has_rel, has_mt;
 	int has_button, has_keyboard, has_touch;
 	unsigned int i;
@@ -482,21 +545,15 @@ evdev_configure_device(struct evdev_device *device)
 	has_keyboard = 0;
 	has_touch = 0;
 
-	ioctl(device->fd, EVIOCGBIT(0, sizeof(ev_bits)), ev_bits);
 	if (TEST_BIT(ev_bits, EV_ABS)) {
-		ioctl(device->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)),
-		      abs_bits);
-
 		if (TEST_BIT(abs_bits, ABS_X)) {
-			ioctl(device->fd, EVIOCGABS(ABS_X), &absinfo);
-			device->abs.min_x = absinfo.minimum;
-			device->abs.max_x = absinfo.maximum;
+			device->abs.min_x = info->absinfo[ABS_X].minimum;
+			device->abs.max_x = info->absinfo[ABS_X].maximum;
 			has_abs = 1;
 		}
 		if (TEST_BIT(abs_bits, ABS_Y)) {
-			ioctl(device->fd, EVIOCGABS(ABS_Y), &absinfo);
-			device->abs.min_y = absinfo.minimum;
-			device->abs.max_y = absinfo.maximum;
+			device->abs.min_y = info->absinfo[ABS_Y].minimum;
+			device->abs.max_y = info->absinfo[ABS_Y].maximum;
 			has_abs = 1;
 		}
                 /* We only handle the slotted Protocol B in weston.
@@ -504,14 +561,14 @@ evdev_configure_device(struct evdev_device *device)
                    require mtdev for conversion. */
 		if (TEST_BIT(abs_bits, ABS_MT_POSITION_X) &&
 		    TEST_BIT(abs_bits, ABS_MT_POSITION_Y)) {
-			ioctl(device->fd, EVIOCGABS(ABS_MT_POSITION_X),
-			      &absinfo);
-			device->abs.min_x = absinfo.minimum;
-			device->abs.max_x = absinfo.maximum;
-			ioctl(device->fd, EVIOCGABS(ABS_MT_POSITION_Y),
-			      &absinfo);
-			device->abs.min_y = absinfo.minimum;
-			device->abs.max_y = absinfo.maximum;
+			device->abs.min_x =
+				info->absinfo[ABS_MT_POSITION_X].minimum;
+			device->abs.max_x =
+				info->absinfo[ABS_MT_POSITION_X].maximum;
+			device->abs.min_y =
+				info->absinfo[ABS_MT_POSITION_Y].minimum;
+			device->abs.max_y =
+				info->absinfo[ABS_MT_POSITION_Y].maximum;
 			device->is_mt = 1;
 			has_touch = 1;
 			has_mt = 1;
@@ -525,25 +582,20 @@ evdev_configure_device(struct evdev_device *device)
 				}
 				device->mt.slot = device->mtdev->caps.slot.value;
 			} else {
-				ioctl(device->fd, EVIOCGABS(ABS_MT_SLOT),
-				      &absinfo);
-				device->mt.slot = absinfo.value;
+				device->mt.slot =
+					info->absinfo[ABS_MT_SLOT].value;
 			}
 		}
 	}
 	if (TEST_BIT(ev_bits, EV_REL)) {
-		ioctl(device->fd, EVIOCGBIT(EV_REL, sizeof(rel_bits)),
-		      rel_bits);
 		if (TEST_BIT(rel_bits, REL_X) || TEST_BIT(rel_bits, REL_Y))
 			has_rel = 1;
 	}
 	if (TEST_BIT(ev_bits, EV_KEY)) {
-		ioctl(device->fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)),
-		      key_bits);
 		if (TEST_BIT(key_bits, BTN_TOOL_FINGER) &&
 		    !TEST_BIT(key_bits, BTN_TOOL_PEN) &&
 		    (has_abs || has_mt)) {
-			device->dispatch = evdev_touchpad_create(device);
+			device->dispatch = evdev_touchpad_create(device, info);
 			weston_log("input device %s, %s is a touchpad\n",
 				   device->devname, device->devnode);
 		}
@@ -621,18 +673,16 @@ evdev_device_set_output(struct evdev_device *device,
 		      &device->output_destroy_listener);
 }
 
-struct evdev_device *
-evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
+static struct evdev_device *
+evdev_device_init(struct weston_seat *seat, const char *path, int device_fd,
+		  const struct evdev_device_info *info)
 {
 	struct evdev_device *device;
-	struct weston_compositor *ec;
-	char devname[256] = "unknown";
 
 	device = zalloc(sizeof *device);
 	if (device == NULL)
 		return NULL;
 
-	ec = seat->compositor;
 	device->seat = seat;
 	device->seat_caps = 0;
 	device->is_mt = 0;
@@ -646,11 +696,9 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 	device->pending_event = EVDEV_NONE;
 	wl_list_init(&device->link);
 
-	ioctl(device->fd, EVIOCGNAME(sizeof(devname)), devname);
-	devname[sizeof(devname) - 1] = '\0';
-	device->devname = strdup(devname);
+	device->devname = strdup(info->name);
 
-	if (evdev_configure_device(device) == -1)
+	if (evdev_configure_device(device, info) == -1)
 		goto err;
 
 	if (device->seat_caps == 0) {
@@ -664,17 +712,51 @@ evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
 	if (device->dispatch == NULL)
 		goto err;
 
+	return device;
+
+err:
+	evdev_device_destroy(device);
+	return NULL;
+}
+
+struct evdev_device *
+evdev_device_create(struct weston_seat *seat, const char *path, int device_fd)
+{
+	struct evdev_device *device;
+	struct weston_compositor *ec = seat->compositor;
+	struct evdev_device_info info;
+	int clockid = CLOCK_MONOTONIC;
+
+	evdev_device_info_read(device_fd, &info);
+
+	device = evdev_device_init(seat, path, device_fd, &info);
+	if (device == NULL || device == EVDEV_UNHANDLED_DEVICE)
+		return device;
+
+	/* Ask for monotonic event times so that they can be compared with
+	 * the repaint clock and weston_compositor_get_time(); on older
+	 * kernels the events get stamped when read. */
+	device->monotonic_time =
+		ioctl(device->fd, EVIOCSCLOCKID, &clockid) == 0;
+
 	device->source = wl_event_loop_add_fd(ec->input_loop, device->fd,
 					      WL_EVENT_READABLE,
 					      evdev_device_data, device);
-	if (device->source == NULL)
-		goto err;
+	if (device->source == NULL) {
+		evdev_device_destroy(device);
+		return NULL;
+	}
 
 	return device;
+}
 
-err:
-	evdev_device_destroy(device);
-	return NULL;
+/* A device without a file descriptor, its events are fed in with
+ * evdev_device_process_event(). */
+struct evdev_device *
+evdev_device_create_from_info(struct weston_seat *seat, const char *path,
+			      const struct evdev_device_info *info)
+{
+	return evdev_device_init(seat, path, -1, info);
 }
 
 void
@@ -682,6 +764,11 @@ evdev_device_destroy(struct evdev_device *device)
 {
 	struct evdev_dispatch *dispatch;
 
+	if (device->thread)
+		evdev_input_thread_remove_device(device->thread, device);
+	if (device->recorder)
+		evdev_recorder_remove_device(device->recorder, device);
+
 	if (device->seat_caps & EVDEV_SEAT_POINTER)
 		weston_seat_release_pointer(device->seat);
 	if (device->seat_caps & EVDEV_SEAT_KEYBOARD)
@@ -700,7 +787,8 @@ evdev_device_destroy(struct evdev_device *device)
 	wl_list_remove(&device->link);
 	if (device->mtdev)
 		mtdev_close_delete(device->mtdev);
-	close(device->fd);
+	if (device->fd >= 0)
+		close(device->fd);
 	free(device->devname);
 	free(device->devnode);
 	free(device->output_name);
@@ -84,6 +84,13 @@ struct evdev_device {
 	enum evdev_device_seat_capability seat_caps;
 
 	int is_mt;
+
+	/* Event times are on CLOCK_MONOTONIC (EVIOCSCLOCKID). */
+	int monotonic_time;
+	struct evdev_input_thread *thread;
+
+	struct evdev_recorder *recorder;
+	uint32_t record_id;
 };
 
 /* copied from udev/extras/input_id/input_id.c */
@@ -98,6 +105,19 @@ struct evdev_device {
 
 #define EVDEV_UNHANDLED_DEVICE ((struct evdev_device *) 1)
 
+/* What a device tells about itself, read from the kernel or from an
+ * input recording. */
+struct evdev_device_info {
+	char name[256];
+	struct input_id id;
+	unsigned long ev_bits[NBITS(EV_CNT)];
+	unsigned long abs_bits[NBITS(ABS_CNT)];
+	unsigned long rel_bits[NBITS(REL_CNT)];
+	unsigned long key_bits[NBITS(KEY_CNT)];
+	unsigned long prop_bits[NBITS(INPUT_PROP_CNT)];
+	struct input_absinfo absinfo[ABS_CNT];
+};
+
 struct evdev_dispatch;
 
 struct evdev_dispatch_interface {
@@ -116,14 +136,22 @@ struct evdev_dispatch {
 };
 
 struct evdev_dispatch *
-evdev_touchpad_create(struct evdev_device *device);
+evdev_touchpad_create(struct evdev_device *device,
+		      const struct evdev_device_info *info);
 
 void
 evdev_led_update(struct evdev_device *device, enum weston_led leds);
 
+void
+evdev_device_info_read(int fd, struct evdev_device_info *info);
+
 struct evdev_device *
 evdev_device_create(struct weston_seat *seat, const char *path, int device_fd);
 
+struct evdev_device *
+evdev_device_create_from_info(struct weston_seat *seat, const char *path,
+			      const struct evdev_device_info *info);
+
 void
 evdev_device_set_output(struct evdev_device *device,
 			struct weston_output *output);
@@ -134,4 +162,44 @@ void
 evdev_notify_keyboard_focus(struct weston_seat *seat,
 			    struct wl_list *evdev_devices);
 
+void
+evdev_device_process_event(struct evdev_device *device,
+			   struct input_event *e, int monotonic);
+
+struct evdev_input_thread;
+
+struct evdev_input_thread *
+evdev_input_thread_create(struct weston_compositor *ec);
+
+void
+evdev_input_thread_destroy(struct evdev_input_thread *thread);
+
+int
+evdev_input_thread_add_device(struct evdev_input_thread *thread,
+			      struct evdev_device *device);
+
+void
+evdev_input_thread_remove_device(struct evdev_input_thread *thread,
+				 struct evdev_device *device);
+
+struct evdev_recorder;
+
+struct evdev_recorder *
+evdev_recorder_create(const char *filename);
+
+void
+evdev_recorder_destroy(struct evdev_recorder *recorder);
+
+void
+evdev_recorder_add_device(struct evdev_recorder *recorder,
+			  struct evdev_device *device);
+
+void
+evdev_recorder_remove_device(struct evdev_recorder *recorder,
+			     struct evdev_device *device);
+
+void
+evdev_recorder_event(struct evdev_recorder *recorder,
+		     struct evdev_device *device, struct input_event *e);
+
 #endif /* EVDEV_H */
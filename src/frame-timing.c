@@ -0,0 +1,370 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <linux/input.h>
+
+#include "compositor.h"
+#include "frame-timing-server-protocol.h"
+
+/* Frames looked at to predict the next repaint duration. */
+#define WESTON_REPAINT_PREDICT_FRAMES 32
+
+struct frame_timing {
+	struct weston_compositor *ec;
+	struct wl_global *global;
+	struct wl_listener destroy_listener;
+};
+
+static const char * const phase_names[WESTON_FRAME_PHASE_COUNT] = {
+	[WESTON_FRAME_PHASE_VIEW_LIST] = "view list",
+	[WESTON_FRAME_PHASE_PLANES] = "planes",
+	[WESTON_FRAME_PHASE_DAMAGE] = "damage",
+	[WESTON_FRAME_PHASE_RENDER] = "render",
+	[WESTON_FRAME_PHASE_INPUT] = "input",
+	[WESTON_FRAME_PHASE_FRAME_CALLBACKS] = "frame callbacks",
+	[WESTON_FRAME_PHASE_ANIMATIONS] = "animations",
+	[WESTON_FRAME_PHASE_PRESENT] = "present",
+};
+
+WL_EXPORT uint64_t
+weston_frame_timing_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+WL_EXPORT void
+weston_frame_timeline_init(struct weston_frame_timeline *timeline)
+{
+	memset(timeline, 0, sizeof *timeline);
+}
+
+/* Start recording a new frame, reusing the oldest slot of the ring. */
+WL_EXPORT void
+weston_frame_timing_begin(struct weston_output *output)
+{
+	struct weston_frame_timeline *tl = &output->timeline;
+	struct weston_frame_timing *frame;
+	uint64_t pending;
+
+	frame = &tl->frames[tl->seq & (WESTON_FRAME_TIMELINE_SIZE - 1)];
+	if (frame == tl->submitted)
+		tl->submitted = NULL;
+
+	memset(frame, 0, sizeof *frame);
+	frame->seq = tl->seq++;
+	frame->start_us = weston_frame_timing_now_us();
+
+	pending = output->compositor->input_pending_usec;
+	if (pending && pending < frame->start_us)
+		frame->input_us = frame->start_us - pending;
+	output->compositor->input_pending_usec = 0;
+
+	tl->mark_us = frame->start_us;
+	tl->current = frame;
+}
+
+/* Charge the time since the previous mark to the given phase.  A phase
+ * may be marked several times per frame, the durations add up. */
+WL_EXPORT void
+weston_frame_timing_mark(struct weston_output *output,
+			 enum weston_frame_phase phase)
+{
+	struct weston_frame_timeline *tl = &output->timeline;
+	uint64_t now;
+
+	if (!tl->current)
+		return;
+
+	now = weston_frame_timing_now_us();
+	tl->current->phase_us[phase] += now - tl->mark_us;
+	tl->mark_us = now;
+}
+
+/* The backend accepted the frame, the present phase runs until it
+ * reports the frame finished. */
+WL_EXPORT void
+weston_frame_timing_submit(struct weston_output *output)
+{
+	struct weston_frame_timeline *tl = &output->timeline;
+
+	tl->submitted = tl->current;
+	tl->submit_us = tl->mark_us;
+
+	if (tl->current)
+		tl->current->repaint_us = tl->mark_us - tl->current->start_us;
+}
+
+WL_EXPORT void
+weston_frame_timing_present(struct weston_output *output)
+{
+	struct weston_frame_timeline *tl = &output->timeline;
+
+	if (!tl->submitted)
+		return;
+
+	tl->submitted->phase_us[WESTON_FRAME_PHASE_PRESENT] =
+		weston_frame_timing_now_us() - tl->submit_us;
+	tl->submitted = NULL;
+}
+
+static uint32_t
+timeline_count(struct weston_frame_timeline *tl)
+{
+	if (tl->seq < WESTON_FRAME_TIMELINE_SIZE)
+		return tl->seq;
+
+	return WESTON_FRAME_TIMELINE_SIZE;
+}
+
+static struct weston_frame_timing *
+timeline_frame(struct weston_frame_timeline *tl, uint32_t seq)
+{
+	return &tl->frames[seq & (WESTON_FRAME_TIMELINE_SIZE - 1)];
+}
+
+/* The slowest submitted repaint among the recent frames, as the guess
+ * for how long the next one takes; 0 until enough frames were seen. */
+WL_EXPORT uint32_t
+weston_frame_timing_predict_repaint(struct weston_output *output)
+{
+	struct weston_frame_timeline *tl = &output->timeline;
+	struct weston_frame_timing *frame;
+	uint32_t seq, predicted = 0;
+
+	if (tl->seq < WESTON_REPAINT_PREDICT_FRAMES)
+		return 0;
+
+	for (seq = tl->seq - WESTON_REPAINT_PREDICT_FRAMES;
+	     seq != tl->seq; seq++) {
+		frame = timeline_frame(tl, seq);
+		if (frame->repaint_us > predicted)
+			predicted = frame->repaint_us;
+	}
+
+	return predicted;
+}
+
+static void
+frame_timing_get_timeline(struct wl_client *client,
+			  struct wl_resource *resource,
+			  struct wl_resource *output_resource)
+{
+	struct weston_output *output =
+		wl_resource_get_user_data(output_resource);
+	struct weston_frame_timeline *tl = &output->timeline;
+	struct weston_frame_timing *frame;
+	struct wl_array phases;
+	uint64_t present_us;
+	uint32_t seq, count;
+
+	wl_array_init(&phases);
+	if (!wl_array_add(&phases, sizeof frame->phase_us)) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+
+	count = timeline_count(tl);
+	for (seq = tl->seq - count; seq != tl->seq; seq++) {
+		frame = timeline_frame(tl, seq);
+		memcpy(phases.data, frame->phase_us, sizeof frame->phase_us);
+		weston_frame_timing_send_frame(resource, frame->seq,
+					       frame->start_us / 1000000,
+					       frame->start_us % 1000000,
+					       &phases);
+
+		if (wl_resource_get_version(resource) < 2 ||
+		    !frame->repaint_us ||
+		    !frame->phase_us[WESTON_FRAME_PHASE_PRESENT])
+			continue;
+
+		present_us = frame->start_us + frame->repaint_us +
+			frame->phase_us[WESTON_FRAME_PHASE_PRESENT];
+		weston_frame_timing_send_present(resource, frame->seq,
+						 present_us / 1000000,
+						 present_us % 1000000);
+	}
+
+	weston_frame_timing_send_done(resource);
+
+	wl_array_release(&phases);
+}
+
+static const struct weston_frame_timing_interface frame_timing_implementation = {
+	frame_timing_get_timeline
+};
+
+static void
+bind_frame_timing(struct wl_client *client,
+		  void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource;
+
+	resource = wl_resource_create(client,
+				      &weston_frame_timing_interface,
+				      MIN(version, 2), id);
+	if (resource == NULL) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &frame_timing_implementation,
+				       data, NULL);
+}
+
+static void
+dump_output_timeline(struct weston_output *output)
+{
+	struct weston_frame_timeline *tl = &output->timeline;
+	struct weston_frame_timing *frame, *worst = NULL;
+	uint64_t sum[WESTON_FRAME_PHASE_COUNT] = { 0 };
+	uint32_t max[WESTON_FRAME_PHASE_COUNT] = { 0 };
+	uint32_t seq, count, total, worst_total = 0;
+	uint32_t input_frames = 0, input_max = 0;
+	uint64_t input_sum = 0;
+	int i;
+
+	count = timeline_count(tl);
+	if (count == 0)
+		return;
+
+	for (seq = tl->seq - count; seq != tl->seq; seq++) {
+		frame = timeline_frame(tl, seq);
+		total = 0;
+		for (i = 0; i < WESTON_FRAME_PHASE_COUNT; i++) {
+			sum[i] += frame->phase_us[i];
+			if (frame->phase_us[i] > max[i])
+				max[i] = frame->phase_us[i];
+			if (i != WESTON_FRAME_PHASE_PRESENT)
+				total += frame->phase_us[i];
+		}
+
+		if (frame->input_us) {
+			input_frames++;
+			input_sum += frame->input_us;
+			if (frame->input_us > input_max)
+				input_max = frame->input_us;
+		}
+
+		if (!worst || total > worst_total) {
+			worst = frame;
+			worst_total = total;
+		}
+	}
+
+	weston_log("frame timing for output %s, last %u frames:\n",
+		   output->name ? output->name : "(unnamed)", count);
+	for (i = 0; i < WESTON_FRAME_PHASE_COUNT; i++)
+		weston_log_continue(STAMP_SPACE "%-16s avg %8.3f ms, "
+				    "max %8.3f ms\n", phase_names[i],
+				    sum[i] / 1000.0 / count, max[i] / 1000.0);
+
+	weston_log_continue(STAMP_SPACE "slowest frame %u took %.3f ms "
+			    "before present:", worst->seq,
+			    worst_total / 1000.0);
+	for (i = 0; i < WESTON_FRAME_PHASE_PRESENT; i++)
+		weston_log_continue(" %s %.3f", phase_names[i],
+				    worst->phase_us[i] / 1000.0);
+	weston_log_continue("\n");
+
+	if (input_frames)
+		weston_log_continue(STAMP_SPACE "input to repaint avg %.3f ms, "
+				    "max %.3f ms over %u frames\n",
+				    input_sum / 1000.0 / input_frames,
+				    input_max / 1000.0, input_frames);
+
+	if (output->compositor->predictive_repaint)
+		weston_log_continue(STAMP_SPACE "predicted repaint %.3f ms, "
+				    "margin %.3f ms%s\n",
+				    weston_frame_timing_predict_repaint(output)
+				    / 1000.0,
+				    output->compositor->repaint_margin_us
+				    / 1000.0,
+				    output->repaint_fallback ?
+				    ", falling back after a miss" : "");
+}
+
+static void
+frame_timing_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
+		     void *data)
+{
+	struct frame_timing *timing = data;
+	struct weston_output *output;
+
+	wl_list_for_each(output, &timing->ec->output_list, link)
+		dump_output_timeline(output);
+
+	if (timing->ec->coalesce_motion)
+		weston_log("merged %llu motion events\n",
+			   (unsigned long long)
+			   timing->ec->motion_events_merged);
+}
+
+static void
+frame_timing_destroy(struct wl_listener *listener, void *data)
+{
+	struct frame_timing *timing =
+		container_of(listener, struct frame_timing, destroy_listener);
+
+	if (timing->global)
+		wl_global_destroy(timing->global);
+	free(timing);
+}
+
+void
+frame_timing_create(struct weston_compositor *ec)
+{
+	struct weston_config_section *section;
+	struct frame_timing *timing;
+	int protocol;
+
+	timing = zalloc(sizeof *timing);
+	if (timing == NULL)
+		return;
+
+	timing->ec = ec;
+
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_bool(section, "frame-timing-protocol",
+				       &protocol, 0);
+	if (protocol)
+		timing->global =
+			wl_global_create(ec->wl_display,
+					 &weston_frame_timing_interface, 2,
+					 timing, bind_frame_timing);
+
+	weston_compositor_add_debug_binding(ec, KEY_T,
+					    frame_timing_binding, timing);
+
+	timing->destroy_listener.notify = frame_timing_destroy;
+	wl_signal_add(&ec->destroy_signal, &timing->destroy_listener);
+}
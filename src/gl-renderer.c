@@ -29,6 +29,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <float.h>
+#include <limits.h>
 #include <assert.h>
 #include <linux/input.h>
 
@@ -50,6 +51,16 @@ struct gl_shader {
 
 #define BUFFER_DAMAGE_COUNT 2
 
+/* Damage rectangles are merged for upload as long as the merged
+ * rectangle wastes at most this fraction of its pixels. */
+#define UPLOAD_MERGE_WASTE 0.25
+#define UPLOAD_MAX_RECTS 32
+
+struct upload_rect {
+	pixman_box32_t box; /* in buffer coordinates */
+	int area; /* damaged pixels within box */
+};
+
 enum gl_border_status {
 	BORDER_STATUS_CLEAN = 0,
 	BORDER_TOP_DIRTY = 1 << GL_RENDERER_BORDER_TOP,
@@ -81,6 +92,33 @@ enum buffer_type {
 	BUFFER_TYPE_EGL
 };
 
+/* Number of texture_region() results kept per surface, enough for the
+ * opaque and blended parts of a view on two outputs. */
+#define GEOMETRY_CACHE_SIZE 4
+
+/* Everything besides the regions that the vertices depend on */
+struct gl_geometry_key {
+	struct weston_matrix matrix;
+	int32_t transform_enabled;
+	float x, y;
+	int32_t width, height;
+	struct weston_buffer_viewport viewport;
+	int32_t pitch, buffer_height, y_inverted;
+};
+
+struct gl_geometry {
+	struct wl_list link;
+
+	struct gl_geometry_key key;
+	struct wl_array rects; /* damage rects, then surface rects */
+	int nrects, nsurf;
+
+	struct wl_array vertices;
+	struct wl_array vtxcnt;
+	int nfans;
+	GLuint vbo;
+};
+
 struct gl_surface_state {
 	GLfloat color[4];
 	struct gl_shader *shader;
@@ -102,6 +140,10 @@ struct gl_surface_state {
 
 	struct weston_surface *surface;
 
+	/* Most recently used first */
+	struct wl_list geometry_cache;
+	int geometry_count;
+
 	struct wl_listener surface_destroy_listener;
 	struct wl_listener renderer_destroy_listener;
 };
@@ -139,6 +181,20 @@ struct gl_renderer {
 
 	int has_egl_buffer_age;
 
+#if defined(GL_NV_pixel_buffer_object) && defined(GL_OES_mapbuffer)
+	PFNGLMAPBUFFEROESPROC map_buffer;
+	PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+#endif
+	GLuint upload_pbo;
+	struct wl_array upload_staging;
+
+	int upload_debug;
+	struct weston_binding *upload_binding;
+	/* wl_shm uploads since the last repaint */
+	uint32_t upload_bytes;
+	uint32_t upload_calls;
+	uint32_t upload_damage_rects;
+
 	struct gl_shader texture_shader_rgba;
 	struct gl_shader texture_shader_rgbx;
 	struct gl_shader texture_shader_egl_external;
@@ -289,11 +345,10 @@ calculate_edges(struct weston_view *ev, pixman_box32_t *rect,
 
 static int
 texture_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+		pixman_region32_t *surf_region,
+		struct wl_array *vertices, struct wl_array *vtxcnts)
 {
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
-	struct weston_compositor *ec = ev->surface->compositor;
-	struct gl_renderer *gr = get_renderer(ec);
 	GLfloat *v, inv_width, inv_height;
 	unsigned int *vtxcnt, nvtx = 0;
 	pixman_box32_t *rects, *surf_rects;
@@ -305,8 +360,8 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	/* worst case we can have 8 vertices per rect (ie. clipped into
 	 * an octagon):
 	 */
-	v = wl_array_add(&gr->vertices, nrects * nsurf * 8 * 4 * sizeof *v);
-	vtxcnt = wl_array_add(&gr->vtxcnt, nrects * nsurf * sizeof *vtxcnt);
+	v = wl_array_add(vertices, nrects * nsurf * 8 * 4 * sizeof *v);
+	vtxcnt = wl_array_add(vtxcnts, nrects * nsurf * sizeof *vtxcnt);
 
 	inv_width = 1.0 / gs->pitch;
         inv_height = 1.0 / gs->height;
@@ -403,12 +458,143 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 	free(buffer);
 }
 
+static void
+geometry_destroy(struct gl_geometry *geometry)
+{
+	wl_list_remove(&geometry->link);
+	if (geometry->vbo)
+		glDeleteBuffers(1, &geometry->vbo);
+	wl_array_release(&geometry->rects);
+	wl_array_release(&geometry->vertices);
+	wl_array_release(&geometry->vtxcnt);
+	free(geometry);
+}
+
+static void
+geometry_key_init(struct gl_geometry_key *key, struct weston_view *ev)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+
+	/* Zero the padding too, keys are compared with memcmp() */
+	memset(key, 0, sizeof *key);
+
+	key->transform_enabled = ev->transform.enabled;
+	if (ev->transform.enabled)
+		key->matrix = ev->transform.matrix;
+	key->x = ev->geometry.x;
+	key->y = ev->geometry.y;
+	key->width = ev->surface->width;
+	key->height = ev->surface->height;
+	key->viewport = ev->surface->buffer_viewport;
+	key->pitch = gs->pitch;
+	key->buffer_height = gs->height;
+	key->y_inverted = gs->y_inverted;
+}
+
+static int
+geometry_matches(struct gl_geometry *geometry, struct gl_geometry_key *key,
+		 pixman_box32_t *rects, int nrects,
+		 pixman_box32_t *surf_rects, int nsurf)
+{
+	pixman_box32_t *cached = geometry->rects.data;
+
+	return geometry->nrects == nrects && geometry->nsurf == nsurf &&
+		memcmp(&geometry->key, key, sizeof *key) == 0 &&
+		memcmp(cached, rects, nrects * sizeof *rects) == 0 &&
+		memcmp(cached + nrects, surf_rects,
+		       nsurf * sizeof *surf_rects) == 0;
+}
+
+/* Find the vertices of the view clipped to region and surf_region,
+ * computing them only if they are not cached from an earlier frame.
+ * Returns the geometry with its VBO bound, or NULL on allocation
+ * failure. */
+static struct gl_geometry *
+geometry_cache_get(struct weston_view *ev, pixman_region32_t *region,
+		   pixman_region32_t *surf_region)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_geometry *geometry;
+	struct gl_geometry_key key;
+	pixman_box32_t *rects, *surf_rects, *cached;
+	unsigned int *vtxcnt;
+	int i, nrects, nsurf, nvtx;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	surf_rects = pixman_region32_rectangles(surf_region, &nsurf);
+	geometry_key_init(&key, ev);
+
+	wl_list_for_each(geometry, &gs->geometry_cache, link) {
+		if (!geometry_matches(geometry, &key, rects, nrects,
+				      surf_rects, nsurf))
+			continue;
+
+		wl_list_remove(&geometry->link);
+		wl_list_insert(&gs->geometry_cache, &geometry->link);
+		glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo);
+
+		return geometry;
+	}
+
+	if (gs->geometry_count < GEOMETRY_CACHE_SIZE) {
+		geometry = zalloc(sizeof *geometry);
+		if (!geometry)
+			return NULL;
+		wl_array_init(&geometry->rects);
+		wl_array_init(&geometry->vertices);
+		wl_array_init(&geometry->vtxcnt);
+		wl_list_insert(&gs->geometry_cache, &geometry->link);
+		gs->geometry_count++;
+	} else {
+		/* Recycle the least recently used one */
+		geometry = container_of(gs->geometry_cache.prev,
+					struct gl_geometry, link);
+		wl_list_remove(&geometry->link);
+		wl_list_insert(&gs->geometry_cache, &geometry->link);
+	}
+
+	geometry->rects.size = 0;
+	geometry->vertices.size = 0;
+	geometry->vtxcnt.size = 0;
+	geometry->nrects = 0;
+	geometry->nsurf = 0;
+
+	cached = wl_array_add(&geometry->rects,
+			      (nrects + nsurf) * sizeof *cached);
+	if (!cached) {
+		memset(&geometry->key, 0, sizeof geometry->key);
+		return NULL;
+	}
+	memcpy(cached, rects, nrects * sizeof *rects);
+	memcpy(cached + nrects, surf_rects, nsurf * sizeof *surf_rects);
+	geometry->key = key;
+	geometry->nrects = nrects;
+	geometry->nsurf = nsurf;
+
+	geometry->nfans = texture_region(ev, region, surf_region,
+					 &geometry->vertices,
+					 &geometry->vtxcnt);
+
+	vtxcnt = geometry->vtxcnt.data;
+	for (i = 0, nvtx = 0; i < geometry->nfans; i++)
+		nvtx += vtxcnt[i];
+
+	if (!geometry->vbo)
+		glGenBuffers(1, &geometry->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, geometry->vbo);
+	glBufferData(GL_ARRAY_BUFFER, nvtx * 4 * sizeof(GLfloat),
+		     geometry->vertices.data, GL_DYNAMIC_DRAW);
+
+	return geometry;
+}
+
 static void
 repaint_region(struct weston_view *ev, pixman_region32_t *region,
 		pixman_region32_t *surf_region)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_geometry *geometry;
 	GLfloat *v;
 	unsigned int *vtxcnt;
 	int i, first, nfans;
@@ -421,10 +607,18 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	 * polygon for each pair, and store it as a triangle fan if
 	 * it has a non-zero area (at least 3 vertices1, actually).
 	 */
-	nfans = texture_region(ev, region, surf_region);
-
-	v = gr->vertices.data;
-	vtxcnt = gr->vtxcnt.data;
+	geometry = geometry_cache_get(ev, region, surf_region);
+	if (geometry) {
+		/* Offsets into the VBO */
+		v = NULL;
+		vtxcnt = geometry->vtxcnt.data;
+		nfans = geometry->nfans;
+	} else {
+		nfans = texture_region(ev, region, surf_region,
+				       &gr->vertices, &gr->vtxcnt);
+		v = gr->vertices.data;
+		vtxcnt = gr->vtxcnt.data;
+	}
 
 	/* position: */
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
@@ -444,6 +638,9 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	glDisableVertexAttribArray(1);
 	glDisableVertexAttribArray(0);
 
+	if (geometry)
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
 	gr->vertices.size = 0;
 	gr->vtxcnt.size = 0;
 }
@@ -953,6 +1150,15 @@ gl_renderer_repaint_output(struct weston_output *output,
 	}
 
 	go->border_status = BORDER_STATUS_CLEAN;
+
+	if (gr->upload_debug && gr->upload_damage_rects)
+		weston_log("%s: uploaded %u bytes in %u transfers "
+			   "for %u damage rectangles\n", output->name,
+			   gr->upload_bytes, gr->upload_calls,
+			   gr->upload_damage_rects);
+	gr->upload_bytes = 0;
+	gr->upload_calls = 0;
+	gr->upload_damage_rects = 0;
 }
 
 static int
@@ -984,6 +1190,235 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static int
+upload_rect_area(const pixman_box32_t *box)
+{
+	return (box->x2 - box->x1) * (box->y2 - box->y1);
+}
+
+static void
+upload_rect_union(struct upload_rect *a, const struct upload_rect *b)
+{
+	a->box.x1 = min(a->box.x1, b->box.x1);
+	a->box.y1 = min(a->box.y1, b->box.y1);
+	a->box.x2 = max(a->box.x2, b->box.x2);
+	a->box.y2 = max(a->box.y2, b->box.y2);
+	a->area += b->area;
+}
+
+/* Pixels uploaded needlessly if a and b were merged */
+static int
+upload_rect_waste(const struct upload_rect *a, const struct upload_rect *b)
+{
+	struct upload_rect u = *a;
+
+	upload_rect_union(&u, b);
+
+	return upload_rect_area(&u.box) - u.area;
+}
+
+static int
+upload_rect_should_merge(const struct upload_rect *a,
+			 const struct upload_rect *b)
+{
+	struct upload_rect u = *a;
+
+	upload_rect_union(&u, b);
+
+	return upload_rect_area(&u.box) - u.area <=
+		upload_rect_area(&u.box) * UPLOAD_MERGE_WASTE;
+}
+
+/* Turn the texture damage into at most UPLOAD_MAX_RECTS rectangles in
+ * buffer coordinates, merging neighbours while little is wasted. */
+static int
+coalesce_upload_rects(struct weston_surface *surface,
+		      pixman_region32_t *damage, struct upload_rect *rects)
+{
+	pixman_box32_t *boxes;
+	struct upload_rect r;
+	int i, j, n, nboxes, best, waste, best_waste, merged;
+
+	boxes = pixman_region32_rectangles(damage, &nboxes);
+
+	n = 0;
+	for (i = 0; i < nboxes; i++) {
+		r.box = weston_surface_to_buffer_rect(surface, boxes[i]);
+		r.area = upload_rect_area(&r.box);
+
+		if (n < UPLOAD_MAX_RECTS) {
+			rects[n++] = r;
+			continue;
+		}
+
+		best = 0;
+		best_waste = INT_MAX;
+		for (j = 0; j < n; j++) {
+			waste = upload_rect_waste(&rects[j], &r);
+			if (waste < best_waste) {
+				best = j;
+				best_waste = waste;
+			}
+		}
+		upload_rect_union(&rects[best], &r);
+	}
+
+	do {
+		merged = 0;
+		for (i = 0; i < n; i++) {
+			for (j = i + 1; j < n; j++) {
+				if (!upload_rect_should_merge(&rects[i],
+							      &rects[j]))
+					continue;
+
+				upload_rect_union(&rects[i], &rects[j]);
+				rects[j--] = rects[--n];
+				merged = 1;
+			}
+		}
+	} while (merged);
+
+	return n;
+}
+
+static int
+upload_row_stride(const struct upload_rect *rect, int bpp)
+{
+	/* Rows stay aligned to the default GL_UNPACK_ALIGNMENT of 4 */
+	return ((rect->box.x2 - rect->box.x1) * bpp + 3) & ~3;
+}
+
+static void
+pack_upload_rects(struct upload_rect *rects, int n, int bpp,
+		  const uint8_t *src, int src_stride, uint8_t *dst)
+{
+	int i, y, width, stride;
+
+	for (i = 0; i < n; i++) {
+		width = (rects[i].box.x2 - rects[i].box.x1) * bpp;
+		stride = upload_row_stride(&rects[i], bpp);
+
+		for (y = rects[i].box.y1; y < rects[i].box.y2; y++) {
+			memcpy(dst, src + y * src_stride +
+			       rects[i].box.x1 * bpp, width);
+			dst += stride;
+		}
+	}
+}
+
+/* Copy the damaged rectangles tightly packed into a pixel buffer object
+ * if there is one, or a staging array otherwise, and upload them from
+ * there.  Unlike uploading straight from the shm pool this needs no
+ * GL_EXT_unpack_subimage, and with a PBO the transfers to the texture
+ * need not block. */
+static void
+upload_rects_packed(struct gl_renderer *gr, struct weston_buffer *buffer,
+		    struct upload_rect *rects, int n,
+		    GLenum format, int pixel_type, int bpp)
+{
+	uint8_t *data = NULL, *base;
+	size_t size = 0, offset = 0;
+	int i, use_pbo = 0;
+
+	for (i = 0; i < n; i++)
+		size += upload_row_stride(&rects[i], bpp) *
+			(rects[i].box.y2 - rects[i].box.y1);
+
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+#endif
+
+#if defined(GL_NV_pixel_buffer_object) && defined(GL_OES_mapbuffer)
+	if (gr->upload_pbo) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, gr->upload_pbo);
+		/* Orphan the previous contents, they may still be in use */
+		glBufferData(GL_PIXEL_UNPACK_BUFFER_NV, size, NULL,
+			     GL_STREAM_DRAW);
+		data = gr->map_buffer(GL_PIXEL_UNPACK_BUFFER_NV,
+				      GL_WRITE_ONLY_OES);
+		if (data)
+			use_pbo = 1;
+		else
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+	}
+#endif
+
+	if (!use_pbo) {
+		if (gr->upload_staging.alloc < size &&
+		    !wl_array_add(&gr->upload_staging,
+				  size - gr->upload_staging.size))
+			return;
+		data = gr->upload_staging.data;
+	}
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	pack_upload_rects(rects, n, bpp,
+			  wl_shm_buffer_get_data(buffer->shm_buffer),
+			  wl_shm_buffer_get_stride(buffer->shm_buffer), data);
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	/* With a PBO bound the pixel pointers are offsets into it */
+	base = data;
+#if defined(GL_NV_pixel_buffer_object) && defined(GL_OES_mapbuffer)
+	if (use_pbo) {
+		gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER_NV);
+		base = NULL;
+	}
+#endif
+
+	for (i = 0; i < n; i++) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0,
+				rects[i].box.x1, rects[i].box.y1,
+				rects[i].box.x2 - rects[i].box.x1,
+				rects[i].box.y2 - rects[i].box.y1,
+				format, pixel_type, base + offset);
+		offset += upload_row_stride(&rects[i], bpp) *
+			(rects[i].box.y2 - rects[i].box.y1);
+	}
+
+#if defined(GL_NV_pixel_buffer_object) && defined(GL_OES_mapbuffer)
+	if (use_pbo)
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER_NV, 0);
+#endif
+
+	gr->upload_bytes += size;
+	gr->upload_calls += n;
+}
+
+#ifdef GL_EXT_unpack_subimage
+static void
+upload_rects_direct(struct gl_renderer *gr, struct weston_surface *surface,
+		    struct weston_buffer *buffer, struct upload_rect *rects,
+		    int n, GLenum format, int pixel_type, int bpp)
+{
+	struct gl_surface_state *gs = get_surface_state(surface);
+	void *data;
+	int i;
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (i = 0; i < n; i++) {
+		pixman_box32_t r = rects[i].box;
+
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
+				r.x2 - r.x1, r.y2 - r.y1,
+				format, pixel_type, data);
+		gr->upload_bytes += upload_rect_area(&r) * bpp;
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	gr->upload_calls += n;
+}
+#endif
+
 static void
 gl_renderer_flush_damage(struct weston_surface *surface)
 {
@@ -991,15 +1426,10 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	struct gl_surface_state *gs = get_surface_state(surface);
 	struct weston_buffer *buffer = gs->buffer_ref.buffer;
 	struct weston_view *view;
-	int texture_used;
+	struct upload_rect rects[UPLOAD_MAX_RECTS];
+	int texture_used, n;
 	GLenum format;
-	int pixel_type;
-
-#ifdef GL_EXT_unpack_subimage
-	pixman_box32_t *rectangles;
-	void *data;
-	int i, n;
-#endif
+	int pixel_type, bpp;
 
 	pixman_region32_union(&gs->texture_damage,
 			      &gs->texture_damage, &surface->damage);
@@ -1031,20 +1461,29 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	case WL_SHM_FORMAT_ARGB8888:
 		format = GL_BGRA_EXT;
 		pixel_type = GL_UNSIGNED_BYTE;
+		bpp = 4;
 		break;
 	case WL_SHM_FORMAT_RGB565:
 		format = GL_RGB;
 		pixel_type = GL_UNSIGNED_SHORT_5_6_5;
+		bpp = 2;
 		break;
 	default:
 		weston_log("warning: unknown shm buffer format\n");
 		format = GL_BGRA_EXT;
 		pixel_type = GL_UNSIGNED_BYTE;
+		bpp = 4;
 	}
 
 	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
 
-	if (!gr->has_unpack_subimage) {
+	if (gs->needs_full_upload) {
+		gr->upload_bytes += gs->pitch * buffer->height * bpp;
+		gr->upload_calls++;
+		gr->upload_damage_rects++;
+	}
+
+	if (!gr->has_unpack_subimage && gs->needs_full_upload) {
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		glTexImage2D(GL_TEXTURE_2D, 0, format,
 			     gs->pitch, buffer->height, 0,
@@ -1056,36 +1495,35 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	}
 
 #ifdef GL_EXT_unpack_subimage
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
-	data = wl_shm_buffer_get_data(buffer->shm_buffer);
-
 	if (gs->needs_full_upload) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->pitch);
 		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
 		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
 		wl_shm_buffer_begin_access(buffer->shm_buffer);
 		glTexSubImage2D(GL_TEXTURE_2D, 0,
 				0, 0, gs->pitch, buffer->height,
-				format, pixel_type, data);
+				format, pixel_type,
+				wl_shm_buffer_get_data(buffer->shm_buffer));
 		wl_shm_buffer_end_access(buffer->shm_buffer);
 		goto done;
 	}
+#endif
 
-	rectangles = pixman_region32_rectangles(&gs->texture_damage, &n);
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < n; i++) {
-		pixman_box32_t r;
-
-		r = weston_surface_to_buffer_rect(surface, rectangles[i]);
+	gr->upload_damage_rects +=
+		pixman_region32_n_rects(&gs->texture_damage);
+	n = coalesce_upload_rects(surface, &gs->texture_damage, rects);
 
-		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, r.x1);
-		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, r.y1);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, r.x1, r.y1,
-				r.x2 - r.x1, r.y2 - r.y1,
-				format, pixel_type, data);
+#ifdef GL_EXT_unpack_subimage
+	/* Without a PBO the driver copies out of the pool either way */
+	if (gr->has_unpack_subimage && !gr->upload_pbo) {
+		upload_rects_direct(gr, surface, buffer, rects, n,
+				    format, pixel_type, bpp);
+		goto done;
 	}
-	wl_shm_buffer_end_access(buffer->shm_buffer);
 #endif
 
+	upload_rects_packed(gr, buffer, rects, n, format, pixel_type, bpp);
+
 done:
 	pixman_region32_fini(&gs->texture_damage);
 	pixman_region32_init(&gs->texture_damage);
@@ -1303,6 +1741,7 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 static void
 surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 {
+	struct gl_geometry *geometry, *next;
 	int i;
 
 	wl_list_remove(&gs->surface_destroy_listener.link);
@@ -1312,6 +1751,9 @@ surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
 
 	glDeleteTextures(gs->num_textures, gs->textures);
 
+	wl_list_for_each_safe(geometry, next, &gs->geometry_cache, link)
+		geometry_destroy(geometry);
+
 	for (i = 0; i < gs->num_images; i++)
 		gr->destroy_image(gr->egl_display, gs->images[i]);
 
@@ -1368,6 +1810,7 @@ gl_renderer_create_surface(struct weston_surface *surface)
 	gs->surface = surface;
 
 	pixman_region32_init(&gs->texture_damage);
+	wl_list_init(&gs->geometry_cache);
 	surface->renderer_state = gs;
 
 	gs->surface_destroy_listener.notify =
@@ -1755,6 +2198,9 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
+	if (gr->upload_pbo)
+		glDeleteBuffers(1, &gr->upload_pbo);
+
 	/* Work around crash in egl_dri2.c's dri2_make_current() - when does this apply? */
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
@@ -1765,9 +2211,11 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->upload_staging);
 
 	weston_binding_destroy(gr->fragment_binding);
 	weston_binding_destroy(gr->fan_binding);
+	weston_binding_destroy(gr->upload_binding);
 
 	free(gr);
 }
@@ -1962,6 +2410,16 @@ fan_debug_repaint_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 	weston_compositor_damage_all(compositor);
 }
 
+static void
+upload_debug_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
+		     void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct gl_renderer *gr = get_renderer(compositor);
+
+	gr->upload_debug = !gr->upload_debug;
+}
+
 static int
 gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
@@ -2035,6 +2493,17 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (strstr(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+#if defined(GL_NV_pixel_buffer_object) && defined(GL_OES_mapbuffer)
+	if (strstr(extensions, "GL_NV_pixel_buffer_object") &&
+	    strstr(extensions, "GL_OES_mapbuffer")) {
+		gr->map_buffer = (void *) eglGetProcAddress("glMapBufferOES");
+		gr->unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBufferOES");
+		if (gr->map_buffer && gr->unmap_buffer)
+			glGenBuffers(1, &gr->upload_pbo);
+	}
+#endif
+
 	extensions =
 		(const char *) eglQueryString(gr->egl_display, EGL_EXTENSIONS);
 	if (!extensions) {
@@ -2078,12 +2547,18 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 		weston_compositor_add_debug_binding(ec, KEY_F,
 						    fan_debug_repaint_binding,
 						    ec);
+	gr->upload_binding =
+		weston_compositor_add_debug_binding(ec, KEY_U,
+						    upload_debug_binding,
+						    ec);
 
 	weston_log("GL ES 2 renderer features:\n");
 	weston_log_continue(STAMP_SPACE "read-back format: %s\n",
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
 			    gr->has_unpack_subimage ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBO: %s\n",
+			    gr->upload_pbo ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
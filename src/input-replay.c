@@ -0,0 +1,464 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "compositor.h"
+#include "evdev.h"
+
+/* Plays back a recording made with [core] input-record=, through the
+ * same evdev dispatch code the live devices use, on a seat of its
+ * own. */
+
+/* Events handled per main loop iteration at maximum speed, so that
+ * clients and repaints still get to run. */
+#define REPLAY_BATCH 256
+
+struct replay_device {
+	struct wl_list link;
+	uint32_t id;
+	struct evdev_device_info info;
+	struct evdev_device *device;
+};
+
+struct input_replay {
+	struct weston_compositor *compositor;
+	struct weston_seat seat;
+	struct wl_listener destroy_listener;
+	struct wl_list device_list;
+
+	char *path;
+	FILE *fp;
+	char *line;
+	size_t line_size;
+
+	int maximum_speed;
+	int repeat;
+	int exit_when_done;
+
+	/* The next event, read ahead to know when it is due. */
+	int have_event;
+	struct replay_device *event_device;
+	struct input_event event;
+
+	uint64_t first_event_us;
+	uint64_t start_us;
+	uint64_t events;
+	uint64_t merged_before;
+
+	struct wl_event_source *timer;
+	struct wl_event_source *busy_source;
+	int busy_fd;
+};
+
+static uint64_t
+event_time_us(const struct input_event *e)
+{
+	return (uint64_t) e->time.tv_sec * 1000000 + e->time.tv_usec;
+}
+
+static struct replay_device *
+replay_find_device(struct input_replay *replay, uint32_t id)
+{
+	struct replay_device *rd;
+
+	wl_list_for_each(rd, &replay->device_list, link)
+		if (rd->id == id)
+			return rd;
+
+	return NULL;
+}
+
+static void
+replay_device_destroy(struct replay_device *rd)
+{
+	if (rd->device)
+		evdev_device_destroy(rd->device);
+	wl_list_remove(&rd->link);
+	free(rd);
+}
+
+static void
+replay_destroy_devices(struct input_replay *replay)
+{
+	struct replay_device *rd, *next;
+
+	wl_list_for_each_safe(rd, next, &replay->device_list, link)
+		replay_device_destroy(rd);
+}
+
+static void
+replay_add_device(struct input_replay *replay, struct replay_device *rd)
+{
+	struct weston_compositor *ec = replay->compositor;
+	struct evdev_device *device;
+	char path[32];
+
+	snprintf(path, sizeof path, "replay-%u", rd->id);
+	device = evdev_device_create_from_info(&replay->seat, path, &rd->info);
+	if (device == EVDEV_UNHANDLED_DEVICE || device == NULL) {
+		weston_log("input replay: not using device %u, %s\n",
+			   rd->id, rd->info.name);
+		return;
+	}
+
+	if (!wl_list_empty(&ec->output_list))
+		evdev_device_set_output(device,
+					container_of(ec->output_list.next,
+						     struct weston_output,
+						     link));
+	rd->device = device;
+}
+
+static void
+parse_bits(char *p, unsigned long *bits, unsigned int count)
+{
+	unsigned long bit;
+	char *end;
+
+	for (;;) {
+		bit = strtoul(p, &end, 10);
+		if (end == p)
+			break;
+		if (bit < count)
+			bits[LONG(bit)] |= BIT(bit);
+		p = end;
+	}
+}
+
+/* Handle the device lines up to the next event and read that one.
+ * Returns 0 at the end of the recording. */
+static int
+replay_read_event(struct input_replay *replay)
+{
+	struct replay_device *rd;
+	struct input_absinfo abs;
+	unsigned int id, code, type, bus, vendor, product, version;
+	char tag[16];
+	long sec, usec;
+	int value, n;
+
+	while (getline(&replay->line, &replay->line_size, replay->fp) > 0) {
+		if (sscanf(replay->line, "%15s %u %n", tag, &id, &n) < 2)
+			continue;
+
+		if (strcmp(tag, "event") == 0) {
+			if (sscanf(replay->line + n, "%ld %ld %u %u %d",
+				   &sec, &usec, &type, &code, &value) != 5)
+				continue;
+			rd = replay_find_device(replay, id);
+			if (!rd || !rd->device)
+				continue;
+
+			replay->event_device = rd;
+			replay->event.time.tv_sec = sec;
+			replay->event.time.tv_usec = usec;
+			replay->event.type = type;
+			replay->event.code = code;
+			replay->event.value = value;
+			return 1;
+		}
+
+		if (strcmp(tag, "device") == 0) {
+			rd = zalloc(sizeof *rd);
+			if (rd == NULL)
+				return 0;
+			rd->id = id;
+			snprintf(rd->info.name, sizeof rd->info.name, "%s",
+				 replay->line + n);
+			rd->info.name[strcspn(rd->info.name, "\n")] = '\0';
+			wl_list_insert(replay->device_list.prev, &rd->link);
+			continue;
+		}
+
+		rd = replay_find_device(replay, id);
+		if (rd == NULL)
+			continue;
+
+		if (strcmp(tag, "id") == 0 &&
+		    sscanf(replay->line + n, "%u %u %u %u",
+			   &bus, &vendor, &product, &version) == 4) {
+			rd->info.id.bustype = bus;
+			rd->info.id.vendor = vendor;
+			rd->info.id.product = product;
+			rd->info.id.version = version;
+		} else if (strcmp(tag, "prop") == 0) {
+			parse_bits(replay->line + n, rd->info.prop_bits,
+				   INPUT_PROP_CNT);
+		} else if (strcmp(tag, "ev") == 0) {
+			parse_bits(replay->line + n, rd->info.ev_bits, EV_CNT);
+		} else if (strcmp(tag, "key") == 0) {
+			parse_bits(replay->line + n, rd->info.key_bits,
+				   KEY_CNT);
+		} else if (strcmp(tag, "rel") == 0) {
+			parse_bits(replay->line + n, rd->info.rel_bits,
+				   REL_CNT);
+		} else if (strcmp(tag, "abs") == 0 &&
+			   sscanf(replay->line + n, "%u %d %d %d %d %d %d",
+				  &code, &abs.value, &abs.minimum,
+				  &abs.maximum, &abs.fuzz, &abs.flat,
+				  &abs.resolution) == 7 &&
+			   code < ABS_CNT) {
+			rd->info.abs_bits[LONG(code)] |= BIT(code);
+			rd->info.absinfo[code] = abs;
+		} else if (strcmp(tag, "added") == 0) {
+			replay_add_device(replay, rd);
+		} else if (strcmp(tag, "removed") == 0) {
+			replay_device_destroy(rd);
+		}
+	}
+
+	return 0;
+}
+
+static void
+replay_stop(struct input_replay *replay)
+{
+	if (replay->timer) {
+		wl_event_source_remove(replay->timer);
+		replay->timer = NULL;
+	}
+	if (replay->busy_source) {
+		wl_event_source_remove(replay->busy_source);
+		replay->busy_source = NULL;
+	}
+	if (replay->busy_fd >= 0) {
+		close(replay->busy_fd);
+		replay->busy_fd = -1;
+	}
+}
+
+static void
+replay_begin(struct input_replay *replay)
+{
+	replay->have_event = replay_read_event(replay);
+	replay->first_event_us = event_time_us(&replay->event);
+	replay->start_us = weston_frame_timing_now_us();
+	replay->events = 0;
+	replay->merged_before = replay->compositor->motion_events_merged;
+}
+
+static void
+replay_finish(struct input_replay *replay)
+{
+	struct weston_compositor *ec = replay->compositor;
+	uint64_t elapsed;
+
+	elapsed = weston_frame_timing_now_us() - replay->start_us;
+	weston_log("input replay: %llu events in %.3f ms, %.0f events/s, "
+		   "%llu motion events merged\n",
+		   (unsigned long long) replay->events, elapsed / 1000.0,
+		   elapsed ? replay->events * 1000000.0 / elapsed : 0.0,
+		   (unsigned long long)
+		   (ec->motion_events_merged - replay->merged_before));
+
+	if (--replay->repeat > 0) {
+		replay_destroy_devices(replay);
+		rewind(replay->fp);
+		replay_begin(replay);
+		return;
+	}
+
+	replay_stop(replay);
+	if (replay->exit_when_done)
+		wl_display_terminate(ec->wl_display);
+}
+
+/* Feed the events that are due, at most budget of them. */
+static void
+replay_run(struct input_replay *replay, int budget)
+{
+	uint64_t now, due;
+
+	now = weston_frame_timing_now_us();
+	while (replay->have_event && budget-- > 0) {
+		if (!replay->maximum_speed) {
+			due = replay->start_us +
+				event_time_us(&replay->event) -
+				replay->first_event_us;
+			if (due > now) {
+				wl_event_source_timer_update(replay->timer,
+					(due - now + 999) / 1000);
+				return;
+			}
+		}
+
+		evdev_device_process_event(replay->event_device->device,
+					   &replay->event, 0);
+		replay->events++;
+		replay->have_event = replay_read_event(replay);
+	}
+
+	if (!replay->have_event)
+		replay_finish(replay);
+
+	/* Started over for another round. */
+	if (replay->have_event && !replay->maximum_speed)
+		wl_event_source_timer_update(replay->timer, 1);
+}
+
+static int
+replay_timer_handler(void *data)
+{
+	struct input_replay *replay = data;
+
+	replay_run(replay, INT32_MAX);
+
+	return 1;
+}
+
+/* The eventfd is never read, so it stays readable and we get called on
+ * every main loop iteration. */
+static int
+replay_busy_handler(int fd, uint32_t mask, void *data)
+{
+	struct input_replay *replay = data;
+
+	replay_run(replay, REPLAY_BATCH);
+
+	return 1;
+}
+
+static void
+replay_start(void *data)
+{
+	struct input_replay *replay = data;
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(replay->compositor->wl_display);
+
+	weston_log("input replay: playing %s at %s speed\n", replay->path,
+		   replay->maximum_speed ? "maximum" : "original");
+
+	replay_begin(replay);
+
+	if (replay->maximum_speed) {
+		replay->busy_fd = eventfd(1, EFD_CLOEXEC);
+		if (replay->busy_fd >= 0)
+			replay->busy_source =
+				wl_event_loop_add_fd(loop, replay->busy_fd,
+						     WL_EVENT_READABLE,
+						     replay_busy_handler,
+						     replay);
+		if (replay->busy_source == NULL) {
+			weston_log("input replay: failed to start\n");
+			replay_stop(replay);
+		}
+	} else {
+		replay->timer = wl_event_loop_add_timer(loop,
+							replay_timer_handler,
+							replay);
+		if (replay->timer)
+			replay_run(replay, INT32_MAX);
+	}
+}
+
+static void
+replay_destroy(struct wl_listener *listener, void *data)
+{
+	struct input_replay *replay =
+		container_of(listener, struct input_replay, destroy_listener);
+
+	replay_stop(replay);
+	replay_destroy_devices(replay);
+	weston_seat_release(&replay->seat);
+
+	fclose(replay->fp);
+	free(replay->line);
+	free(replay->path);
+	free(replay);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *ec,
+	    int *argc, char *argv[])
+{
+	struct input_replay *replay;
+	struct weston_config_section *section;
+	struct wl_event_loop *loop;
+	char *speed, *header = NULL;
+	size_t header_size = 0;
+
+	replay = zalloc(sizeof *replay);
+	if (replay == NULL)
+		return -1;
+
+	replay->compositor = ec;
+	replay->busy_fd = -1;
+	wl_list_init(&replay->device_list);
+
+	section = weston_config_get_section(ec->config,
+					    "input-replay", NULL, NULL);
+	weston_config_section_get_string(section, "path",
+					 &replay->path, NULL);
+	weston_config_section_get_string(section, "speed",
+					 &speed, "original");
+	weston_config_section_get_int(section, "repeat", &replay->repeat, 1);
+	weston_config_section_get_bool(section, "exit",
+				       &replay->exit_when_done, 0);
+
+	replay->maximum_speed = strcmp(speed, "maximum") == 0;
+	free(speed);
+
+	if (replay->path == NULL) {
+		weston_log("input replay: no path in [input-replay]\n");
+		goto err;
+	}
+
+	replay->fp = fopen(replay->path, "r");
+	if (replay->fp == NULL) {
+		weston_log("input replay: failed to open %s: %m\n",
+			   replay->path);
+		goto err;
+	}
+
+	if (getline(&header, &header_size, replay->fp) < 0 ||
+	    strcmp(header, "weston-input-recording 1\n") != 0) {
+		weston_log("input replay: %s is not an input recording\n",
+			   replay->path);
+		free(header);
+		fclose(replay->fp);
+		goto err;
+	}
+	free(header);
+
+	weston_seat_init(&replay->seat, ec, "replay");
+
+	replay->destroy_listener.notify = replay_destroy;
+	wl_signal_add(&ec->destroy_signal, &replay->destroy_listener);
+
+	/* Wait for the outputs before placing absolute devices. */
+	loop = wl_display_get_event_loop(ec->wl_display);
+	wl_event_loop_add_idle(loop, replay_start, replay);
+
+	return 0;
+
+err:
+	free(replay->path);
+	free(replay);
+	return -1;
+}
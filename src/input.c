@@ -923,15 +923,126 @@ weston_pointer_handle_output_destroy(struct wl_listener *listener, void *data)
 	weston_pointer_move(pointer, fx, fy);
 }
 
+/* Deliver the pointer and touch motion merged since the last flush.
+ * Called before any event whose order against motion matters and at
+ * the start of every repaint. */
+WL_EXPORT void
+weston_seat_flush_motion(struct weston_seat *seat)
+{
+	struct weston_seat_motion *motion = &seat->motion;
+	struct weston_pointer *pointer = seat->pointer;
+	uint32_t mask;
+	int id;
+
+	if (motion->pending != WESTON_MOTION_NONE && pointer) {
+		if (motion->pending == WESTON_MOTION_RELATIVE)
+			pointer->grab->interface->motion(pointer->grab,
+							 motion->time,
+							 pointer->x + motion->dx,
+							 pointer->y + motion->dy);
+		else
+			pointer->grab->interface->motion(pointer->grab,
+							 motion->time,
+							 motion->x + motion->dx,
+							 motion->y + motion->dy);
+	}
+	motion->pending = WESTON_MOTION_NONE;
+	motion->dx = 0;
+	motion->dy = 0;
+
+	mask = motion->touch_mask;
+	motion->touch_mask = 0;
+	motion->flushing = 1;
+	while (mask && seat->touch) {
+		id = ffs(mask) - 1;
+		mask &= ~(1u << id);
+		notify_touch(seat, motion->touch[id].time, id,
+			     motion->touch[id].x, motion->touch[id].y,
+			     WL_TOUCH_MOTION);
+	}
+	motion->flushing = 0;
+}
+
+WL_EXPORT void
+weston_compositor_flush_motion(struct weston_compositor *compositor)
+{
+	struct weston_seat *seat;
+
+	wl_list_for_each(seat, &compositor->seat_list, link)
+		weston_seat_flush_motion(seat);
+}
+
+/* Merged motion goes out with the next repaint of the output under the
+ * pointer, or of all outputs if there is none. */
+static void
+weston_seat_schedule_motion(struct weston_seat *seat)
+{
+	struct weston_compositor *ec = seat->compositor;
+	struct weston_output *output;
+	int32_t x, y;
+
+	if (seat->pointer) {
+		x = wl_fixed_to_int(seat->pointer->x);
+		y = wl_fixed_to_int(seat->pointer->y);
+		wl_list_for_each(output, &ec->output_list, link) {
+			if (pixman_region32_contains_point(&output->region,
+							   x, y, NULL)) {
+				weston_output_schedule_repaint(output);
+				return;
+			}
+		}
+	}
+
+	weston_compositor_schedule_repaint(ec);
+}
+
+/* Backends that know the CLOCK_MONOTONIC time of an event in
+ * microseconds put it in weston_seat::event_usec while calling the
+ * notify functions, whose time arguments are milliseconds on whatever
+ * clock the backend has.  The oldest such time since the last repaint
+ * started is what the frame timing measures input latency from. */
+static void
+weston_seat_note_event_time(struct weston_seat *seat)
+{
+	struct weston_compositor *ec = seat->compositor;
+
+	if (seat->event_usec == 0)
+		return;
+
+	if (ec->input_pending_usec == 0 ||
+	    seat->event_usec < ec->input_pending_usec)
+		ec->input_pending_usec = seat->event_usec;
+}
+
 WL_EXPORT void
 notify_motion(struct weston_seat *seat,
 	      uint32_t time, wl_fixed_t dx, wl_fixed_t dy)
 {
 	struct weston_compositor *ec = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
+	struct weston_seat_motion *motion = &seat->motion;
 
+	weston_seat_note_event_time(seat);
 	weston_compositor_wake(ec);
-	pointer->grab->interface->motion(pointer->grab, time, pointer->x + dx, pointer->y + dy);
+
+	if (!ec->coalesce_motion) {
+		pointer->grab->interface->motion(pointer->grab, time,
+						 pointer->x + dx,
+						 pointer->y + dy);
+		return;
+	}
+
+	/* Summing the deltas keeps what the acceleration filter made of
+	 * every single event, only the intermediate positions are lost. */
+	if (motion->pending == WESTON_MOTION_NONE) {
+		motion->pending = WESTON_MOTION_RELATIVE;
+		weston_seat_schedule_motion(seat);
+	} else {
+		ec->motion_events_merged++;
+	}
+	motion->time = time;
+	motion->dx += dx;
+	motion->dy += dy;
 }
 
 static void
@@ -976,9 +1087,26 @@ notify_motion_absolute(struct weston_seat *seat,
 {
 	struct weston_compositor *ec = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
+	struct weston_seat_motion *motion = &seat->motion;
 
+	weston_seat_note_event_time(seat);
 	weston_compositor_wake(ec);
-	pointer->grab->interface->motion(pointer->grab, time, x, y);
+
+	if (!ec->coalesce_motion) {
+		pointer->grab->interface->motion(pointer->grab, time, x, y);
+		return;
+	}
+
+	if (motion->pending == WESTON_MOTION_NONE)
+		weston_seat_schedule_motion(seat);
+	else
+		ec->motion_events_merged++;
+	motion->pending = WESTON_MOTION_ABSOLUTE;
+	motion->time = time;
+	motion->x = x;
+	motion->y = y;
+	motion->dx = 0;
+	motion->dy = 0;
 }
 
 WL_EXPORT void
@@ -1001,9 +1129,16 @@ notify_button(struct weston_seat *seat, uint32_t time, int32_t button,
 {
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
-	struct weston_surface *focus =
-		(struct weston_surface *) pointer->focus;
-	uint32_t serial = wl_display_next_serial(compositor->wl_display);
+	struct weston_surface *focus;
+	uint32_t serial;
+
+	weston_seat_note_event_time(seat);
+
+	/* The button goes to wherever the pointer has moved so far. */
+	weston_seat_flush_motion(seat);
+
+	focus = (struct weston_surface *) pointer->focus;
+	serial = wl_display_next_serial(compositor->wl_display);
 
 	if (state == WL_POINTER_BUTTON_STATE_PRESSED) {
 		if (compositor->ping_handler && focus)
@@ -1037,12 +1172,17 @@ notify_axis(struct weston_seat *seat, uint32_t time, uint32_t axis,
 {
 	struct weston_compositor *compositor = seat->compositor;
 	struct weston_pointer *pointer = seat->pointer;
-	struct weston_surface *focus =
-		(struct weston_surface *) pointer->focus;
-	uint32_t serial = wl_display_next_serial(compositor->wl_display);
+	struct weston_surface *focus;
+	uint32_t serial;
 	struct wl_resource *resource;
 	struct wl_list *resource_list;
 
+	weston_seat_note_event_time(seat);
+	weston_seat_flush_motion(seat);
+
+	focus = (struct weston_surface *) pointer->focus;
+	serial = wl_display_next_serial(compositor->wl_display);
+
 	if (compositor->ping_handler && focus)
 		compositor->ping_handler(focus, serial);
 
@@ -1266,6 +1406,11 @@ notify_key(struct weston_seat *seat, uint32_t time, uint32_t key,
 	uint32_t serial = wl_display_next_serial(compositor->wl_display);
 	uint32_t *k, *end;
 
+	weston_seat_note_event_time(seat);
+
+	/* Bindings may act on the pointer position. */
+	weston_seat_flush_motion(seat);
+
 	if (state == WL_KEYBOARD_KEY_STATE_PRESSED) {
 		if (compositor->ping_handler && focus)
 			compositor->ping_handler(focus, serial);
@@ -1317,6 +1462,8 @@ WL_EXPORT void
 notify_pointer_focus(struct weston_seat *seat, struct weston_output *output,
 		     wl_fixed_t x, wl_fixed_t y)
 {
+	weston_seat_flush_motion(seat);
+
 	if (output) {
 		weston_pointer_move(seat->pointer, x, y);
 	} else {
@@ -1453,6 +1600,27 @@ notify_touch(struct weston_seat *seat, uint32_t time, int touch_id,
 	struct weston_view *ev;
 	wl_fixed_t sx, sy;
 
+	weston_seat_note_event_time(seat);
+
+	/* Only the latest position of each touch point is kept until
+	 * the next repaint; downs and ups flush it to keep the order. */
+	if (ec->coalesce_motion && touch_type == WL_TOUCH_MOTION &&
+	    touch_id >= 0 && touch_id < WESTON_MOTION_MAX_TOUCH &&
+	    !seat->motion.flushing) {
+		if (seat->motion.touch_mask & (1u << touch_id))
+			ec->motion_events_merged++;
+		else if (seat->motion.touch_mask == 0)
+			weston_seat_schedule_motion(seat);
+		seat->motion.touch_mask |= 1u << touch_id;
+		seat->motion.touch[touch_id].time = time;
+		seat->motion.touch[touch_id].x = x;
+		seat->motion.touch[touch_id].y = y;
+		return;
+	}
+
+	if (touch_type != WL_TOUCH_MOTION)
+		weston_seat_flush_motion(seat);
+
 	/* Update grab's global coordinates. */
 	if (touch_id == touch->grab_touch_id && touch_type != WL_TOUCH_UP) {
 		touch->grab_x = x;
@@ -2139,6 +2307,9 @@ weston_seat_release_pointer(struct weston_seat *seat)
 
 	seat->pointer_device_count--;
 	if (seat->pointer_device_count == 0) {
+		seat->motion.pending = WESTON_MOTION_NONE;
+		seat->motion.dx = 0;
+		seat->motion.dy = 0;
 		weston_pointer_set_focus(pointer, NULL,
 					 wl_fixed_from_int(0),
 					 wl_fixed_from_int(0));
@@ -2180,6 +2351,7 @@ weston_seat_release_touch(struct weston_seat *seat)
 {
 	seat->touch_device_count--;
 	if (seat->touch_device_count == 0) {
+		seat->motion.touch_mask = 0;
 		weston_touch_set_focus(seat, NULL);
 		weston_touch_cancel_grab(seat->touch);
 		weston_touch_reset_state(seat->touch);
@@ -25,21 +25,40 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <pthread.h>
 
 #include "pixman-renderer.h"
+#include "vertex-clipping.h"
 
 #include <linux/input.h>
 
+/* Height of the full width bands the output is split into when
+ * compositing on several threads. */
+#define TILE_HEIGHT 64
+
+static const pixman_color_t debug_red = {
+	0x3fff, 0x0000, 0x0000, 0x3fff
+};
+
 struct pixman_output_state {
 	void *shadow_buffer;
-	pixman_image_t *shadow_image;
+	pixman_image_t *shadow_image; /* NULL when rendering directly */
 	pixman_image_t *hw_buffer;
+
+	/* Output zoom of the frame being rendered, output pixel p is
+	 * magnified to zoom_scale * p + (zoom_x, zoom_y). */
+	int zoom_active;
+	float zoom_scale, zoom_x, zoom_y;
 };
 
 struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color; /* if image is a solid fill */
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -47,6 +66,47 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* One composite operation recorded for tiled rendering.  Pixman images
+ * carry their clip, transform and filter, so each tile composites from
+ * its own image wrapping the same pixels. */
+struct pixman_paint {
+	pixman_op_t op;
+	pixman_region32_t region; /* output coordinates */
+	pixman_transform_t transform;
+	pixman_filter_t filter;
+
+	/* source bits, or a solid fill of color if data is NULL */
+	pixman_format_code_t format;
+	int width, height, stride;
+	uint32_t *data;
+	pixman_color_t color;
+	struct wl_shm_buffer *shm_buffer;
+};
+
+struct pixman_tile_frame {
+	struct wl_array *paints;
+	pixman_format_code_t format;
+	uint32_t *data;
+	int width, height, stride;
+	pixman_box32_t *tiles;
+	int tile_count;
+};
+
+struct pixman_tile_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int thread_count;
+	int quit;
+
+	/* Current frame, protected by mutex */
+	struct pixman_tile_frame *frame;
+	uint32_t frame_serial;
+	int next_tile;
+	int tiles_done;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -54,6 +114,11 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	/* Tiled rendering on a worker pool, NULL if disabled */
+	struct pixman_tile_pool *tile_pool;
+	struct wl_array paints;
+	int recording;
+
 	struct wl_signal destroy_signal;
 };
 
@@ -63,6 +128,14 @@ get_output_state(struct weston_output *output)
 	return (struct pixman_output_state *)output->renderer_state;
 }
 
+/* The image views are composited into: the shadow image if the output
+ * has one, the current hw buffer otherwise. */
+static inline pixman_image_t *
+get_target_image(struct pixman_output_state *po)
+{
+	return po->shadow_image ? po->shadow_image : po->hw_buffer;
+}
+
 static int
 pixman_renderer_create_surface(struct weston_surface *surface);
 
@@ -127,6 +200,75 @@ pixman_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+/* Match the zoom camera weston_output_update_matrix() sets up for GL */
+static void
+output_zoom_update(struct weston_output *output)
+{
+	struct pixman_output_state *po = get_output_state(output);
+	float w = output->current_mode->width;
+	float h = output->current_mode->height;
+
+	po->zoom_active = output->zoom.active;
+	if (!po->zoom_active)
+		return;
+
+	po->zoom_scale = 1.0f / (1.0f - output->zoom.spring_z.current);
+	po->zoom_x = w / 2.0f *
+		(1.0f - po->zoom_scale * (1.0f + output->zoom.trans_x));
+	po->zoom_y = h / 2.0f *
+		(1.0f - po->zoom_scale * (1.0f + output->zoom.trans_y));
+}
+
+static void
+output_zoom_point(struct weston_output *output, float *x, float *y)
+{
+	struct pixman_output_state *po = get_output_state(output);
+
+	if (!po->zoom_active)
+		return;
+
+	*x = *x * po->zoom_scale + po->zoom_x;
+	*y = *y * po->zoom_scale + po->zoom_y;
+}
+
+/* Magnify a region of output pixels, rounding out to whole pixels and
+ * clipping to the output. */
+static void
+region_output_zoom(struct weston_output *output, pixman_region32_t *region)
+{
+	pixman_box32_t *rects, *boxes;
+	float x1, y1, x2, y2;
+	int i, n;
+
+	rects = pixman_region32_rectangles(region, &n);
+	boxes = malloc(n * sizeof *boxes);
+	if (!boxes)
+		return;
+
+	for (i = 0; i < n; i++) {
+		x1 = rects[i].x1;
+		y1 = rects[i].y1;
+		x2 = rects[i].x2;
+		y2 = rects[i].y2;
+		output_zoom_point(output, &x1, &y1);
+		output_zoom_point(output, &x2, &y2);
+
+		boxes[i].x1 = floorf(x1);
+		boxes[i].y1 = floorf(y1);
+		boxes[i].x2 = ceilf(x2);
+		boxes[i].y2 = ceilf(y2);
+	}
+
+	pixman_region32_fini(region);
+	pixman_region32_init_rects(region, boxes, n);
+	pixman_region32_intersect_rect(region, region, 0, 0,
+				       output->current_mode->width,
+				       output->current_mode->height);
+	free(boxes);
+}
+
+/* Convert a region in global coordinates to the output pixels it ends up
+ * on, magnified if the output is zoomed. */
 static void
 region_global_to_output(struct weston_output *output, pixman_region32_t *region)
 {
@@ -134,58 +276,366 @@ region_global_to_output(struct weston_output *output, pixman_region32_t *region)
 	weston_transformed_region(output->width, output->height,
 				  output->transform, output->current_scale,
 				  region, region);
+
+	if (get_output_state(output)->zoom_active)
+		region_output_zoom(output, region);
+}
+
+/* The inverse of weston_transformed_coord() for the output, the output
+ * transform is affine so it can be recovered from the images of the
+ * origin and the two unit vectors. */
+static void
+output_coord_to_global(struct weston_output *output, float x, float y,
+		       float *gx, float *gy)
+{
+	float ox, oy, ux, uy, vx, vy, det;
+
+	weston_transformed_coord(output->width, output->height,
+				 output->transform, output->current_scale,
+				 0, 0, &ox, &oy);
+	weston_transformed_coord(output->width, output->height,
+				 output->transform, output->current_scale,
+				 1, 0, &ux, &uy);
+	weston_transformed_coord(output->width, output->height,
+				 output->transform, output->current_scale,
+				 0, 1, &vx, &vy);
+	ux -= ox;
+	uy -= oy;
+	vx -= ox;
+	vy -= oy;
+	x -= ox;
+	y -= oy;
+
+	det = ux * vy - vx * uy;
+	*gx = (x * vy - y * vx) / det + output->x;
+	*gy = (y * ux - x * uy) / det + output->y;
+}
+
+/* Replace the global damage by the area it covers once magnified, which
+ * is what the backend has to present. */
+static void
+region_zoom_damage(struct weston_output *output, pixman_region32_t *damage)
+{
+	pixman_region32_t region;
+	pixman_box32_t *rects, *boxes;
+	float x1, y1, x2, y2;
+	int i, n;
+
+	pixman_region32_init(&region);
+	pixman_region32_copy(&region, damage);
+	region_global_to_output(output, &region);
+
+	rects = pixman_region32_rectangles(&region, &n);
+	boxes = malloc(n * sizeof *boxes);
+	if (!boxes) {
+		pixman_region32_copy(damage, &output->region);
+		pixman_region32_fini(&region);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		output_coord_to_global(output, rects[i].x1, rects[i].y1,
+				       &x1, &y1);
+		output_coord_to_global(output, rects[i].x2, rects[i].y2,
+				       &x2, &y2);
+
+		boxes[i].x1 = floorf(fminf(x1, x2));
+		boxes[i].y1 = floorf(fminf(y1, y2));
+		boxes[i].x2 = ceilf(fmaxf(x1, x2));
+		boxes[i].y2 = ceilf(fmaxf(y1, y2));
+	}
+
+	pixman_region32_fini(damage);
+	pixman_region32_init_rects(damage, boxes, n);
+	pixman_region32_intersect(damage, damage, &output->region);
+
+	free(boxes);
+	pixman_region32_fini(&region);
+}
+
+static struct pixman_paint *
+add_paint(struct pixman_renderer *pr, pixman_region32_t *region,
+	  pixman_op_t op)
+{
+	struct pixman_paint *paint;
+
+	paint = wl_array_add(&pr->paints, sizeof *paint);
+	if (!paint)
+		return NULL;
+
+	memset(paint, 0, sizeof *paint);
+	paint->op = op;
+	pixman_region32_init(&paint->region);
+	pixman_region32_copy(&paint->region, region);
+	pixman_transform_init_identity(&paint->transform);
+	paint->filter = PIXMAN_FILTER_NEAREST;
+
+	return paint;
+}
+
+static void
+record_paint(struct pixman_renderer *pr, struct pixman_surface_state *ps,
+	     pixman_region32_t *region, pixman_transform_t *transform,
+	     pixman_filter_t filter, pixman_op_t op)
+{
+	struct pixman_paint *paint;
+
+	paint = add_paint(pr, region, op);
+	if (!paint)
+		return;
+
+	paint->transform = *transform;
+	paint->filter = filter;
+
+	paint->data = pixman_image_get_data(ps->image);
+	if (paint->data) {
+		paint->format = pixman_image_get_format(ps->image);
+		paint->width = pixman_image_get_width(ps->image);
+		paint->height = pixman_image_get_height(ps->image);
+		paint->stride = pixman_image_get_stride(ps->image);
+	} else {
+		paint->color = ps->color;
+	}
+
+	if (ps->buffer_ref.buffer)
+		paint->shm_buffer = ps->buffer_ref.buffer->shm_buffer;
+
+	if (pr->repaint_debug) {
+		paint = add_paint(pr, region, PIXMAN_OP_OVER);
+		if (paint)
+			paint->color = debug_red;
+	}
+}
+
+static pixman_image_t *
+paint_create_source(struct pixman_paint *paint)
+{
+	pixman_image_t *image;
+
+	if (paint->data)
+		image = pixman_image_create_bits(paint->format,
+						 paint->width, paint->height,
+						 paint->data, paint->stride);
+	else
+		image = pixman_image_create_solid_fill(&paint->color);
+
+	if (!image)
+		return NULL;
+
+	pixman_image_set_transform(image, &paint->transform);
+	pixman_image_set_filter(image, paint->filter, NULL, 0);
+
+	return image;
+}
+
+static void
+render_tile(struct pixman_tile_frame *frame, pixman_box32_t *tile)
+{
+	struct pixman_paint *paint;
+	pixman_image_t *dest, *src;
+	pixman_region32_t clip;
+	int w = tile->x2 - tile->x1;
+	int h = tile->y2 - tile->y1;
+
+	dest = pixman_image_create_bits(frame->format,
+					frame->width, frame->height,
+					frame->data, frame->stride);
+	if (!dest)
+		return;
+
+	pixman_region32_init(&clip);
+
+	wl_array_for_each(paint, frame->paints) {
+		pixman_region32_intersect_rect(&clip, &paint->region,
+					       tile->x1, tile->y1, w, h);
+		if (!pixman_region32_not_empty(&clip))
+			continue;
+
+		src = paint_create_source(paint);
+		if (!src)
+			continue;
+
+		pixman_image_set_clip_region32(dest, &clip);
+
+		if (paint->shm_buffer)
+			wl_shm_buffer_begin_access(paint->shm_buffer);
+
+		pixman_image_composite32(paint->op,
+					 src, /* src */
+					 NULL /* mask */,
+					 dest, /* dest */
+					 tile->x1, tile->y1, /* src_x, src_y */
+					 0, 0, /* mask_x, mask_y */
+					 tile->x1, tile->y1, /* dest_x, dest_y */
+					 w, /* width */
+					 h /* height */);
+
+		if (paint->shm_buffer)
+			wl_shm_buffer_end_access(paint->shm_buffer);
+
+		pixman_image_unref(src);
+	}
+
+	pixman_region32_fini(&clip);
+	pixman_image_unref(dest);
+}
+
+/* Render tiles of the current frame until none are left.  Run by the
+ * workers and by the compositor thread itself. */
+static void
+tile_pool_run(struct pixman_tile_pool *pool)
+{
+	struct pixman_tile_frame *frame;
+	int tile;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->frame && pool->next_tile < pool->frame->tile_count) {
+		frame = pool->frame;
+		tile = pool->next_tile++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		render_tile(frame, &frame->tiles[tile]);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (++pool->tiles_done == frame->tile_count)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *
+tile_pool_worker(void *data)
+{
+	struct pixman_tile_pool *pool = data;
+	uint32_t serial;
+
+	pthread_mutex_lock(&pool->mutex);
+	serial = pool->frame_serial;
+	for (;;) {
+		while (!pool->quit && pool->frame_serial == serial)
+			pthread_cond_wait(&pool->start_cond, &pool->mutex);
+		if (pool->quit)
+			break;
+		serial = pool->frame_serial;
+
+		pthread_mutex_unlock(&pool->mutex);
+		tile_pool_run(pool);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+tile_pool_render(struct pixman_tile_pool *pool,
+		 struct pixman_tile_frame *frame)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->frame = frame;
+	pool->frame_serial++;
+	pool->next_tile = 0;
+	pool->tiles_done = 0;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	tile_pool_run(pool);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->tiles_done < frame->tile_count)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pool->frame = NULL;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+tile_pool_destroy(struct pixman_tile_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+/* The compositor thread takes part in rendering, so thread_count
+ * workers give thread_count + 1 threads compositing. */
+static struct pixman_tile_pool *
+tile_pool_create(int thread_count)
+{
+	struct pixman_tile_pool *pool;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(thread_count, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (pool->thread_count = 0;
+	     pool->thread_count < thread_count;
+	     pool->thread_count++) {
+		if (pthread_create(&pool->threads[pool->thread_count], NULL,
+				   tile_pool_worker, pool) != 0) {
+			weston_log("failed to create pixman render thread\n");
+			tile_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
 }
 
 #define D2F(v) pixman_double_to_fixed((double)v)
 
+/* Composite the view into 'final_region', given in output coordinates. */
 static void
-repaint_region(struct weston_view *ev, struct weston_output *output,
-	       pixman_region32_t *region, pixman_region32_t *surf_region,
-	       pixman_op_t pixman_op)
+repaint_output_region(struct weston_view *ev, struct weston_output *output,
+		      pixman_region32_t *final_region, pixman_op_t pixman_op)
 {
 	struct pixman_renderer *pr =
 		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
 	struct pixman_output_state *po = get_output_state(output);
-	pixman_region32_t final_region;
-	float view_x, view_y;
+	pixman_image_t *target = get_target_image(po);
 	pixman_transform_t transform;
+	pixman_filter_t filter;
 	pixman_fixed_t fw, fh;
 
-	/* The final region to be painted is the intersection of
-	 * 'region' and 'surf_region'. However, 'region' is in the global
-	 * coordinates, and 'surf_region' is in the surface-local
-	 * coordinates
-	 */
-	pixman_region32_init(&final_region);
-	if (surf_region) {
-		pixman_region32_copy(&final_region, surf_region);
-
-		/* Convert from surface to global coordinates */
-		if (!ev->transform.enabled) {
-			pixman_region32_translate(&final_region, ev->geometry.x, ev->geometry.y);
-		} else {
-			weston_view_to_global_float(ev, 0, 0, &view_x, &view_y);
-			pixman_region32_translate(&final_region, (int)view_x, (int)view_y);
-		}
-
-		/* We need to paint the intersection */
-		pixman_region32_intersect(&final_region, &final_region, region);
-	} else {
-		/* If there is no surface region, just use the global region */
-		pixman_region32_copy(&final_region, region);
-	}
-
-	/* Convert from global to output coord */
-	region_global_to_output(output, &final_region);
+	if (!pixman_region32_not_empty(final_region))
+		return;
 
-	/* And clip to it */
-	pixman_image_set_clip_region32 (po->shadow_image, &final_region);
 
 	/* Set up the source transformation based on the surface
-	   position, the output position/transform/scale and the client
+	   position, the output zoom/position/transform/scale and the client
 	   specified buffer transform/scale */
 	pixman_transform_init_identity(&transform);
+
+	if (po->zoom_active) {
+		pixman_transform_translate(&transform, NULL,
+					   pixman_double_to_fixed(-po->zoom_x),
+					   pixman_double_to_fixed(-po->zoom_y));
+		pixman_transform_scale(&transform, NULL,
+				       pixman_double_to_fixed(1.0 / po->zoom_scale),
+				       pixman_double_to_fixed(1.0 / po->zoom_scale));
+	}
 	pixman_transform_scale(&transform, NULL,
 			       pixman_double_to_fixed ((double)1.0/output->current_scale),
 			       pixman_double_to_fixed ((double)1.0/output->current_scale));
@@ -317,12 +767,23 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		break;
 	}
 
-	pixman_image_set_transform(ps->image, &transform);
-
-	if (ev->transform.enabled || output->current_scale != ev->surface->buffer_viewport.scale)
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_BILINEAR, NULL, 0);
+	if (ev->transform.enabled || po->zoom_active ||
+	    output->current_scale != ev->surface->buffer_viewport.scale)
+		filter = PIXMAN_FILTER_BILINEAR;
 	else
-		pixman_image_set_filter(ps->image, PIXMAN_FILTER_NEAREST, NULL, 0);
+		filter = PIXMAN_FILTER_NEAREST;
+
+	if (pr->recording) {
+		record_paint(pr, ps, final_region, &transform, filter,
+			     pixman_op);
+		return;
+	}
+
+	/* Clip to the final region */
+	pixman_image_set_clip_region32 (target, final_region);
+
+	pixman_image_set_transform(ps->image, &transform);
+	pixman_image_set_filter(ps->image, filter, NULL, 0);
 
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_begin_access(ps->buffer_ref.buffer->shm_buffer);
@@ -330,12 +791,12 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	pixman_image_composite32(pixman_op,
 				 ps->image, /* src */
 				 NULL /* mask */,
-				 po->shadow_image, /* dest */
+				 target, /* dest */
 				 0, 0, /* src_x, src_y */
 				 0, 0, /* mask_x, mask_y */
 				 0, 0, /* dest_x, dest_y */
-				 pixman_image_get_width (po->shadow_image), /* width */
-				 pixman_image_get_height (po->shadow_image) /* height */);
+				 pixman_image_get_width (target), /* width */
+				 pixman_image_get_height (target) /* height */);
 
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
@@ -344,18 +805,255 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 		pixman_image_composite32(PIXMAN_OP_OVER,
 					 pr->debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 target, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (target), /* width */
+					 pixman_image_get_height (target) /* height */);
+
+	pixman_image_set_clip_region32 (target, NULL);
+}
+
+static void
+repaint_region(struct weston_view *ev, struct weston_output *output,
+	       pixman_region32_t *region, pixman_region32_t *surf_region,
+	       pixman_op_t pixman_op)
+{
+	pixman_region32_t final_region;
+	float view_x, view_y;
+
+	/* The final region to be painted is the intersection of
+	 * 'region' and 'surf_region'. However, 'region' is in the global
+	 * coordinates, and 'surf_region' is in the surface-local
+	 * coordinates
+	 */
+	pixman_region32_init(&final_region);
+	if (surf_region) {
+		pixman_region32_copy(&final_region, surf_region);
+
+		/* Convert from surface to global coordinates */
+		if (!ev->transform.enabled) {
+			pixman_region32_translate(&final_region, ev->geometry.x, ev->geometry.y);
+		} else {
+			weston_view_to_global_float(ev, 0, 0, &view_x, &view_y);
+			pixman_region32_translate(&final_region, (int)view_x, (int)view_y);
+		}
+
+		/* We need to paint the intersection */
+		pixman_region32_intersect(&final_region, &final_region, region);
+	} else {
+		/* If there is no surface region, just use the global region */
+		pixman_region32_copy(&final_region, region);
+	}
+
+	/* Convert from global to output coord */
+	region_global_to_output(output, &final_region);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	repaint_output_region(ev, output, &final_region, pixman_op);
 
 	pixman_region32_fini(&final_region);
 }
 
+/* Horizontal extent of the convex polygon on the line y.  Returns 0 if
+ * the line misses the polygon. */
+static int
+polygon_span(const float *ex, const float *ey, int n, float y,
+	     float *x1, float *x2)
+{
+	float x, t;
+	int i, j, hit = 0;
+
+	for (i = 0, j = n - 1; i < n; j = i++) {
+		if (y < fminf(ey[i], ey[j]) || y > fmaxf(ey[i], ey[j]))
+			continue;
+
+		if (!hit) {
+			*x1 = FLT_MAX;
+			*x2 = -FLT_MAX;
+			hit = 1;
+		}
+
+		if (ey[i] == ey[j]) {
+			*x1 = fminf(*x1, fminf(ex[i], ex[j]));
+			*x2 = fmaxf(*x2, fmaxf(ex[i], ex[j]));
+			continue;
+		}
+
+		t = (y - ey[j]) / (ey[i] - ey[j]);
+		x = ex[j] + (ex[i] - ex[j]) * t;
+		*x1 = fminf(*x1, x);
+		*x2 = fmaxf(*x2, x);
+	}
+
+	return hit;
+}
+
+/* Rasterize the surface rectangle 'rect' of the view into a region of
+ * output pixels, limited to 'clip' (output coordinates).  With 'inner'
+ * only the pixels lying entirely inside the transformed rectangle are
+ * included, otherwise every pixel it touches. */
+static void
+view_rect_to_output_region(struct weston_view *ev,
+			   struct weston_output *output,
+			   pixman_box32_t *rect, pixman_box32_t *clip,
+			   int inner, pixman_region32_t *region)
+{
+	struct clip_context ctx;
+	struct polygon8 surf = {
+		{ rect->x1, rect->x2, rect->x2, rect->x1 },
+		{ rect->y1, rect->y1, rect->y2, rect->y2 },
+		4
+	};
+	float ex[8], ey[8], min_y, max_y, l0, r0, l1, r1, x1, x2;
+	pixman_box32_t *boxes;
+	int i, n, y, y1, y2, top, bottom, count = 0;
+
+	pixman_region32_init(region);
+
+	for (i = 0; i < surf.n; i++) {
+		weston_view_to_global_float(ev, surf.x[i], surf.y[i],
+					    &surf.x[i], &surf.y[i]);
+		weston_transformed_coord(output->width, output->height,
+					 output->transform,
+					 output->current_scale,
+					 surf.x[i] - output->x,
+					 surf.y[i] - output->y,
+					 &surf.x[i], &surf.y[i]);
+		output_zoom_point(output, &surf.x[i], &surf.y[i]);
+	}
+
+	ctx.clip.x1 = clip->x1;
+	ctx.clip.y1 = clip->y1;
+	ctx.clip.x2 = clip->x2;
+	ctx.clip.y2 = clip->y2;
+
+	n = clip_transformed(&ctx, &surf, ex, ey);
+	if (n < 3)
+		return;
+
+	min_y = max_y = ey[0];
+	for (i = 1; i < n; i++) {
+		min_y = fminf(min_y, ey[i]);
+		max_y = fmaxf(max_y, ey[i]);
+	}
+
+	if (inner) {
+		y1 = ceilf(min_y);
+		y2 = floorf(max_y);
+	} else {
+		y1 = floorf(min_y);
+		y2 = ceilf(max_y);
+	}
+	if (y1 >= y2)
+		return;
+
+	boxes = malloc((y2 - y1) * sizeof *boxes);
+	if (!boxes)
+		return;
+
+	/* The polygon is convex, so every row is a single span.  Its
+	 * extent over the row follows from the edges on the row's top and
+	 * bottom lines and the vertices in between. */
+	for (y = y1; y < y2; y++) {
+		top = polygon_span(ex, ey, n, y, &l0, &r0);
+		bottom = polygon_span(ex, ey, n, y + 1, &l1, &r1);
+
+		if (inner) {
+			if (!top || !bottom)
+				continue;
+			x1 = ceilf(fmaxf(l0, l1));
+			x2 = floorf(fminf(r0, r1));
+		} else {
+			x1 = FLT_MAX;
+			x2 = -FLT_MAX;
+			if (top) {
+				x1 = fminf(x1, l0);
+				x2 = fmaxf(x2, r0);
+			}
+			if (bottom) {
+				x1 = fminf(x1, l1);
+				x2 = fmaxf(x2, r1);
+			}
+			for (i = 0; i < n; i++) {
+				if (ey[i] > y && ey[i] < y + 1) {
+					x1 = fminf(x1, ex[i]);
+					x2 = fmaxf(x2, ex[i]);
+				}
+			}
+			x1 = floorf(x1);
+			x2 = ceilf(x2);
+		}
+
+		if (x1 >= x2)
+			continue;
+
+		boxes[count].x1 = x1;
+		boxes[count].y1 = y;
+		boxes[count].x2 = x2;
+		boxes[count].y2 = y + 1;
+		count++;
+	}
+
+	pixman_region32_fini(region);
+	pixman_region32_init_rects(region, boxes, count);
+	free(boxes);
+}
+
+/* Paint a view with a non-translation transform.  Only the output pixels
+ * the transformed surface reaches are composited, and the parts of the
+ * opaque region that cover whole pixels are copied instead of blended. */
+static void
+repaint_region_complex(struct weston_view *ev, struct weston_output *output,
+		       pixman_region32_t *region)
+{
+	struct weston_surface *surface = ev->surface;
+	pixman_region32_t clip, blend, opaque, part;
+	pixman_box32_t *extents, *rects, rect;
+	int i, nrects;
+
+	pixman_region32_init(&clip);
+	pixman_region32_copy(&clip, region);
+	region_global_to_output(output, &clip);
+	extents = pixman_region32_extents(&clip);
+
+	/* With bilinear filtering the surface bleeds into the pixels
+	 * around its edges, grow it by a pixel to cover those. */
+	rect.x1 = -1;
+	rect.y1 = -1;
+	rect.x2 = surface->width + 1;
+	rect.y2 = surface->height + 1;
+	view_rect_to_output_region(ev, output, &rect, extents, 0, &blend);
+	pixman_region32_intersect(&blend, &blend, &clip);
+
+	/* Conversely only pixels whose filter taps all land inside the
+	 * opaque region can be copied. */
+	pixman_region32_init(&opaque);
+	rects = pixman_region32_rectangles(&surface->opaque, &nrects);
+	for (i = 0; i < nrects; i++) {
+		rect.x1 = rects[i].x1 + 1;
+		rect.y1 = rects[i].y1 + 1;
+		rect.x2 = rects[i].x2 - 1;
+		rect.y2 = rects[i].y2 - 1;
+		if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+			continue;
+
+		view_rect_to_output_region(ev, output, &rect, extents, 1,
+					   &part);
+		pixman_region32_union(&opaque, &opaque, &part);
+		pixman_region32_fini(&part);
+	}
+	pixman_region32_intersect(&opaque, &opaque, &blend);
+	pixman_region32_subtract(&blend, &blend, &opaque);
+
+	repaint_output_region(ev, output, &opaque, PIXMAN_OP_SRC);
+	repaint_output_region(ev, output, &blend, PIXMAN_OP_OVER);
+
+	pixman_region32_fini(&opaque);
+	pixman_region32_fini(&blend);
+	pixman_region32_fini(&clip);
+}
+
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
 	  pixman_region32_t *damage) /* in global coordinates */
@@ -378,15 +1076,9 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
-	if (output->zoom.active) {
-		weston_log("pixman renderer does not support zoom\n");
-		goto out;
-	}
-
-	/* TODO: Implement repaint_region_complex() using pixman_composite_trapezoids() */
 	if (ev->transform.enabled &&
 	    ev->transform.matrix.type != WESTON_MATRIX_TRANSFORM_TRANSLATE) {
-		repaint_region(ev, output, &repaint, NULL, PIXMAN_OP_OVER);
+		repaint_region_complex(ev, output, &repaint);
 	} else {
 		/* blended region is whole surface minus opaque region: */
 		pixman_region32_init_rect(&surface_blend, 0, 0,
@@ -418,6 +1110,66 @@ repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
 			draw_view(view, output, damage);
 }
 
+static void
+repaint_surfaces_tiled(struct weston_output *output,
+		       pixman_region32_t *damage)
+{
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	pixman_image_t *target = get_target_image(get_output_state(output));
+	struct pixman_tile_frame frame;
+	struct pixman_paint *paint;
+	pixman_region32_t output_damage;
+	pixman_box32_t *tile;
+	struct wl_array tiles;
+	int y;
+
+	pr->paints.size = 0;
+	pr->recording = 1;
+	repaint_surfaces(output, damage);
+	pr->recording = 0;
+
+	frame.paints = &pr->paints;
+	frame.format = pixman_image_get_format(target);
+	frame.data = pixman_image_get_data(target);
+	frame.width = pixman_image_get_width(target);
+	frame.height = pixman_image_get_height(target);
+	frame.stride = pixman_image_get_stride(target);
+
+	pixman_region32_init(&output_damage);
+	pixman_region32_copy(&output_damage, damage);
+	region_global_to_output(output, &output_damage);
+
+	/* Only bands that intersect the damage become tiles */
+	wl_array_init(&tiles);
+	for (y = 0; y < frame.height; y += TILE_HEIGHT) {
+		pixman_box32_t band = {
+			0, y, frame.width, MIN(y + TILE_HEIGHT, frame.height)
+		};
+
+		if (pixman_region32_contains_rectangle(&output_damage,
+						       &band) ==
+		    PIXMAN_REGION_OUT)
+			continue;
+
+		tile = wl_array_add(&tiles, sizeof *tile);
+		if (tile)
+			*tile = band;
+	}
+	pixman_region32_fini(&output_damage);
+
+	frame.tiles = tiles.data;
+	frame.tile_count = tiles.size / sizeof *tile;
+
+	if (frame.tile_count > 0 && pr->paints.size > 0)
+		tile_pool_render(pr->tile_pool, &frame);
+
+	wl_array_release(&tiles);
+
+	wl_array_for_each(paint, &pr->paints)
+		pixman_region32_fini(&paint->region);
+	pr->paints.size = 0;
+}
+
 static void
 copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 {
@@ -453,8 +1205,20 @@ pixman_renderer_repaint_output(struct weston_output *output,
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	output_zoom_update(output);
+
+	if (get_renderer(output->compositor)->tile_pool)
+		repaint_surfaces_tiled(output, output_damage);
+	else
+		repaint_surfaces(output, output_damage);
+
+	if (po->shadow_image)
+		copy_to_hw_buffer(output, output_damage);
+
+	/* Views were painted from the unmagnified damage, the backend has
+	 * to present what it turned into. */
+	if (po->zoom_active)
+		region_zoom_damage(output, output_damage);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -626,7 +1390,8 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
-	
+	ps->color = color;
+
 	if (ps->image) {
 		pixman_image_unref(ps->image);
 		ps->image = NULL;
@@ -642,6 +1407,9 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	if (pr->tile_pool)
+		tile_pool_destroy(pr->tile_pool);
+	wl_array_release(&pr->paints);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -657,11 +1425,7 @@ debug_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 	pr->repaint_debug ^= 1;
 
 	if (pr->repaint_debug) {
-		pixman_color_t red = {
-			0x3fff, 0x0000, 0x0000, 0x3fff
-		};
-
-		pr->debug_color = pixman_image_create_solid_fill(&red);
+		pr->debug_color = pixman_image_create_solid_fill(&debug_red);
 	} else {
 		pixman_image_unref(pr->debug_color);
 		weston_compositor_damage_all(ec);
@@ -672,11 +1436,23 @@ WL_EXPORT int
 pixman_renderer_init(struct weston_compositor *ec)
 {
 	struct pixman_renderer *renderer;
+	struct weston_config_section *section;
+	int32_t threads;
 
 	renderer = calloc(1, sizeof *renderer);
 	if (renderer == NULL)
 		return -1;
 
+	section = weston_config_get_section(ec->config, "core", NULL, NULL);
+	weston_config_section_get_int(section, "pixman-threads", &threads, 0);
+	if (threads > 0) {
+		renderer->tile_pool = tile_pool_create(threads);
+		if (renderer->tile_pool)
+			weston_log("pixman renderer: compositing tiles on "
+				   "%d additional threads\n", threads);
+	}
+	wl_array_init(&renderer->paints);
+
 	renderer->repaint_debug = 0;
 	renderer->debug_color = NULL;
 	renderer->base.read_pixels = pixman_renderer_read_pixels;
@@ -716,7 +1492,7 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 }
 
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po = calloc(1, sizeof *po);
 	int w, h;
@@ -724,6 +1500,11 @@ pixman_renderer_output_create(struct weston_output *output)
 	if (!po)
 		return -1;
 
+	if (!(flags & PIXMAN_RENDERER_OUTPUT_USE_SHADOW)) {
+		output->renderer_state = po;
+		return 0;
+	}
+
 	/* set shadow image transformation */
 	w = output->current_mode->width;
 	h = output->current_mode->height;
@@ -755,7 +1536,10 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image) {
+		pixman_image_unref(po->shadow_image);
+		free(po->shadow_buffer);
+	}
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
@@ -27,8 +27,15 @@
 int
 pixman_renderer_init(struct weston_compositor *ec);
 
+/* Composite into a private shadow image and copy the damage to the hw
+ * buffer afterwards, for hw buffers that are slow to read back.  Without
+ * it views are composited straight into the hw buffer, and the damage
+ * passed to repaint_output must then cover everything that changed since
+ * that buffer was last rendered to. */
+#define PIXMAN_RENDERER_OUTPUT_USE_SHADOW (1 << 0)
+
 int
-pixman_renderer_output_create(struct weston_output *output);
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags);
 
 void
 pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *buffer);
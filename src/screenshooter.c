@@ -28,7 +28,13 @@
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/uio.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "compositor.h"
 #include "screenshooter-server-protocol.h"
@@ -260,14 +266,57 @@ screenshooter_binding(struct weston_seat *seat, uint32_t time, uint32_t key,
 					screenshooter_exe, screenshooter_sigchld);
 }
 
+/* Frames captured but not yet encoded.  When the encoder falls this far
+ * behind, new frames are dropped and their damage carried over to the
+ * next captured frame, so the delta stream stays consistent. */
+#define RECORDER_MAX_QUEUED_FRAMES 4
+
+/* Encoded data is written out in chunks of at least this size. */
+#define RECORDER_WRITE_BATCH (1024 * 1024)
+
+/* A full frame is recorded this often so that decoders can seek. */
+#define RECORDER_KEYFRAME_INTERVAL 10000
+
+struct recorder_frame {
+	struct wl_list link;
+	uint32_t msecs;
+	uint32_t flags;
+	struct wl_array rects;
+	struct wl_array pixels;
+};
+
 struct weston_recorder {
 	struct weston_output *output;
-	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
-	uint32_t total;
 	int fd;
+	int stride, height;
+	int do_yflip;
 	struct wl_listener frame_listener;
-	int count, destroying;
+	int destroying;
+
+	/* Compositor thread only */
+	pixman_region32_t pending_damage;
+	uint32_t keyframe_msecs;
+	int need_keyframe;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;
+
+	/* Protected by mutex */
+	struct wl_list queue;
+	struct wl_list free_list;
+	int queued;
+	int quit;
+	uint32_t total;
+	int count, dropped;
+
+	/* Encoder thread only */
+	uint32_t *frame;
+	uint32_t *delta;
+	struct wl_array out;
+	struct wl_array index;
+	uint64_t offset;
+	int write_error;
 };
 
 static uint32_t *
@@ -301,9 +350,308 @@ component_delta(uint32_t next, uint32_t prev)
 	return (dr << 16) | (dg << 8) | (db << 0);
 }
 
+/* Store the component_delta() of a row against the previous frame in
+ * delta and update the previous frame with the new pixels.  The per
+ * byte wrapping subtraction maps directly onto SSE2. */
+static void
+row_delta(uint32_t *delta, uint32_t *prev, const uint32_t *next, int width)
+{
+	int k = 0;
+
+#ifdef __SSE2__
+	const __m128i mask = _mm_set1_epi32(0x00ffffff);
+	__m128i n, p;
+
+	for (; k + 4 <= width; k += 4) {
+		n = _mm_loadu_si128((const __m128i *) (next + k));
+		p = _mm_loadu_si128((const __m128i *) (prev + k));
+		_mm_storeu_si128((__m128i *) (delta + k),
+				 _mm_and_si128(_mm_sub_epi8(n, p), mask));
+		_mm_storeu_si128((__m128i *) (prev + k), n);
+	}
+#endif
+
+	for (; k < width; k++) {
+		delta[k] = component_delta(next[k], prev[k]);
+		prev[k] = next[k];
+	}
+}
+
+/* Number of leading entries of p equal to value. */
+static int
+run_length(const uint32_t *p, int n, uint32_t value)
+{
+	int k = 0;
+
+#ifdef __SSE2__
+	const __m128i v = _mm_set1_epi32(value);
+	int mask;
+
+	for (; k + 4 <= n; k += 4) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi32(
+			_mm_loadu_si128((const __m128i *) (p + k)), v));
+		if (mask != 0xffff)
+			return k + __builtin_ctz(~mask) / 4;
+	}
+#endif
+
+	while (k < n && p[k] == value)
+		k++;
+
+	return k;
+}
+
+static void
+recorder_flush(struct weston_recorder *recorder)
+{
+	const char *p = recorder->out.data;
+	size_t left = recorder->out.size;
+	ssize_t n;
+
+	while (left > 0 && !recorder->write_error) {
+		n = write(recorder->fd, p, left);
+		if (n < 0) {
+			if (errno != EINTR)
+				recorder->write_error = errno;
+			continue;
+		}
+		p += n;
+		left -= n;
+	}
+
+	recorder->out.size = 0;
+}
+
+static void
+recorder_append(struct weston_recorder *recorder, const void *data,
+		size_t size)
+{
+	void *p;
+
+	p = wl_array_add(&recorder->out, size);
+	if (p)
+		memcpy(p, data, size);
+	else
+		recorder->write_error = ENOMEM;
+}
+
+/* Delta and run-length encode one captured rectangle straight into the
+ * output buffer. */
+static void
+recorder_encode_rect(struct weston_recorder *recorder,
+		     const pixman_box32_t *r, const uint32_t *s)
+{
+	int j, k, m, width, height, run, y;
+	uint32_t prev, *d, *p, *start;
+	size_t size;
+
+	width = r->x2 - r->x1;
+	height = r->y2 - r->y1;
+
+	/* Every pixel encodes to at most one word. */
+	size = recorder->out.size;
+	start = wl_array_add(&recorder->out,
+			     (size_t) width * height * sizeof *start);
+	if (start == NULL) {
+		recorder->write_error = ENOMEM;
+		return;
+	}
+
+	p = start;
+	run = prev = 0;
+	for (j = 0; j < height; j++) {
+		if (recorder->do_yflip)
+			y = r->y2 - j - 1;
+		else
+			y = r->y1 + j;
+		d = recorder->frame + recorder->stride * y + r->x1;
+
+		row_delta(recorder->delta, d, s, width);
+		s += width;
+
+		k = 0;
+		while (k < width) {
+			if (run == 0) {
+				prev = recorder->delta[k++];
+				run = 1;
+				continue;
+			}
+
+			m = run_length(recorder->delta + k, width - k, prev);
+			run += m;
+			k += m;
+			if (k < width) {
+				p = output_run(p, prev, run);
+				run = 0;
+			}
+		}
+	}
+
+	p = output_run(p, prev, run);
+
+	recorder->out.size = size + (p - start) * sizeof *p;
+}
+
+static uint32_t
+recorder_encode_frame(struct weston_recorder *recorder,
+		      struct recorder_frame *frame)
+{
+	struct wcap_frame_header_v2 header;
+	struct wcap_index_entry *entry;
+	pixman_box32_t *r;
+	const uint32_t *s;
+	size_t start;
+	uint32_t size;
+
+	entry = wl_array_add(&recorder->index, sizeof *entry);
+	if (entry) {
+		entry->offset = recorder->offset;
+		entry->msecs = frame->msecs;
+		entry->flags = frame->flags;
+	}
+
+	/* Keyframes are encoded against black. */
+	if (frame->flags & WCAP_FRAME_KEYFRAME)
+		memset(recorder->frame, 0,
+		       recorder->stride * recorder->height * 4);
+
+	header.msecs = frame->msecs;
+	header.nrects = frame->rects.size / sizeof *r;
+	header.flags = frame->flags;
+	header.size = 0;
+
+	start = recorder->out.size;
+	recorder_append(recorder, &header, sizeof header);
+	recorder_append(recorder, frame->rects.data, frame->rects.size);
+
+	s = frame->pixels.data;
+	wl_array_for_each(r, &frame->rects) {
+		recorder_encode_rect(recorder, r, s);
+		s += (r->x2 - r->x1) * (r->y2 - r->y1);
+	}
+
+	size = recorder->out.size - start;
+	if (!recorder->write_error) {
+		header.size = size - sizeof header;
+		memcpy((char *) recorder->out.data + start,
+		       &header, sizeof header);
+	}
+
+	recorder->offset += size;
+	if (recorder->out.size >= RECORDER_WRITE_BATCH)
+		recorder_flush(recorder);
+
+	return size;
+}
+
+/* The index lets decoders seek without walking the whole file.  Files
+ * cut short lack it and are indexed by the decoder instead. */
+static void
+recorder_write_index(struct weston_recorder *recorder)
+{
+	struct wcap_index_trailer trailer;
+
+	trailer.offset = recorder->offset;
+	trailer.count = recorder->index.size / sizeof (struct wcap_index_entry);
+	trailer.magic = WCAP_INDEX_MAGIC;
+
+	recorder_append(recorder, recorder->index.data, recorder->index.size);
+	recorder_append(recorder, &trailer, sizeof trailer);
+}
+
+static void *
+recorder_worker(void *data)
+{
+	struct weston_recorder *recorder = data;
+	struct recorder_frame *frame;
+	uint32_t size;
+
+	pthread_mutex_lock(&recorder->mutex);
+	for (;;) {
+		while (!recorder->quit && wl_list_empty(&recorder->queue))
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+		if (wl_list_empty(&recorder->queue))
+			break;
+
+		frame = container_of(recorder->queue.prev,
+				     struct recorder_frame, link);
+		wl_list_remove(&frame->link);
+		pthread_mutex_unlock(&recorder->mutex);
+
+		size = recorder_encode_frame(recorder, frame);
+
+		pthread_mutex_lock(&recorder->mutex);
+		wl_list_insert(&recorder->free_list, &frame->link);
+		recorder->queued--;
+		recorder->total += size;
+		recorder->count++;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	recorder_write_index(recorder);
+	recorder_flush(recorder);
+
+	return NULL;
+}
+
+static struct recorder_frame *
+recorder_get_frame(struct weston_recorder *recorder)
+{
+	struct recorder_frame *frame = NULL;
+
+	pthread_mutex_lock(&recorder->mutex);
+	if (recorder->queued < RECORDER_MAX_QUEUED_FRAMES) {
+		if (!wl_list_empty(&recorder->free_list)) {
+			frame = container_of(recorder->free_list.next,
+					     struct recorder_frame, link);
+			wl_list_remove(&frame->link);
+		} else {
+			frame = zalloc(sizeof *frame);
+			if (frame) {
+				wl_array_init(&frame->rects);
+				wl_array_init(&frame->pixels);
+			}
+		}
+		if (frame)
+			recorder->queued++;
+	}
+	pthread_mutex_unlock(&recorder->mutex);
+
+	if (frame) {
+		frame->rects.size = 0;
+		frame->pixels.size = 0;
+	}
+
+	return frame;
+}
+
+static void
+recorder_queue_frame(struct weston_recorder *recorder,
+		     struct recorder_frame *frame)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	wl_list_insert(&recorder->queue, &frame->link);
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+}
+
+/* Give a frame back without queueing it. */
+static void
+recorder_release_frame(struct weston_recorder *recorder,
+		       struct recorder_frame *frame)
+{
+	pthread_mutex_lock(&recorder->mutex);
+	wl_list_insert(&recorder->free_list, &frame->link);
+	recorder->queued--;
+	pthread_mutex_unlock(&recorder->mutex);
+}
+
 static void
 weston_recorder_destroy(struct weston_recorder *recorder);
 
+/* Read back the damaged rectangles and hand them to the encoder
+ * thread.  This is all the recorder does on the compositor thread. */
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -311,25 +659,12 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = output->frame_time;
-	pixman_box32_t *r;
+	struct recorder_frame *frame;
+	pixman_box32_t *r, *rects;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	uint32_t *pixels;
+	size_t area;
+	int i, n, width, height, y_orig, keyframe;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -341,113 +676,151 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 				 &damage, &transformed_damage);
 	pixman_region32_fini(&damage);
 
+	pixman_region32_union(&transformed_damage, &transformed_damage,
+			      &recorder->pending_damage);
+	pixman_region32_clear(&recorder->pending_damage);
+
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
+	if (n == 0)
+		goto out;
+
+	frame = recorder_get_frame(recorder);
+	if (frame == NULL) {
+		pixman_region32_copy(&recorder->pending_damage,
+				     &transformed_damage);
+		pthread_mutex_lock(&recorder->mutex);
+		recorder->dropped++;
+		pthread_mutex_unlock(&recorder->mutex);
+		goto out;
+	}
+
+	keyframe = recorder->need_keyframe ||
+		output->frame_time - recorder->keyframe_msecs >=
+			RECORDER_KEYFRAME_INTERVAL;
+	if (keyframe) {
 		pixman_region32_fini(&transformed_damage);
-		return;
+		pixman_region32_init_rect(&transformed_damage, 0, 0,
+					  recorder->stride, recorder->height);
+		r = pixman_region32_rectangles(&transformed_damage, &n);
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
+	area = 0;
+	for (i = 0; i < n; i++)
+		area += (r[i].x2 - r[i].x1) * (r[i].y2 - r[i].y1);
+
+	rects = wl_array_add(&frame->rects, n * sizeof *r);
+	pixels = wl_array_add(&frame->pixels, area * sizeof *pixels);
+	if (rects == NULL || pixels == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		recorder_release_frame(recorder, frame);
+		pixman_region32_copy(&recorder->pending_damage,
+				     &transformed_damage);
+		goto out;
+	}
+
+	memcpy(rects, r, n * sizeof *r);
+	frame->msecs = output->frame_time;
+	frame->flags = keyframe ? WCAP_FRAME_KEYFRAME : 0;
 
 	for (i = 0; i < n; i++) {
 		width = r[i].x2 - r[i].x1;
 		height = r[i].y2 - r[i].y1;
 
-		if (do_yflip)
+		if (recorder->do_yflip)
 			y_orig = output->current_mode->height - r[i].y2;
 		else
 			y_orig = r[i].y1;
 
 		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
+				compositor->read_format, pixels,
 				r[i].x1, y_orig, width, height);
+		pixels += width * height;
+	}
 
-		s = recorder->rect;
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				y_orig = r[i].y2 - j - 1;
-			else
-				y_orig = r[i].y1 + j;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	recorder_queue_frame(recorder, frame);
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+	if (keyframe) {
+		recorder->need_keyframe = 0;
+		recorder->keyframe_msecs = output->frame_time;
 	}
 
+out:
 	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
 
 	if (recorder->destroying)
 		weston_recorder_destroy(recorder);
 }
 
+static void
+recorder_free_frames(struct wl_list *list)
+{
+	struct recorder_frame *frame, *next;
+
+	wl_list_for_each_safe(frame, next, list, link) {
+		wl_array_release(&frame->rects);
+		wl_array_release(&frame->pixels);
+		free(frame);
+	}
+}
+
+static void
+recorder_free(struct weston_recorder *recorder)
+{
+	pthread_cond_destroy(&recorder->queue_cond);
+	pthread_mutex_destroy(&recorder->mutex);
+	pixman_region32_fini(&recorder->pending_damage);
+	recorder_free_frames(&recorder->queue);
+	recorder_free_frames(&recorder->free_list);
+	wl_array_release(&recorder->out);
+	wl_array_release(&recorder->index);
+	free(recorder->delta);
+	free(recorder->frame);
+	free(recorder);
+}
+
 static void
 weston_recorder_create(struct weston_output *output, const char *filename)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_recorder *recorder;
-	int stride, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	sigset_t mask, old_mask;
+	int size, ret;
 
-	recorder = malloc(sizeof *recorder);
+	recorder = zalloc(sizeof *recorder);
 
 	if (recorder == NULL) {
 		weston_log("%s: out of memory\n", __func__);
 		return;
 	}
 
-	stride = output->current_mode->width;
-	size = stride * 4 * output->current_mode->height;
+	recorder->stride = output->current_mode->width;
+	recorder->height = output->current_mode->height;
+	size = recorder->stride * 4 * recorder->height;
 	recorder->frame = zalloc(size);
-	recorder->rect = malloc(size);
-	recorder->total = 0;
-	recorder->count = 0;
-	recorder->destroying = 0;
+	recorder->delta = malloc(recorder->stride * 4);
 	recorder->output = output;
+	recorder->do_yflip =
+		!!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	recorder->fd = -1;
 
-	if (do_yflip)
-		recorder->tmpbuf = NULL;
-	else
-		recorder->tmpbuf = malloc(size);
+	recorder->need_keyframe = 1;
+
+	pixman_region32_init(&recorder->pending_damage);
+	wl_list_init(&recorder->queue);
+	wl_list_init(&recorder->free_list);
+	wl_array_init(&recorder->out);
+	wl_array_init(&recorder->index);
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+
+	if (recorder->frame == NULL || recorder->delta == NULL) {
+		weston_log("%s: out of memory\n", __func__);
+		recorder_free(recorder);
+		return;
+	}
 
-	header.magic = WCAP_HEADER_MAGIC;
+	header.magic = WCAP_HEADER_MAGIC_V2;
 
 	switch (compositor->read_format) {
 	case PIXMAN_x8r8g8b8:
@@ -459,10 +832,7 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		break;
 	default:
 		weston_log("unknown recorder format\n");
-		free(recorder->rect);
-		free(recorder->tmpbuf);
-		free(recorder->frame);
-		free(recorder);
+		recorder_free(recorder);
 		return;
 	}
 
@@ -471,16 +841,28 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 
 	if (recorder->fd < 0) {
 		weston_log("problem opening output file %s: %m\n", filename);
-		free(recorder->rect);
-		free(recorder->tmpbuf);
-		free(recorder->frame);
-		free(recorder);
+		recorder_free(recorder);
 		return;
 	}
 
 	header.width = output->current_mode->width;
 	header.height = output->current_mode->height;
-	recorder->total += write(recorder->fd, &header, sizeof header);
+	recorder_append(recorder, &header, sizeof header);
+	recorder->total = recorder->out.size;
+	recorder->offset = recorder->out.size;
+
+	/* Leave signal handling to the compositor thread. */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+	ret = pthread_create(&recorder->thread, NULL,
+			     recorder_worker, recorder);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	if (ret != 0) {
+		weston_log("failed to create recorder thread\n");
+		close(recorder->fd);
+		recorder_free(recorder);
+		return;
+	}
 
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
@@ -488,16 +870,25 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	weston_output_damage(output);
 }
 
+/* Waits for the encoder to drain the queue. */
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
 	wl_list_remove(&recorder->frame_listener.link);
+
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = 1;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+	pthread_join(recorder->thread, NULL);
+
+	if (recorder->write_error)
+		weston_log("recorder: writing capture failed: %s\n",
+			   strerror(recorder->write_error));
+
 	close(recorder->fd);
-	free(recorder->tmpbuf);
-	free(recorder->frame);
-	free(recorder->rect);
 	recorder->output->disable_planes--;
-	free(recorder);
+	recorder_free(recorder);
 }
 
 static void
@@ -521,9 +912,13 @@ recorder_binding(struct weston_seat *seat, uint32_t time, uint32_t key, void *da
 		recorder = container_of(listener, struct weston_recorder,
 					frame_listener);
 
+		pthread_mutex_lock(&recorder->mutex);
 		weston_log(
-			"stopping recorder, total file size %dM, %d frames\n",
-			recorder->total / (1024 * 1024), recorder->count);
+			"stopping recorder, total file size %dM, %d frames, "
+			"%d dropped, %d queued\n",
+			recorder->total / (1024 * 1024), recorder->count,
+			recorder->dropped, recorder->queued);
+		pthread_mutex_unlock(&recorder->mutex);
 
 		recorder->destroying = 1;
 		weston_output_schedule_repaint(recorder->output);
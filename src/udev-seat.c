@@ -92,6 +92,14 @@ device_added(struct udev_device *udev_device, struct udev_input *input)
 		return 0;
 	}
 
+	if (input->recorder)
+		evdev_recorder_add_device(input->recorder, device);
+
+	if (input->thread &&
+	    evdev_input_thread_add_device(input->thread, device) < 0)
+		weston_log("reading input device '%s' on the compositor "
+			   "thread.\n", devnode);
+
 	calibration_values =
 		udev_device_get_property_value(udev_device,
 					       "WL_CALIBRATION");
@@ -315,15 +323,39 @@ int
 udev_input_init(struct udev_input *input, struct weston_compositor *c, struct udev *udev,
 		const char *seat_id)
 {
+	struct weston_config_section *s;
+	char *record;
+	int use_thread;
+
 	memset(input, 0, sizeof *input);
 	input->seat_id = strdup(seat_id);
 	input->compositor = c;
+
+	s = weston_config_get_section(c->config, "core", NULL, NULL);
+	weston_config_section_get_bool(s, "input-thread", &use_thread, 0);
+	if (use_thread) {
+		input->thread = evdev_input_thread_create(c);
+		if (input->thread == NULL)
+			weston_log("failed to start the input thread, "
+				   "reading input on the compositor thread\n");
+	}
+
+	weston_config_section_get_string(s, "input-record", &record, NULL);
+	if (record) {
+		input->recorder = evdev_recorder_create(record);
+		free(record);
+	}
+
 	if (udev_input_enable(input, udev) < 0)
 		goto err;
 
 	return 0;
 
  err:
+	if (input->thread)
+		evdev_input_thread_destroy(input->thread);
+	if (input->recorder)
+		evdev_recorder_destroy(input->recorder);
 	free(input->seat_id);
 	return -1;
 }
@@ -335,6 +367,10 @@ udev_input_destroy(struct udev_input *input)
 	udev_input_disable(input);
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
 		udev_seat_destroy(seat);
+	if (input->thread)
+		evdev_input_thread_destroy(input->thread);
+	if (input->recorder)
+		evdev_recorder_destroy(input->recorder);
 	free(input->seat_id);
 }
 
@@ -41,6 +41,8 @@ struct udev_input {
 	char *seat_id;
 	struct weston_compositor *compositor;
 	int enabled;
+	struct evdev_input_thread *thread;
+	struct evdev_recorder *recorder;
 };
 
 int udev_input_enable(struct udev_input *input, struct udev *udev);
@@ -0,0 +1,307 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+#include "compositor.h"
+
+/* A view covering more cells than this is kept on the unbounded list
+ * instead, it would otherwise cost more to register than to test. */
+#define MAX_CELLS_PER_VIEW 256
+
+struct weston_view_index_entry {
+	struct wl_list link;
+	struct weston_view *view;
+	int32_t cx, cy;
+};
+
+static uint32_t
+bucket_for_cell(int32_t cx, int32_t cy)
+{
+	uint32_t hash;
+
+	hash = ((uint32_t) cx * 73856093u) ^ ((uint32_t) cy * 19349663u);
+
+	return hash & (WESTON_VIEW_INDEX_BUCKETS - 1);
+}
+
+static int
+box_equal(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+	return a->x1 == b->x1 && a->y1 == b->y1 &&
+	       a->x2 == b->x2 && a->y2 == b->y2;
+}
+
+/* The box a view can be picked in.  Picking truncates view-local
+ * coordinates towards zero, so a point up to one pixel outside the
+ * bounding box may still hit; pad the box accordingly.  Surfaces whose
+ * input region reaches outside the surface (the infinite default of
+ * internal surfaces) can be hit anywhere. */
+static int
+view_index_compute_box(struct weston_view *view, pixman_box32_t *box)
+{
+	struct weston_surface *surface = view->surface;
+	pixman_box32_t *input, *bbox;
+
+	input = pixman_region32_extents(&surface->input);
+	if (pixman_region32_not_empty(&surface->input) &&
+	    (input->x1 < 0 || input->y1 < 0 ||
+	     input->x2 > surface->width || input->y2 > surface->height)) {
+		box->x1 = INT32_MIN;
+		box->y1 = INT32_MIN;
+		box->x2 = INT32_MAX;
+		box->y2 = INT32_MAX;
+		return 1;
+	}
+
+	if (!pixman_region32_not_empty(&view->transform.boundingbox)) {
+		box->x1 = box->y1 = box->x2 = box->y2 = 0;
+		return 0;
+	}
+
+	bbox = pixman_region32_extents(&view->transform.boundingbox);
+	box->x1 = bbox->x1 - 1;
+	box->y1 = bbox->y1 - 1;
+	box->x2 = bbox->x2 + 1;
+	box->y2 = bbox->y2 + 1;
+
+	return 0;
+}
+
+static void
+view_index_unregister(struct weston_view *view)
+{
+	int i;
+
+	for (i = 0; i < view->pick_index.entry_count; i++)
+		wl_list_remove(&view->pick_index.entries[i].link);
+
+	free(view->pick_index.entries);
+	view->pick_index.entries = NULL;
+	view->pick_index.entry_count = 0;
+}
+
+static void
+view_index_register(struct weston_view_index *index,
+		    struct weston_view *view)
+{
+	struct weston_view_index_entry *entry;
+	pixman_box32_t box;
+	int32_t cx, cy, cx1, cy1, cx2, cy2;
+	int unbounded, count;
+
+	unbounded = view_index_compute_box(view, &box);
+
+	if (view->pick_index.entries && box_equal(&box, &view->pick_index.box))
+		return;
+
+	view_index_unregister(view);
+	view->pick_index.box = box;
+
+	if (box.x1 == box.x2 || box.y1 == box.y2)
+		return;
+
+	cx1 = box.x1 >> WESTON_VIEW_INDEX_CELL_SHIFT;
+	cy1 = box.y1 >> WESTON_VIEW_INDEX_CELL_SHIFT;
+	cx2 = (box.x2 - 1) >> WESTON_VIEW_INDEX_CELL_SHIFT;
+	cy2 = (box.y2 - 1) >> WESTON_VIEW_INDEX_CELL_SHIFT;
+
+	if (unbounded ||
+	    (int64_t) (cx2 - cx1 + 1) * (cy2 - cy1 + 1) > MAX_CELLS_PER_VIEW) {
+		entry = malloc(sizeof *entry);
+		if (!entry)
+			return;
+
+		entry->view = view;
+		entry->cx = entry->cy = 0;
+		wl_list_insert(&index->unbounded_list, &entry->link);
+
+		view->pick_index.entries = entry;
+		view->pick_index.entry_count = 1;
+		return;
+	}
+
+	count = (cx2 - cx1 + 1) * (cy2 - cy1 + 1);
+	entry = calloc(count, sizeof *entry);
+	if (!entry)
+		return;
+
+	view->pick_index.entries = entry;
+	view->pick_index.entry_count = count;
+
+	for (cy = cy1; cy <= cy2; cy++) {
+		for (cx = cx1; cx <= cx2; cx++) {
+			entry->view = view;
+			entry->cx = cx;
+			entry->cy = cy;
+			wl_list_insert(&index->bucket[bucket_for_cell(cx, cy)],
+				       &entry->link);
+			entry++;
+		}
+	}
+}
+
+WL_EXPORT void
+weston_view_index_init(struct weston_view_index *index)
+{
+	int i;
+
+	for (i = 0; i < WESTON_VIEW_INDEX_BUCKETS; i++)
+		wl_list_init(&index->bucket[i]);
+	wl_list_init(&index->unbounded_list);
+	wl_list_init(&index->view_list);
+
+	index->serial = 0;
+	index->next_order = 0;
+}
+
+WL_EXPORT void
+weston_view_index_release(struct weston_view_index *index)
+{
+	struct weston_view *view, *next;
+
+	wl_list_for_each_safe(view, next, &index->view_list, pick_index.link)
+		weston_view_index_remove(index, view);
+}
+
+/* Called when the compositor starts rebuilding its view list.  Every
+ * view that ends up in the new list must be passed to
+ * weston_view_index_add() in stacking order, top-most first. */
+WL_EXPORT void
+weston_view_index_begin(struct weston_view_index *index)
+{
+	index->serial++;
+	index->next_order = 0;
+}
+
+WL_EXPORT void
+weston_view_index_add(struct weston_view_index *index,
+		      struct weston_view *view)
+{
+	if (wl_list_empty(&view->pick_index.link))
+		wl_list_insert(&index->view_list, &view->pick_index.link);
+
+	view->pick_index.serial = index->serial;
+	view->pick_index.order = index->next_order++;
+
+	view_index_register(index, view);
+}
+
+/* Refresh the cells of an already indexed view after its bounding box
+ * changed.  Views not in the view list are left alone. */
+WL_EXPORT void
+weston_view_index_update(struct weston_view_index *index,
+			 struct weston_view *view)
+{
+	if (wl_list_empty(&view->pick_index.link))
+		return;
+
+	view_index_register(index, view);
+}
+
+WL_EXPORT void
+weston_view_index_remove(struct weston_view_index *index,
+			 struct weston_view *view)
+{
+	view_index_unregister(view);
+	wl_list_remove(&view->pick_index.link);
+	wl_list_init(&view->pick_index.link);
+}
+
+/* Drop the views that did not make it into the rebuilt view list. */
+WL_EXPORT void
+weston_view_index_end(struct weston_view_index *index)
+{
+	struct weston_view *view, *next;
+
+	wl_list_for_each_safe(view, next, &index->view_list, pick_index.link) {
+		if (view->pick_index.serial != index->serial)
+			weston_view_index_remove(index, view);
+	}
+}
+
+static void
+view_index_test(struct weston_view_index *index, struct weston_view *view,
+		int32_t ix, int32_t iy, wl_fixed_t x, wl_fixed_t y,
+		struct weston_view **best, wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	pixman_box32_t *box = &view->pick_index.box;
+	wl_fixed_t tx, ty;
+
+	if (view->pick_index.serial != index->serial)
+		return;
+
+	if (*best && view->pick_index.order >= (*best)->pick_index.order)
+		return;
+
+	if (ix < box->x1 || ix >= box->x2 || iy < box->y1 || iy >= box->y2)
+		return;
+
+	weston_view_from_global_fixed(view, x, y, &tx, &ty);
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    wl_fixed_to_int(tx),
+					    wl_fixed_to_int(ty),
+					    NULL))
+		return;
+
+	*best = view;
+	*vx = tx;
+	*vy = ty;
+}
+
+/* Return the top-most view whose input region contains the global point
+ * x, y, the same view a front to back walk of the view list would find. */
+WL_EXPORT struct weston_view *
+weston_view_index_pick(struct weston_view_index *index,
+		       wl_fixed_t x, wl_fixed_t y,
+		       wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view_index_entry *entry;
+	struct weston_view *best = NULL;
+	struct wl_list *bucket;
+	int32_t ix, iy, cx, cy;
+
+	ix = floor(wl_fixed_to_double(x));
+	iy = floor(wl_fixed_to_double(y));
+	cx = ix >> WESTON_VIEW_INDEX_CELL_SHIFT;
+	cy = iy >> WESTON_VIEW_INDEX_CELL_SHIFT;
+
+	bucket = &index->bucket[bucket_for_cell(cx, cy)];
+	wl_list_for_each(entry, bucket, link) {
+		if (entry->cx != cx || entry->cy != cy)
+			continue;
+
+		view_index_test(index, entry->view, ix, iy, x, y,
+				&best, vx, vy);
+	}
+
+	wl_list_for_each(entry, &index->unbounded_list, link)
+		view_index_test(index, entry->view, ix, iy, x, y,
+				&best, vx, vy);
+
+	return best;
+}
@@ -0,0 +1,869 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "weston-test-client-helper.h"
+#include "frame-timing-client-protocol.h"
+
+/* Compositor benchmarks.  Every scenario maps a set of shm surfaces
+ * through the test protocol and keeps committing damage to them for a
+ * while, then prints one JSON object per line with the repaint times
+ * from the frame timeline, the latency from commit to frame callback
+ * and from commit to the presentation of the frame that carried it,
+ * with a histogram of the latter in ms buckets, and the CPU time used.
+ * The compositor only keeps the last 256 frames, so the timeline is
+ * fetched over and over during the run; frames that still got away are
+ * counted in timeline_lost.  The repaint times and presentation need
+ * frame-timing-protocol=true in the core section of weston.ini; "make
+ * bench" runs them on the headless backend with such a config, "make
+ * bench-latency" on its 60Hz clock with and without predictive repaint.
+ * Set WESTON_BENCH_OUTPUT to append the results to a file instead of
+ * stdout, and WESTON_BENCH_DURATION to the length of each run in ms. */
+
+#define DEFAULT_DURATION_MS	2000
+#define MAX_LATENCY_SAMPLES	65536
+#define TIMELINE_SIZE		256	/* frames the compositor keeps */
+#define MAX_TIMELINE_SAMPLES	65536
+#define MIN_FETCH_INTERVAL_US	2000
+#define MAX_FETCH_INTERVAL_US	250000
+#define TIMELINE_PHASES		8
+#define PHASE_RENDER		3
+#define PHASE_PRESENT		7
+#define HISTOGRAM_BUCKETS	64
+
+struct bench_scenario {
+	const char *name;
+	int clients;		/* connections to the compositor */
+	int surfaces;		/* stacked top-level surfaces per client */
+	int subsurfaces;	/* depth of the sub-surface chain of each */
+	int width, height;
+	int damage;		/* side of the damaged square, 0 for all */
+	int rate;		/* commits per second, 0 for every frame */
+	int transform;		/* buffer transform */
+	int scale;		/* buffer scale */
+};
+
+static const struct bench_scenario scenarios[] = {
+	{ "single-fullframe", 1, 1, 0, 800, 600, 0, 0,
+	  WL_OUTPUT_TRANSFORM_NORMAL, 1 },
+	{ "single-small-damage", 1, 1, 0, 800, 600, 32, 0,
+	  WL_OUTPUT_TRANSFORM_NORMAL, 1 },
+	{ "stack-16", 1, 16, 0, 256, 256, 64, 0,
+	  WL_OUTPUT_TRANSFORM_NORMAL, 1 },
+	{ "stack-64", 1, 64, 0, 256, 256, 64, 0,
+	  WL_OUTPUT_TRANSFORM_NORMAL, 1 },
+	{ "clients-8-at-30hz", 8, 2, 0, 200, 150, 0, 30,
+	  WL_OUTPUT_TRANSFORM_NORMAL, 1 },
+	{ "subsurface-tree", 2, 2, 6, 320, 240, 48, 0,
+	  WL_OUTPUT_TRANSFORM_NORMAL, 1 },
+	{ "transformed-90", 1, 4, 0, 300, 200, 0, 0,
+	  WL_OUTPUT_TRANSFORM_90, 1 },
+	{ "scaled-2", 1, 4, 0, 300, 200, 0, 0,
+	  WL_OUTPUT_TRANSFORM_NORMAL, 2 },
+};
+
+struct bench;
+
+struct bench_surface {
+	struct bench *bench;
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+	struct wl_buffer *buffer;
+	void *pixels;
+	int buffer_width, buffer_height;
+	uint32_t commits;
+
+	struct wl_callback *frame;
+	uint64_t commit_usec;
+	uint64_t next_commit_usec;
+};
+
+struct bench_client {
+	struct client *client;
+	struct wl_compositor *compositor;
+	struct wl_subcompositor *subcompositor;
+	struct bench_surface *surfaces;
+	int surface_count;
+};
+
+struct bench_frame {
+	uint32_t seq;
+	uint64_t start_usec;
+	uint64_t present_usec;		/* 0 if it never finished */
+	uint32_t repaint_us, render_us;
+};
+
+/* Commit to frame callback, and to the frame's presentation once the
+ * timeline is in. */
+struct latency_sample {
+	uint64_t commit_usec;
+	uint64_t callback_usec;
+};
+
+struct bench {
+	const struct bench_scenario *scenario;
+	struct bench_client *clients;
+	uint64_t interval_usec;
+	int measuring;
+
+	struct latency_sample *latency;
+	int latency_count;
+
+	struct weston_frame_timing *timing;
+	uint32_t timeline_seq;
+	int timeline_done;
+	int timeline_seen;
+	uint32_t timeline_next_seq;	/* first frame not seen yet */
+	uint32_t timeline_new;		/* frames new in the last fetch */
+	uint32_t timeline_lost;
+	uint64_t fetch_usec, next_fetch_usec;
+	struct bench_frame held_frame;
+	int holding_frame;
+	uint32_t *repaint;
+	uint32_t *render;
+	uint64_t *frame_start;
+	uint64_t *frame_present;
+	int timeline_count;
+	uint64_t timeline_start_usec;
+};
+
+static uint64_t
+get_time_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *
+xzalloc_array(size_t count, size_t size)
+{
+	void *p;
+
+	p = calloc(count, size);
+	assert(p);
+
+	return p;
+}
+
+/* Every fetch sends the whole timeline again, and frames may have
+ * dropped out of it since the previous one. */
+static void
+timeline_add_frame(struct bench *bench, struct bench_frame *frame)
+{
+	int n = bench->timeline_count;
+
+	if (bench->timeline_seen) {
+		if ((int32_t) (frame->seq - bench->timeline_next_seq) < 0)
+			return;
+		if (bench->measuring)
+			bench->timeline_lost +=
+				frame->seq - bench->timeline_next_seq;
+	}
+	bench->timeline_seen = 1;
+	bench->timeline_next_seq = frame->seq + 1;
+	bench->timeline_new++;
+
+	/* Only the frames repainted during the run, the timeline also
+	 * holds the ones from before. */
+	if (!bench->measuring ||
+	    frame->start_usec < bench->timeline_start_usec ||
+	    n == MAX_TIMELINE_SAMPLES)
+		return;
+
+	bench->repaint[n] = frame->repaint_us;
+	bench->render[n] = frame->render_us;
+	bench->frame_start[n] = frame->start_usec;
+	bench->frame_present[n] = frame->present_usec;
+	bench->timeline_count++;
+}
+
+/* A frame is only complete once its present event came or a newer
+ * frame exists; the newest one is left for the next fetch otherwise. */
+static void
+timing_handle_frame(void *data, struct weston_frame_timing *timing,
+		    uint32_t seq, uint32_t tv_sec, uint32_t tv_usec,
+		    struct wl_array *phases)
+{
+	struct bench *bench = data;
+	struct bench_frame *frame = &bench->held_frame;
+	uint32_t *phase_us = phases->data;
+	size_t i, count;
+
+	/* Frames come oldest first, the last one is the newest. */
+	bench->timeline_seq = seq;
+
+	if (bench->holding_frame)
+		timeline_add_frame(bench, frame);
+
+	memset(frame, 0, sizeof *frame);
+	frame->seq = seq;
+	frame->start_usec = (uint64_t) tv_sec * 1000000 + tv_usec;
+
+	count = phases->size / sizeof *phase_us;
+	if (count > TIMELINE_PHASES)
+		count = TIMELINE_PHASES;
+	for (i = 0; i < count; i++)
+		if (i != PHASE_PRESENT)
+			frame->repaint_us += phase_us[i];
+	frame->render_us = count > PHASE_RENDER ? phase_us[PHASE_RENDER] : 0;
+
+	bench->holding_frame = 1;
+}
+
+static void
+timing_handle_present(void *data, struct weston_frame_timing *timing,
+		      uint32_t seq, uint32_t tv_sec, uint32_t tv_usec)
+{
+	struct bench *bench = data;
+
+	if (bench->holding_frame && bench->held_frame.seq == seq)
+		bench->held_frame.present_usec =
+			(uint64_t) tv_sec * 1000000 + tv_usec;
+}
+
+static void
+timing_handle_done(void *data, struct weston_frame_timing *timing)
+{
+	struct bench *bench = data;
+
+	if (bench->holding_frame && bench->held_frame.present_usec)
+		timeline_add_frame(bench, &bench->held_frame);
+	bench->holding_frame = 0;
+
+	bench->timeline_done = 1;
+}
+
+static const struct weston_frame_timing_listener timing_listener = {
+	timing_handle_frame,
+	timing_handle_done,
+	timing_handle_present
+};
+
+/* Fetches the timeline and plans the next fetch for when about half
+ * of it will have been replaced by new frames. */
+static void
+fetch_timeline(struct bench *bench)
+{
+	struct client *client = bench->clients[0].client;
+	uint64_t now, interval;
+
+	if (!bench->timing)
+		return;
+
+	bench->timeline_done = 0;
+	bench->timeline_new = 0;
+	weston_frame_timing_get_timeline(bench->timing,
+					 client->output->wl_output);
+	while (!bench->timeline_done)
+		assert(wl_display_dispatch(client->wl_display) >= 0);
+
+	now = get_time_usec();
+	if (bench->fetch_usec && bench->timeline_new)
+		interval = (now - bench->fetch_usec) * (TIMELINE_SIZE / 2) /
+			bench->timeline_new;
+	else
+		interval = MAX_FETCH_INTERVAL_US;
+	if (interval < MIN_FETCH_INTERVAL_US)
+		interval = MIN_FETCH_INTERVAL_US;
+	if (interval > MAX_FETCH_INTERVAL_US)
+		interval = MAX_FETCH_INTERVAL_US;
+
+	bench->fetch_usec = now;
+	bench->next_fetch_usec = now + interval;
+}
+
+static struct global *
+find_global(struct client *client, const char *interface)
+{
+	struct global *g;
+
+	wl_list_for_each(g, &client->global_list, link)
+		if (strcmp(g->interface, interface) == 0)
+			return g;
+
+	return NULL;
+}
+
+static void
+bench_surface_draw(struct bench_surface *bs, int32_t *x, int32_t *y,
+		   int32_t *width, int32_t *height)
+{
+	const struct bench_scenario *scenario = bs->bench->scenario;
+	uint32_t *row, color;
+	int i, j, d, w, h;
+
+	w = scenario->width;
+	h = scenario->height;
+	d = scenario->damage;
+
+	if (d == 0 || d >= w || d >= h) {
+		*x = 0;
+		*y = 0;
+		*width = w;
+		*height = h;
+	} else {
+		*x = (bs->commits * 13) % (w - d);
+		*y = (bs->commits * 7) % (h - d);
+		*width = d;
+		*height = d;
+	}
+
+	/* Touch the pixels the damage covers, clipped to the buffer
+	 * whatever its transform. */
+	color = 0xff000000 | (bs->commits * 0x010203);
+	for (j = *y; j < *y + *height && j < bs->buffer_height; j++) {
+		row = (uint32_t *) bs->pixels + j * bs->buffer_width;
+		for (i = *x; i < *x + *width && i < bs->buffer_width; i++)
+			row[i] = color;
+	}
+}
+
+static const struct wl_callback_listener frame_listener;
+
+static void
+bench_surface_commit(struct bench_surface *bs, uint64_t now)
+{
+	int32_t x, y, width, height;
+
+	bench_surface_draw(bs, &x, &y, &width, &height);
+	bs->commits++;
+
+	wl_surface_attach(bs->surface, bs->buffer, 0, 0);
+	wl_surface_damage(bs->surface, x, y, width, height);
+
+	/* One outstanding callback measures the latency well enough and
+	 * keeps the rate driven surfaces from piling them up. */
+	if (!bs->frame) {
+		bs->frame = wl_surface_frame(bs->surface);
+		wl_callback_add_listener(bs->frame, &frame_listener, bs);
+		bs->commit_usec = now;
+	}
+
+	wl_surface_commit(bs->surface);
+
+	if (bs->bench->interval_usec)
+		bs->next_commit_usec = now + bs->bench->interval_usec;
+}
+
+static void
+frame_handle_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct bench_surface *bs = data;
+	struct bench *bench = bs->bench;
+	uint64_t now = get_time_usec();
+
+	wl_callback_destroy(callback);
+	bs->frame = NULL;
+
+	if (bench->measuring && bench->latency_count < MAX_LATENCY_SAMPLES) {
+		bench->latency[bench->latency_count].commit_usec =
+			bs->commit_usec;
+		bench->latency[bench->latency_count].callback_usec = now;
+		bench->latency_count++;
+	}
+
+	/* Surfaces without a rate follow the repaints. */
+	if (!bench->interval_usec)
+		bench_surface_commit(bs, now);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_handle_done
+};
+
+static void
+bench_surface_init(struct bench_surface *bs, struct bench_client *bc,
+		   struct bench_surface *parent, int x, int y)
+{
+	const struct bench_scenario *scenario = bs->bench->scenario;
+	struct client *client = bc->client;
+	int swap;
+
+	swap = scenario->transform & 1;
+	bs->buffer_width = (swap ? scenario->height : scenario->width) *
+		scenario->scale;
+	bs->buffer_height = (swap ? scenario->width : scenario->height) *
+		scenario->scale;
+
+	bs->surface = wl_compositor_create_surface(bc->compositor);
+	assert(bs->surface);
+	bs->buffer = create_shm_buffer(client, bs->buffer_width,
+				       bs->buffer_height, &bs->pixels);
+	memset(bs->pixels, 0xff,
+	       bs->buffer_width * bs->buffer_height * 4);
+
+	if (scenario->transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		wl_surface_set_buffer_transform(bs->surface,
+						scenario->transform);
+	if (scenario->scale != 1)
+		wl_surface_set_buffer_scale(bs->surface, scenario->scale);
+
+	if (parent) {
+		bs->subsurface =
+			wl_subcompositor_get_subsurface(bc->subcompositor,
+							bs->surface,
+							parent->surface);
+		wl_subsurface_set_position(bs->subsurface, x, y);
+		wl_subsurface_set_desync(bs->subsurface);
+	} else {
+		wl_test_move_surface(client->test->wl_test, bs->surface, x, y);
+	}
+}
+
+static void
+bench_client_init(struct bench_client *bc, struct bench *bench, int index)
+{
+	const struct bench_scenario *scenario = bench->scenario;
+	struct bench_surface *bs, *parent;
+	struct global *g;
+	int i, j, x, y, range_x, range_y, per_surface;
+
+	bc->client = client_create(0, 0, 1, 1);
+
+	g = find_global(bc->client, "wl_compositor");
+	assert(g && g->version >= 3);
+	bc->compositor = wl_registry_bind(bc->client->wl_registry, g->name,
+					  &wl_compositor_interface, 3);
+
+	if (scenario->subsurfaces) {
+		g = find_global(bc->client, "wl_subcompositor");
+		assert(g);
+		bc->subcompositor =
+			wl_registry_bind(bc->client->wl_registry, g->name,
+					 &wl_subcompositor_interface, 1);
+	}
+
+	per_surface = 1 + scenario->subsurfaces;
+	bc->surface_count = scenario->surfaces * per_surface;
+	bc->surfaces = xzalloc_array(bc->surface_count, sizeof *bc->surfaces);
+
+	/* Spread the stack over the output, overlapping a lot. */
+	range_x = bc->client->output->width - scenario->width;
+	range_y = bc->client->output->height - scenario->height;
+	if (range_x < 1)
+		range_x = 1;
+	if (range_y < 1)
+		range_y = 1;
+
+	for (i = 0; i < scenario->surfaces; i++) {
+		x = ((index * scenario->surfaces + i) * 37) % range_x;
+		y = ((index * scenario->surfaces + i) * 23) % range_y;
+
+		parent = NULL;
+		for (j = 0; j < per_surface; j++) {
+			bs = &bc->surfaces[i * per_surface + j];
+			bs->bench = bench;
+			bench_surface_init(bs, bc, parent,
+					   parent ? 8 : x, parent ? 8 : y);
+			parent = bs;
+		}
+	}
+}
+
+/* The commits of all surfaces are due at once, start them staggered so
+ * they don't all land in the same repaint. */
+static void
+bench_start(struct bench *bench)
+{
+	const struct bench_scenario *scenario = bench->scenario;
+	struct bench_client *bc;
+	uint64_t now = get_time_usec();
+	int i, j, n = 0;
+
+	for (i = 0; i < scenario->clients; i++) {
+		bc = &bench->clients[i];
+		for (j = 0; j < bc->surface_count; j++, n++) {
+			bench_surface_commit(&bc->surfaces[j], now);
+			if (bench->interval_usec)
+				bc->surfaces[j].next_commit_usec = now +
+					n * bench->interval_usec /
+					(scenario->clients * bc->surface_count);
+		}
+		wl_display_flush(bc->client->wl_display);
+	}
+}
+
+static void
+bench_run(struct bench *bench, uint64_t end_usec)
+{
+	const struct bench_scenario *scenario = bench->scenario;
+	struct pollfd *fds;
+	struct bench_client *bc;
+	struct bench_surface *bs;
+	uint64_t now, next;
+	int i, j, timeout;
+
+	fds = xzalloc_array(scenario->clients, sizeof *fds);
+	for (i = 0; i < scenario->clients; i++) {
+		fds[i].fd = wl_display_get_fd(bench->clients[i].client->wl_display);
+		fds[i].events = POLLIN;
+	}
+
+	while ((now = get_time_usec()) < end_usec) {
+		next = end_usec;
+
+		if (bench->measuring && bench->timing) {
+			if (bench->next_fetch_usec <= now)
+				fetch_timeline(bench);
+			if (bench->next_fetch_usec < next)
+				next = bench->next_fetch_usec;
+		}
+
+		for (i = 0; i < scenario->clients; i++) {
+			bc = &bench->clients[i];
+			for (j = 0; j < bc->surface_count; j++) {
+				bs = &bc->surfaces[j];
+				if (!bench->interval_usec)
+					continue;
+				if (bs->next_commit_usec <= now)
+					bench_surface_commit(bs, now);
+				if (bs->next_commit_usec < next)
+					next = bs->next_commit_usec;
+			}
+			wl_display_flush(bc->client->wl_display);
+		}
+
+		timeout = (next - now + 999) / 1000;
+		assert(poll(fds, scenario->clients, timeout) >= 0);
+
+		for (i = 0; i < scenario->clients; i++) {
+			bc = &bench->clients[i];
+			if (fds[i].revents & POLLIN)
+				assert(wl_display_dispatch(bc->client->wl_display) >= 0);
+			else
+				wl_display_dispatch_pending(bc->client->wl_display);
+		}
+	}
+
+	free(fds);
+}
+
+/* The compositor launched the test runner, which forked us. */
+static int
+read_proc_stat(pid_t pid, pid_t *ppid, uint64_t *ticks)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	int parent;
+	FILE *f;
+
+	snprintf(path, sizeof path, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	p = fgets(buf, sizeof buf, f);
+	fclose(f);
+	if (!p || !(p = strrchr(buf, ')')))
+		return -1;
+
+	if (sscanf(p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		   &parent, &utime, &stime) != 3)
+		return -1;
+
+	*ppid = parent;
+	*ticks = utime + stime;
+
+	return 0;
+}
+
+static pid_t
+compositor_pid(void)
+{
+	pid_t ppid;
+	uint64_t ticks;
+
+	if (read_proc_stat(getppid(), &ppid, &ticks) < 0)
+		return -1;
+
+	return ppid;
+}
+
+static uint64_t
+process_cpu_usec(pid_t pid)
+{
+	pid_t ppid;
+	uint64_t ticks;
+
+	if (pid < 0 || read_proc_stat(pid, &ppid, &ticks) < 0)
+		return 0;
+
+	return ticks * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static uint64_t
+self_cpu_usec(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+		1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/* The frame a commit went out with is the one being repainted when its
+ * frame callback was sent: the last one started before the callback
+ * arrived, if it was presented after that.  Samples whose frame isn't
+ * in the timeline are left out. */
+static int
+present_latency(struct bench *bench, uint32_t *latency)
+{
+	struct latency_sample *sample;
+	int i, lo, hi, mid, count = 0;
+
+	for (i = 0; i < bench->latency_count; i++) {
+		sample = &bench->latency[i];
+
+		lo = 0;
+		hi = bench->timeline_count;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (bench->frame_start[mid] <= sample->callback_usec)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == 0 ||
+		    bench->frame_present[lo - 1] < sample->callback_usec)
+			continue;
+
+		latency[count++] =
+			bench->frame_present[lo - 1] - sample->commit_usec;
+	}
+
+	return count;
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_distribution(FILE *out, const char *name, uint32_t *samples, int count)
+{
+	uint64_t sum = 0;
+	int i;
+
+	if (count == 0) {
+		fprintf(out, ", \"%s\": null", name);
+		return;
+	}
+
+	qsort(samples, count, sizeof *samples, compare_uint32);
+	for (i = 0; i < count; i++)
+		sum += samples[i];
+
+	fprintf(out, ", \"%s\": { \"samples\": %d, \"mean\": %.1f, "
+		"\"p50\": %u, \"p95\": %u, \"p99\": %u, \"max\": %u }",
+		name, count, (double) sum / count,
+		samples[count / 2], samples[count * 95 / 100],
+		samples[count * 99 / 100], samples[count - 1]);
+}
+
+/* Counts per bucket of bucket_us, up to the bucket of the largest
+ * sample or HISTOGRAM_BUCKETS; the last one also holds all slower
+ * samples.  Expects the samples sorted by print_distribution(). */
+static void
+print_histogram(FILE *out, const char *name, uint32_t *samples, int count,
+		uint32_t bucket_us)
+{
+	int buckets[HISTOGRAM_BUCKETS] = { 0 };
+	int i, b, last = 0;
+
+	if (count == 0) {
+		fprintf(out, ", \"%s\": null", name);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		b = samples[i] / bucket_us;
+		if (b >= HISTOGRAM_BUCKETS)
+			b = HISTOGRAM_BUCKETS - 1;
+		buckets[b]++;
+		if (b > last)
+			last = b;
+	}
+
+	fprintf(out, ", \"%s\": { \"bucket_us\": %u, \"counts\": [",
+		name, bucket_us);
+	for (b = 0; b <= last; b++)
+		fprintf(out, "%s%d", b ? ", " : " ", buckets[b]);
+	fprintf(out, " ] }");
+}
+
+static FILE *
+open_output(void)
+{
+	const char *path = getenv("WESTON_BENCH_OUTPUT");
+	FILE *out;
+
+	if (!path)
+		return stdout;
+
+	out = fopen(path, "a");
+	assert(out);
+
+	return out;
+}
+
+static int
+get_duration_ms(void)
+{
+	const char *value = getenv("WESTON_BENCH_DURATION");
+	int duration;
+
+	if (!value)
+		return DEFAULT_DURATION_MS;
+
+	duration = atoi(value);
+
+	return duration > 0 ? duration : DEFAULT_DURATION_MS;
+}
+
+TEST_P(compositor_bench, scenarios)
+{
+	const struct bench_scenario *scenario = data;
+	struct bench bench = { 0, };
+	struct client *first;
+	struct global *g;
+	uint64_t start, wall, compositor_cpu, client_cpu;
+	uint32_t start_seq, *latency;
+	pid_t pid;
+	FILE *out;
+	int i, count;
+
+	bench.scenario = scenario;
+	if (scenario->rate)
+		bench.interval_usec = 1000000 / scenario->rate;
+	bench.latency = xzalloc_array(MAX_LATENCY_SAMPLES,
+				      sizeof *bench.latency);
+	bench.repaint = xzalloc_array(MAX_TIMELINE_SAMPLES,
+				      sizeof *bench.repaint);
+	bench.render = xzalloc_array(MAX_TIMELINE_SAMPLES,
+				     sizeof *bench.render);
+	bench.frame_start = xzalloc_array(MAX_TIMELINE_SAMPLES,
+					  sizeof *bench.frame_start);
+	bench.frame_present = xzalloc_array(MAX_TIMELINE_SAMPLES,
+					    sizeof *bench.frame_present);
+
+	bench.clients = xzalloc_array(scenario->clients,
+				      sizeof *bench.clients);
+	for (i = 0; i < scenario->clients; i++)
+		bench_client_init(&bench.clients[i], &bench, i);
+	first = bench.clients[0].client;
+
+	g = find_global(first, "weston_frame_timing");
+	if (g) {
+		bench.timing = wl_registry_bind(first->wl_registry, g->name,
+						&weston_frame_timing_interface,
+						g->version < 2 ? g->version : 2);
+		weston_frame_timing_add_listener(bench.timing,
+						 &timing_listener, &bench);
+	} else {
+		fprintf(stderr, "no frame timeline, "
+			"set frame-timing-protocol=true in weston.ini\n");
+	}
+
+	/* Map everything and let a few frames go by before measuring. */
+	bench_start(&bench);
+	bench_run(&bench, get_time_usec() + 200000);
+
+	fetch_timeline(&bench);
+	start_seq = bench.timeline_seq;
+
+	pid = compositor_pid();
+	compositor_cpu = process_cpu_usec(pid);
+	client_cpu = self_cpu_usec();
+	start = get_time_usec();
+	bench.timeline_start_usec = start;
+	bench.measuring = 1;
+
+	bench_run(&bench, start + get_duration_ms() * 1000);
+
+	wall = get_time_usec() - start;
+	compositor_cpu = process_cpu_usec(pid) - compositor_cpu;
+	client_cpu = self_cpu_usec() - client_cpu;
+	fetch_timeline(&bench);
+
+	out = open_output();
+	fprintf(out, "{ \"scenario\": \"%s\", \"clients\": %d, "
+		"\"surfaces\": %d, \"subsurfaces\": %d, "
+		"\"width\": %d, \"height\": %d, \"damage\": %d, "
+		"\"rate\": %d, \"transform\": %d, \"scale\": %d, "
+		"\"duration_ms\": %.1f",
+		scenario->name, scenario->clients, scenario->surfaces,
+		scenario->subsurfaces, scenario->width, scenario->height,
+		scenario->damage, scenario->rate, scenario->transform,
+		scenario->scale, wall / 1000.0);
+
+	if (bench.timing)
+		fprintf(out, ", \"frames\": %u, \"fps\": %.1f, "
+			"\"timeline_lost\": %u",
+			bench.timeline_seq - start_seq,
+			(bench.timeline_seq - start_seq) * 1000000.0 / wall,
+			bench.timeline_lost);
+	else
+		fprintf(out, ", \"frames\": null, \"fps\": null, "
+			"\"timeline_lost\": null");
+
+	print_distribution(out, "repaint_us", bench.repaint,
+			   bench.timeline_count);
+	print_distribution(out, "render_us", bench.render,
+			   bench.timeline_count);
+	latency = xzalloc_array(MAX_LATENCY_SAMPLES, sizeof *latency);
+	for (i = 0; i < bench.latency_count; i++)
+		latency[i] = bench.latency[i].callback_usec -
+			bench.latency[i].commit_usec;
+	print_distribution(out, "commit_to_frame_us", latency,
+			   bench.latency_count);
+
+	count = present_latency(&bench, latency);
+	print_distribution(out, "commit_to_present_us", latency, count);
+	print_histogram(out, "commit_to_present_histogram", latency, count,
+			1000);
+	free(latency);
+
+	if (pid > 0)
+		fprintf(out, ", \"compositor_cpu\": %.3f",
+			(double) compositor_cpu / wall);
+	else
+		fprintf(out, ", \"compositor_cpu\": null");
+	fprintf(out, ", \"client_cpu\": %.3f }\n", (double) client_cpu / wall);
+
+	if (out != stdout)
+		fclose(out);
+	else
+		fflush(out);
+}
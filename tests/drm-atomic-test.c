@@ -0,0 +1,513 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The drm backend tries every sprite assignment with a TEST_ONLY atomic
+ * commit and, when the kernel refuses it, moves on to the next sprite
+ * and finally back to the renderer.  When a commit fails it retries
+ * without the sprites.  This checks the kernel behaviour that relies on,
+ * with requests built the way drm_output_populate_atomic() builds them,
+ * against vkms.  Load it with overlay planes:
+ *
+ *	modprobe vkms enable_overlay=1
+ *
+ * The tests are skipped without a vkms device the process can become
+ * master of.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+#include "weston-test-runner.h"
+
+#define SKIP 77
+
+#define SPRITE_SIZE 64
+
+struct vkms {
+	int fd;
+	uint32_t crtc_id, connector_id;
+	uint32_t primary_id, overlay_id;
+	drmModeModeInfo mode;
+	uint32_t mode_blob;
+	uint32_t primary_fb, sprite_fb;
+};
+
+/* What the backend puts on a plane, see drm_sprite_add_atomic(). */
+struct plane_state {
+	uint32_t fb_id;
+	uint32_t src_w, src_h;
+	int32_t dest_x, dest_y;
+	uint32_t dest_w, dest_h;
+};
+
+static uint32_t
+get_prop(int fd, uint32_t obj_id, uint32_t obj_type, const char *name,
+	 uint64_t *value)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr prop;
+	uint32_t i, id = 0;
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && !id; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (strcmp(prop->name, name) == 0) {
+			id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
+		}
+
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	return id;
+}
+
+static void
+add_prop(drmModeAtomicReq *req, int fd, uint32_t obj_id,
+	 uint32_t obj_type, const char *name, uint64_t value)
+{
+	uint32_t id;
+
+	id = get_prop(fd, obj_id, obj_type, name, NULL);
+	assert(id != 0);
+	assert(drmModeAtomicAddProperty(req, obj_id, id, value) >= 0);
+}
+
+static uint32_t
+create_fb(int fd, uint32_t width, uint32_t height, uint32_t format)
+{
+	struct drm_mode_create_dumb create;
+	struct drm_mode_map_dumb map;
+	uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+	uint32_t fb_id;
+	void *data;
+
+	memset(&create, 0, sizeof create);
+	create.width = width;
+	create.height = height;
+	create.bpp = 32;
+	assert(drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) == 0);
+
+	memset(&map, 0, sizeof map);
+	map.handle = create.handle;
+	assert(drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &map) == 0);
+	data = mmap(NULL, create.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, map.offset);
+	assert(data != MAP_FAILED);
+	memset(data, 0xff, create.size);
+	munmap(data, create.size);
+
+	handles[0] = create.handle;
+	pitches[0] = create.pitch;
+	assert(drmModeAddFB2(fd, width, height, format,
+			     handles, pitches, offsets, &fb_id, 0) == 0);
+
+	return fb_id;
+}
+
+static int
+plane_type(int fd, uint32_t plane_id)
+{
+	uint64_t type = 0;
+
+	get_prop(fd, plane_id, DRM_MODE_OBJECT_PLANE, "type", &type);
+
+	return type;
+}
+
+static int
+open_vkms_device(void)
+{
+	drmVersionPtr version;
+	char path[32];
+	int i, fd, vkms;
+
+	for (i = 0; i < 16; i++) {
+		snprintf(path, sizeof path, "/dev/dri/card%d", i);
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		version = drmGetVersion(fd);
+		vkms = version && strcmp(version->name, "vkms") == 0;
+		drmFreeVersion(version);
+		if (vkms)
+			return fd;
+
+		close(fd);
+	}
+
+	return -1;
+}
+
+/* Finds the first connected connector and a crtc, primary plane and
+ * overlay plane to drive it with, or skips the test. */
+static void
+vkms_init(struct vkms *vkms)
+{
+	drmModeRes *res;
+	drmModePlaneRes *plane_res;
+	drmModeConnector *connector = NULL;
+	drmModeEncoder *encoder;
+	drmModePlane *plane;
+	uint32_t i, pipe = 0;
+
+	memset(vkms, 0, sizeof *vkms);
+
+	vkms->fd = open_vkms_device();
+	if (vkms->fd < 0) {
+		fprintf(stderr, "no vkms device\n");
+		exit(SKIP);
+	}
+
+	if (drmSetClientCap(vkms->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+	    drmSetClientCap(vkms->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		fprintf(stderr, "no atomic modesetting\n");
+		exit(SKIP);
+	}
+
+	if (drmSetMaster(vkms->fd) != 0) {
+		fprintf(stderr, "vkms device is in use: %m\n");
+		exit(SKIP);
+	}
+
+	res = drmModeGetResources(vkms->fd);
+	assert(res);
+
+	for (i = 0; i < (uint32_t) res->count_connectors; i++) {
+		connector = drmModeGetConnector(vkms->fd, res->connectors[i]);
+		if (connector && connector->connection == DRM_MODE_CONNECTED &&
+		    connector->count_modes > 0)
+			break;
+		drmModeFreeConnector(connector);
+		connector = NULL;
+	}
+	assert(connector);
+
+	vkms->connector_id = connector->connector_id;
+	vkms->mode = connector->modes[0];
+
+	encoder = drmModeGetEncoder(vkms->fd, connector->encoders[0]);
+	assert(encoder);
+	for (i = 0; i < (uint32_t) res->count_crtcs; i++) {
+		if (encoder->possible_crtcs & (1 << i)) {
+			vkms->crtc_id = res->crtcs[i];
+			pipe = i;
+			break;
+		}
+	}
+	assert(vkms->crtc_id);
+	drmModeFreeEncoder(encoder);
+	drmModeFreeConnector(connector);
+	drmModeFreeResources(res);
+
+	plane_res = drmModeGetPlaneResources(vkms->fd);
+	assert(plane_res);
+	for (i = 0; i < plane_res->count_planes; i++) {
+		plane = drmModeGetPlane(vkms->fd, plane_res->planes[i]);
+		assert(plane);
+
+		if (plane->possible_crtcs & (1 << pipe)) {
+			switch (plane_type(vkms->fd, plane->plane_id)) {
+			case DRM_PLANE_TYPE_PRIMARY:
+				if (!vkms->primary_id)
+					vkms->primary_id = plane->plane_id;
+				break;
+			case DRM_PLANE_TYPE_OVERLAY:
+				if (!vkms->overlay_id)
+					vkms->overlay_id = plane->plane_id;
+				break;
+			}
+		}
+
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(plane_res);
+
+	assert(vkms->primary_id);
+	if (!vkms->overlay_id) {
+		fprintf(stderr, "no overlay plane, "
+			"load vkms with enable_overlay=1\n");
+		exit(SKIP);
+	}
+
+	assert(drmModeCreatePropertyBlob(vkms->fd, &vkms->mode,
+					 sizeof vkms->mode,
+					 &vkms->mode_blob) == 0);
+
+	vkms->primary_fb = create_fb(vkms->fd, vkms->mode.hdisplay,
+				     vkms->mode.vdisplay,
+				     DRM_FORMAT_XRGB8888);
+	vkms->sprite_fb = create_fb(vkms->fd, SPRITE_SIZE, SPRITE_SIZE,
+				    DRM_FORMAT_ARGB8888);
+}
+
+/* Turns everything off so that no test sees what the previous one
+ * left on screen. */
+static void
+vkms_reset(struct vkms *vkms)
+{
+	drmModeAtomicReq *req;
+	int fd = vkms->fd;
+
+	req = drmModeAtomicAlloc();
+	assert(req);
+
+	add_prop(req, fd, vkms->primary_id, DRM_MODE_OBJECT_PLANE,
+		 "FB_ID", 0);
+	add_prop(req, fd, vkms->primary_id, DRM_MODE_OBJECT_PLANE,
+		 "CRTC_ID", 0);
+	add_prop(req, fd, vkms->overlay_id, DRM_MODE_OBJECT_PLANE,
+		 "FB_ID", 0);
+	add_prop(req, fd, vkms->overlay_id, DRM_MODE_OBJECT_PLANE,
+		 "CRTC_ID", 0);
+	add_prop(req, fd, vkms->connector_id, DRM_MODE_OBJECT_CONNECTOR,
+		 "CRTC_ID", 0);
+	add_prop(req, fd, vkms->crtc_id, DRM_MODE_OBJECT_CRTC,
+		 "MODE_ID", 0);
+	add_prop(req, fd, vkms->crtc_id, DRM_MODE_OBJECT_CRTC,
+		 "ACTIVE", 0);
+
+	assert(drmModeAtomicCommit(fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET,
+				   NULL) == 0);
+
+	drmModeAtomicFree(req);
+}
+
+static void
+add_plane(drmModeAtomicReq *req, struct vkms *vkms, uint32_t plane_id,
+	  const struct plane_state *state)
+{
+	int fd = vkms->fd;
+	uint32_t type = DRM_MODE_OBJECT_PLANE;
+
+	if (!state->fb_id) {
+		add_prop(req, fd, plane_id, type, "FB_ID", 0);
+		add_prop(req, fd, plane_id, type, "CRTC_ID", 0);
+		return;
+	}
+
+	add_prop(req, fd, plane_id, type, "FB_ID", state->fb_id);
+	add_prop(req, fd, plane_id, type, "CRTC_ID", vkms->crtc_id);
+	add_prop(req, fd, plane_id, type, "SRC_X", 0);
+	add_prop(req, fd, plane_id, type, "SRC_Y", 0);
+	add_prop(req, fd, plane_id, type, "SRC_W", state->src_w << 16);
+	add_prop(req, fd, plane_id, type, "SRC_H", state->src_h << 16);
+	add_prop(req, fd, plane_id, type, "CRTC_X", state->dest_x);
+	add_prop(req, fd, plane_id, type, "CRTC_Y", state->dest_y);
+	add_prop(req, fd, plane_id, type, "CRTC_W", state->dest_w);
+	add_prop(req, fd, plane_id, type, "CRTC_H", state->dest_h);
+}
+
+/* Commits the mode, the primary plane unless primary is NULL, and the
+ * overlay plane.  Returns 0 or a negative errno. */
+static int
+commit(struct vkms *vkms, const struct plane_state *primary,
+       const struct plane_state *overlay, uint32_t flags)
+{
+	drmModeAtomicReq *req;
+	int ret;
+
+	req = drmModeAtomicAlloc();
+	assert(req);
+
+	add_prop(req, vkms->fd, vkms->crtc_id, DRM_MODE_OBJECT_CRTC,
+		 "MODE_ID", vkms->mode_blob);
+	add_prop(req, vkms->fd, vkms->crtc_id, DRM_MODE_OBJECT_CRTC,
+		 "ACTIVE", 1);
+	add_prop(req, vkms->fd, vkms->connector_id,
+		 DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", vkms->crtc_id);
+
+	if (primary)
+		add_plane(req, vkms, vkms->primary_id, primary);
+	add_plane(req, vkms, vkms->overlay_id, overlay);
+
+	ret = drmModeAtomicCommit(vkms->fd, req,
+				  flags | DRM_MODE_ATOMIC_ALLOW_MODESET,
+				  NULL);
+	if (ret)
+		ret = -errno;
+
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+static uint64_t
+plane_fb(struct vkms *vkms, uint32_t plane_id)
+{
+	uint64_t fb_id = 0;
+
+	assert(get_prop(vkms->fd, plane_id, DRM_MODE_OBJECT_PLANE,
+			"FB_ID", &fb_id));
+
+	return fb_id;
+}
+
+static void
+primary_state(struct vkms *vkms, struct plane_state *state)
+{
+	state->fb_id = vkms->primary_fb;
+	state->src_w = vkms->mode.hdisplay;
+	state->src_h = vkms->mode.vdisplay;
+	state->dest_x = 0;
+	state->dest_y = 0;
+	state->dest_w = vkms->mode.hdisplay;
+	state->dest_h = vkms->mode.vdisplay;
+}
+
+static void
+sprite_state(struct vkms *vkms, struct plane_state *state, uint32_t size)
+{
+	state->fb_id = vkms->sprite_fb;
+	state->src_w = SPRITE_SIZE;
+	state->src_h = SPRITE_SIZE;
+	state->dest_x = 16;
+	state->dest_y = 16;
+	state->dest_w = size;
+	state->dest_h = size;
+}
+
+static const struct plane_state no_sprite;
+
+TEST(test_only_changes_nothing)
+{
+	struct vkms vkms;
+	struct plane_state primary, sprite;
+	uint64_t primary_fb, overlay_fb;
+
+	vkms_init(&vkms);
+	vkms_reset(&vkms);
+	primary_state(&vkms, &primary);
+	sprite_state(&vkms, &sprite, SPRITE_SIZE);
+
+	primary_fb = plane_fb(&vkms, vkms.primary_id);
+	overlay_fb = plane_fb(&vkms, vkms.overlay_id);
+
+	/* An unscaled sprite is what vkms can always show. */
+	assert(commit(&vkms, &primary, &sprite,
+		      DRM_MODE_ATOMIC_TEST_ONLY) == 0);
+
+	assert(plane_fb(&vkms, vkms.primary_id) == primary_fb);
+	assert(plane_fb(&vkms, vkms.overlay_id) == overlay_fb);
+
+	assert(commit(&vkms, &primary, &sprite, 0) == 0);
+	assert(plane_fb(&vkms, vkms.primary_id) == vkms.primary_fb);
+	assert(plane_fb(&vkms, vkms.overlay_id) == vkms.sprite_fb);
+}
+
+TEST(refused_sprite_falls_back_to_renderer)
+{
+	struct vkms vkms;
+	struct plane_state primary, scaled;
+
+	vkms_init(&vkms);
+	vkms_reset(&vkms);
+	primary_state(&vkms, &primary);
+
+	/* vkms planes do not scale, so the test of a scaled sprite
+	 * fails, and the backend gives the view back to the renderer
+	 * by leaving the sprite off. */
+	sprite_state(&vkms, &scaled, 2 * SPRITE_SIZE);
+	assert(commit(&vkms, &primary, &scaled,
+		      DRM_MODE_ATOMIC_TEST_ONLY) == -EINVAL);
+	assert(plane_fb(&vkms, vkms.overlay_id) == 0);
+
+	assert(commit(&vkms, &primary, &no_sprite,
+		      DRM_MODE_ATOMIC_TEST_ONLY) == 0);
+	assert(commit(&vkms, &primary, &no_sprite, 0) == 0);
+	assert(plane_fb(&vkms, vkms.primary_id) == vkms.primary_fb);
+	assert(plane_fb(&vkms, vkms.overlay_id) == 0);
+}
+
+TEST(refused_commit_retries_without_sprites)
+{
+	struct vkms vkms;
+	struct plane_state primary, sprite, scaled;
+
+	vkms_init(&vkms);
+	vkms_reset(&vkms);
+	primary_state(&vkms, &primary);
+	sprite_state(&vkms, &sprite, SPRITE_SIZE);
+	sprite_state(&vkms, &scaled, 2 * SPRITE_SIZE);
+
+	assert(commit(&vkms, &primary, &sprite, 0) == 0);
+
+	/* A refused commit keeps what is on screen, and the same
+	 * frame goes through once the sprites are dropped. */
+	assert(commit(&vkms, &primary, &scaled, 0) == -EINVAL);
+	assert(plane_fb(&vkms, vkms.overlay_id) == vkms.sprite_fb);
+
+	assert(commit(&vkms, &primary, &no_sprite, 0) == 0);
+	assert(plane_fb(&vkms, vkms.overlay_id) == 0);
+}
+
+TEST(first_frame_test_without_primary)
+{
+	struct vkms vkms;
+	struct plane_state primary, sprite;
+	int ret;
+
+	vkms_init(&vkms);
+	vkms_reset(&vkms);
+	primary_state(&vkms, &primary);
+	sprite_state(&vkms, &sprite, SPRITE_SIZE);
+
+	/* Before the first frame the sprites are tested without the
+	 * primary plane.  Whatever the kernel answers, nothing may
+	 * change, and the frame must still go out, with the sprite
+	 * when it was accepted or without when the commit with the
+	 * primary plane refuses it. */
+	ret = commit(&vkms, NULL, &sprite, DRM_MODE_ATOMIC_TEST_ONLY);
+	assert(ret == 0 || ret == -EINVAL);
+	assert(plane_fb(&vkms, vkms.overlay_id) == 0);
+
+	if (ret == 0 && commit(&vkms, &primary, &sprite, 0) == 0) {
+		assert(plane_fb(&vkms, vkms.overlay_id) == vkms.sprite_fb);
+		return;
+	}
+
+	assert(commit(&vkms, &primary, &no_sprite, 0) == 0);
+	assert(plane_fb(&vkms, vkms.primary_id) == vkms.primary_fb);
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Runs in weston on the drm backend over vkms, see weston-tests-env,
+ * which also checks that the backend used atomic modesetting.  Getting
+ * here means the outputs came up; each of them then has to show
+ * FRAME_COUNT frames, every one a full repaint, and every one accepted
+ * by the backend's atomic commit.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "../src/compositor.h"
+
+#define FRAME_COUNT	10
+#define TIMEOUT_MS	5000
+
+struct drm_test {
+	struct weston_compositor *compositor;
+	struct wl_event_source *timeout;
+	int outputs;
+	int done;
+};
+
+struct output_frames {
+	struct drm_test *test;
+	struct weston_output *output;
+	struct wl_listener frame_listener;
+	int frames;
+};
+
+/* The output repaints only when damaged after the frame_signal, since
+ * the repaint clears its need for one when the signal has run. */
+static void
+damage_output(void *data)
+{
+	struct output_frames *of = data;
+
+	weston_output_damage(of->output);
+}
+
+static void
+frame_handler(struct wl_listener *listener, void *data)
+{
+	struct output_frames *of =
+		container_of(listener, struct output_frames, frame_listener);
+	struct weston_output *output = data;
+	struct weston_frame_timeline *tl = &output->timeline;
+	struct weston_frame_timing *previous;
+	struct drm_test *test = of->test;
+	struct wl_event_loop *loop;
+
+	/* The frame before this one went out in an atomic commit, or
+	 * drm_output_repaint() failed and it was never submitted. */
+	if (of->frames > 0 && tl->current) {
+		previous = &tl->frames[(tl->current->seq - 1) &
+				       (WESTON_FRAME_TIMELINE_SIZE - 1)];
+		assert(previous->repaint_us != 0);
+	}
+
+	if (++of->frames < FRAME_COUNT) {
+		loop = wl_display_get_event_loop(test->compositor->wl_display);
+		wl_event_loop_add_idle(loop, damage_output, of);
+		return;
+	}
+
+	wl_list_remove(&of->frame_listener.link);
+	free(of);
+
+	fprintf(stderr, "output %s showed %d frames\n",
+		output->name, FRAME_COUNT);
+
+	if (++test->done == test->outputs) {
+		wl_event_source_remove(test->timeout);
+		wl_display_terminate(test->compositor->wl_display);
+	}
+}
+
+static int
+timeout_handler(void *data)
+{
+	struct drm_test *test = data;
+
+	fprintf(stderr, "only %d of %d outputs finished their frames\n",
+		test->done, test->outputs);
+	abort();
+
+	return 0;
+}
+
+static void
+start_test(void *data)
+{
+	struct drm_test *test = data;
+	struct weston_compositor *compositor = test->compositor;
+	struct weston_output *output;
+	struct output_frames *of;
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		of = zalloc(sizeof *of);
+		assert(of);
+		of->test = test;
+		of->output = output;
+		of->frame_listener.notify = frame_handler;
+		wl_signal_add(&output->frame_signal, &of->frame_listener);
+		test->outputs++;
+
+		weston_output_damage(output);
+	}
+
+	assert(test->outputs > 0);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct drm_test *test;
+
+	test = zalloc(sizeof *test);
+	assert(test);
+	test->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	test->timeout = wl_event_loop_add_timer(loop, timeout_handler, test);
+	wl_event_source_timer_update(test->timeout, TIMEOUT_MS);
+
+	wl_event_loop_add_idle(loop, start_test, test);
+
+	return 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../src/compositor.h"
+
+#define VIEW_SIZE	96
+#define REPAINT_COUNT	50
+#define MAX_FRAMES	600
+
+/* Opaque pattern in the top left corner, drawn over the translucent
+ * views: a blue square with a red one inside it. */
+#define PATTERN_SIZE	64
+#define RED_X		16
+#define RED_SIZE	16
+
+#define BLUE_PIXEL	0x000000ff
+#define RED_PIXEL	0x00ff0000
+
+/* A level of l magnifies by 1 / (1 - l). */
+static const float levels[] = { 0.0f, 0.5f, 0.75f, 0.0f };
+
+struct zoom_test {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	struct weston_layer layer;
+	struct wl_listener frame_listener;
+	uint32_t *pixels;
+	unsigned int stage;
+	int stage_pending;
+	int frames;
+	double unzoomed_ms;
+};
+
+static double
+elapsed_ms(const struct timespec *begin)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - begin->tv_sec) * 1000.0 +
+		(end.tv_nsec - begin->tv_nsec) / 1000000.0;
+}
+
+/* Zoom the way the shell's zoom bindings do, and let the spring
+ * animation settle over the following frames. */
+static void
+set_zoom(struct weston_output *output, float level)
+{
+	output->zoom.level = level;
+	if (level > 0.0f)
+		weston_output_activate_zoom(output);
+	weston_output_update_zoom(output);
+}
+
+static int
+zoom_settled(struct weston_output *output)
+{
+	return wl_list_empty(&output->zoom.animation_z.link);
+}
+
+static double
+time_repaints(struct zoom_test *test)
+{
+	struct weston_output *output = test->output;
+	struct weston_compositor *compositor = test->compositor;
+	pixman_region32_t damage;
+	struct timespec begin;
+	double ms = 0.0;
+	int i;
+
+	pixman_region32_init(&damage);
+
+	for (i = 0; i < REPAINT_COUNT; i++) {
+		/* Renderers may rewrite the damage they are given */
+		pixman_region32_copy(&damage, &output->region);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		compositor->renderer->repaint_output(output, &damage);
+		ms += elapsed_ms(&begin);
+
+		/* The magnified damage stays within the output */
+		pixman_region32_subtract(&damage, &damage, &output->region);
+		assert(!pixman_region32_not_empty(&damage));
+	}
+
+	pixman_region32_fini(&damage);
+
+	return ms / REPAINT_COUNT;
+}
+
+/* Pixel at output position x, y of the last repaint; read_pixels
+ * returns the image bottom up. */
+static uint32_t
+output_pixel(struct zoom_test *test, int x, int y)
+{
+	struct weston_output *output = test->output;
+
+	return test->pixels[(output->height - 1 - y) * output->width + x] &
+		0x00ffffff;
+}
+
+/* The pointer sits on the output's top left corner, so zooming keeps
+ * that corner in place and global x, y lands on output x * scale,
+ * y * scale. */
+static void
+check_pattern(struct zoom_test *test, int scale)
+{
+	struct weston_output *output = test->output;
+	int red = (RED_X + RED_SIZE / 2) * scale;
+	int blue = (RED_X / 2) * scale;
+	int outside = (RED_X + RED_SIZE) * scale + RED_SIZE / 2 * scale;
+	int ret;
+
+	ret = test->compositor->renderer->read_pixels(output,
+						      PIXMAN_a8r8g8b8,
+						      test->pixels, 0, 0,
+						      output->width,
+						      output->height);
+	assert(ret == 0);
+
+	assert(output_pixel(test, red, red) == RED_PIXEL);
+	assert(output_pixel(test, blue, blue) == BLUE_PIXEL);
+	assert(output_pixel(test, red, blue) == BLUE_PIXEL);
+	assert(output_pixel(test, outside, red) == BLUE_PIXEL);
+	assert(output_pixel(test, outside, outside) == BLUE_PIXEL);
+
+	/* The edges of the red square, give or take rounding */
+	assert(output_pixel(test, RED_X * scale + 1, red) == RED_PIXEL);
+	assert(output_pixel(test, RED_X * scale - 2, red) == BLUE_PIXEL);
+	assert(output_pixel(test, (RED_X + RED_SIZE) * scale - 2, red) ==
+	       RED_PIXEL);
+	assert(output_pixel(test, (RED_X + RED_SIZE) * scale + 1, red) ==
+	       BLUE_PIXEL);
+}
+
+static void
+run_stage(struct zoom_test *test)
+{
+	float level = levels[test->stage];
+	int scale = 1.0f / (1.0f - level) + 0.5f;
+	double ms;
+
+	ms = time_repaints(test);
+	if (test->stage == 0)
+		test->unzoomed_ms = ms;
+
+	fprintf(stderr, "zoom %dx: %.3f ms per frame (%.2f of unzoomed)\n",
+		scale, ms,
+		test->unzoomed_ms > 0.0 ? ms / test->unzoomed_ms : 1.0);
+
+	check_pattern(test, scale);
+}
+
+/* Runs outside the repaint that settled the zoom: the timed repaints
+ * emit the frame_signal themselves. */
+static void
+next_stage(void *data)
+{
+	struct zoom_test *test = data;
+	struct weston_output *output = test->output;
+
+	run_stage(test);
+	test->stage_pending = 0;
+
+	if (++test->stage < ARRAY_LENGTH(levels)) {
+		set_zoom(output, levels[test->stage]);
+		return;
+	}
+
+	/* Zooming back out turns zoom off again */
+	assert(!output->zoom.active);
+
+	wl_list_remove(&test->frame_listener.link);
+	free(test->pixels);
+	wl_display_terminate(test->compositor->wl_display);
+}
+
+static void
+frame_handler(struct wl_listener *listener, void *data)
+{
+	struct zoom_test *test =
+		container_of(listener, struct zoom_test, frame_listener);
+	struct weston_output *output = test->output;
+	struct wl_event_loop *loop;
+
+	if (test->stage_pending)
+		return;
+
+	assert(++test->frames < MAX_FRAMES);
+
+	if (!zoom_settled(output))
+		return;
+
+	test->stage_pending = 1;
+	loop = wl_display_get_event_loop(test->compositor->wl_display);
+	wl_event_loop_add_idle(loop, next_stage, test);
+}
+
+static struct weston_view *
+add_view(struct zoom_test *test, int32_t x, int32_t y, int32_t size,
+	 float red, float green, float blue, float alpha)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(test->compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+
+	weston_surface_set_color(surface, red, green, blue, alpha);
+	weston_surface_set_size(surface, size, size);
+	weston_view_set_position(view, x, y);
+	wl_list_insert(test->layer.view_list.prev, &view->layer_link);
+
+	return view;
+}
+
+static void
+setup_views(void *data)
+{
+	struct zoom_test *test = data;
+	struct weston_compositor *compositor = test->compositor;
+	struct weston_output *output;
+	struct weston_seat *seat;
+	int32_t x, y;
+
+	output = container_of(compositor->output_list.next,
+			      struct weston_output, link);
+	test->output = output;
+
+	test->pixels = malloc(output->width * output->height * 4);
+	assert(test->pixels);
+
+	/* Zoom follows the pointer of the first seat, the headless
+	 * backend's seat doesn't have one. */
+	assert(!wl_list_empty(&compositor->seat_list));
+	seat = container_of(compositor->seat_list.next,
+			    struct weston_seat, link);
+	if (!seat->pointer)
+		weston_seat_init_pointer(seat);
+	weston_pointer_move(seat->pointer, wl_fixed_from_int(output->x),
+			    wl_fixed_from_int(output->y));
+
+	weston_layer_init(&test->layer, &compositor->cursor_layer.link);
+
+	add_view(test, output->x + RED_X, output->y + RED_X, RED_SIZE,
+		 1.0, 0.0, 0.0, 1.0);
+	add_view(test, output->x, output->y, PATTERN_SIZE,
+		 0.0, 0.0, 1.0, 1.0);
+
+	/* Translucent views overlapping by half, so every pixel blends */
+	for (y = 0; y < output->height; y += VIEW_SIZE / 2)
+		for (x = 0; x < output->width; x += VIEW_SIZE / 2)
+			add_view(test, output->x + x, output->y + y,
+				 VIEW_SIZE, 0.2, 0.4, (x + y) % 3 / 2.0, 0.5);
+
+	test->frame_listener.notify = frame_handler;
+	wl_signal_add(&output->frame_signal, &test->frame_listener);
+
+	weston_compositor_schedule_repaint(compositor);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct zoom_test *test;
+
+	test = zalloc(sizeof *test);
+	if (test == NULL)
+		return -1;
+
+	test->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, setup_views, test);
+
+	return 0;
+}
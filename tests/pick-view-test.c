@@ -0,0 +1,236 @@
+/*
+ * Copyright © 2014 Collabora, Ltd.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and
+ * its documentation for any purpose is hereby granted without fee, provided
+ * that the above copyright notice appear in all copies and that both that
+ * copyright notice and this permission notice appear in supporting
+ * documentation, and that the name of the copyright holders not be used in
+ * advertising or publicity pertaining to distribution of the software
+ * without specific, written prior permission.  The copyright holders make
+ * no representations about the suitability of this software for any
+ * purpose.  It is provided "as is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS
+ * SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS, IN NO EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER
+ * RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+
+#include "../src/compositor.h"
+
+#define GRID_WIDTH	40
+#define GRID_HEIGHT	30
+#define GRID_STEP	32
+#define VIEW_SIZE	48
+#define PICK_COUNT	100000
+
+struct pick_test {
+	struct weston_compositor *compositor;
+	struct weston_layer layer;
+	struct wl_listener frame_listener;
+};
+
+static double
+timespec_to_ms(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0;
+}
+
+static double
+elapsed_ms(const struct timespec *begin)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return timespec_to_ms(&end) - timespec_to_ms(begin);
+}
+
+/* The straightforward front to back walk the index must agree with. */
+static struct weston_view *
+pick_view_linear(struct weston_compositor *compositor,
+		 wl_fixed_t x, wl_fixed_t y,
+		 wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view;
+
+	wl_list_for_each(view, &compositor->view_list, link) {
+		weston_view_from_global_fixed(view, x, y, vx, vy);
+		if (pixman_region32_contains_point(&view->surface->input,
+						   wl_fixed_to_int(*vx),
+						   wl_fixed_to_int(*vy),
+						   NULL))
+			return view;
+	}
+
+	return NULL;
+}
+
+static void
+run_picks(struct pick_test *test)
+{
+	struct weston_compositor *compositor = test->compositor;
+	struct weston_view *view, *expected;
+	struct timespec begin;
+	wl_fixed_t *points, vx, vy, evx, evy;
+	double indexed_ms, linear_ms;
+	int i, count = 0;
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		count++;
+
+	points = malloc(PICK_COUNT * 2 * sizeof *points);
+	assert(points);
+
+	srand(1);
+	for (i = 0; i < PICK_COUNT * 2; i += 2) {
+		points[i] = rand() % wl_fixed_from_int(GRID_WIDTH * GRID_STEP +
+						       VIEW_SIZE);
+		points[i + 1] = rand() % wl_fixed_from_int(GRID_HEIGHT *
+							   GRID_STEP +
+							   VIEW_SIZE);
+	}
+
+	for (i = 0; i < PICK_COUNT * 2; i += 2) {
+		view = weston_compositor_pick_view(compositor,
+						   points[i], points[i + 1],
+						   &vx, &vy);
+		expected = pick_view_linear(compositor,
+					    points[i], points[i + 1],
+					    &evx, &evy);
+		assert(view == expected);
+		if (view)
+			assert(vx == evx && vy == evy);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < PICK_COUNT * 2; i += 2)
+		weston_compositor_pick_view(compositor,
+					    points[i], points[i + 1],
+					    &vx, &vy);
+	indexed_ms = elapsed_ms(&begin);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < PICK_COUNT * 2; i += 2)
+		pick_view_linear(compositor, points[i], points[i + 1],
+				 &vx, &vy);
+	linear_ms = elapsed_ms(&begin);
+
+	fprintf(stderr, "%d picks against %d views: "
+		"indexed %.3f ms (%.1f ns/pick), "
+		"linear %.3f ms (%.1f ns/pick)\n",
+		PICK_COUNT, count,
+		indexed_ms, indexed_ms * 1000000.0 / PICK_COUNT,
+		linear_ms, linear_ms * 1000000.0 / PICK_COUNT);
+
+	free(points);
+}
+
+static void
+frame_handler(struct wl_listener *listener, void *data)
+{
+	struct pick_test *test =
+		container_of(listener, struct pick_test, frame_listener);
+
+	wl_list_remove(&test->frame_listener.link);
+
+	run_picks(test);
+
+	wl_display_terminate(test->compositor->wl_display);
+}
+
+static struct weston_view *
+create_view(struct pick_test *test, int32_t x, int32_t y)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(test->compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+
+	weston_surface_set_size(surface, VIEW_SIZE, VIEW_SIZE);
+	pixman_region32_fini(&surface->input);
+	pixman_region32_init_rect(&surface->input, 0, 0,
+				  VIEW_SIZE, VIEW_SIZE);
+	weston_view_set_position(view, x, y);
+
+	wl_list_insert(test->layer.view_list.prev, &view->layer_link);
+
+	return view;
+}
+
+static void
+setup_views(void *data)
+{
+	struct pick_test *test = data;
+	struct weston_compositor *compositor = test->compositor;
+	struct weston_output *output;
+	struct weston_surface *surface;
+	struct weston_view *view;
+	struct weston_transform *scale;
+	int i, j;
+
+	weston_layer_init(&test->layer, &compositor->cursor_layer.link);
+
+	/* Overlapping views with a few scaled ones mixed in. */
+	for (j = 0; j < GRID_HEIGHT; j++) {
+		for (i = 0; i < GRID_WIDTH; i++) {
+			view = create_view(test, i * GRID_STEP, j * GRID_STEP);
+			if ((i + j) % 7 != 0)
+				continue;
+
+			scale = zalloc(sizeof *scale);
+			assert(scale);
+			weston_matrix_init(&scale->matrix);
+			weston_matrix_scale(&scale->matrix, 1.5, 0.75, 1.0);
+			wl_list_insert(&view->geometry.transformation_list,
+				       &scale->link);
+			weston_view_geometry_dirty(view);
+		}
+	}
+
+	/* A catch-all view with the default infinite input region. */
+	surface = weston_surface_create(compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+	weston_surface_set_size(surface, 1, 1);
+	wl_list_insert(test->layer.view_list.prev, &view->layer_link);
+
+	output = container_of(compositor->output_list.next,
+			      struct weston_output, link);
+	test->frame_listener.notify = frame_handler;
+	wl_signal_add(&output->frame_signal, &test->frame_listener);
+
+	weston_compositor_schedule_repaint(compositor);
+}
+
+WL_EXPORT int
+module_init(struct weston_compositor *compositor, int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+	struct pick_test *test;
+
+	test = zalloc(sizeof *test);
+	if (test == NULL)
+		return -1;
+
+	test->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, setup_views, test);
+
+	return 0;
+}
@@ -63,6 +63,11 @@ list_tests(void)
 		fprintf(stderr, "	%s\n", t->name);
 }
 
+/* Exit status of a test that cannot run here, as automake has it. */
+#define SKIP 77
+
+static int skipped;
+
 static int
 exec_and_report_test(const struct weston_test *t, void *test_data, int iteration)
 {
@@ -91,6 +96,11 @@ exec_and_report_test(const struct weston_test *t, void *test_data, int iteration
 		fprintf(stderr, "exit status %d", info.si_status);
 		if (info.si_status == EXIT_SUCCESS)
 			success = 1;
+		if (info.si_status == SKIP) {
+			fprintf(stderr, ", skip.\n");
+			skipped++;
+			return 1;
+		}
 		break;
 	case CLD_KILLED:
 	case CLD_DUMPED:
@@ -160,8 +170,11 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	fprintf(stderr, "%d tests, %d pass, %d fail\n",
-		total, pass, total - pass);
+	fprintf(stderr, "%d tests, %d pass, %d skip, %d fail\n",
+		total, pass - skipped, skipped, total - pass);
+
+	if (pass != total)
+		return EXIT_FAILURE;
 
-	return pass == total ? EXIT_SUCCESS : EXIT_FAILURE;
+	return skipped == total ? SKIP : EXIT_SUCCESS;
 }
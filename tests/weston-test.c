@@ -78,6 +78,10 @@ notify_pointer_position(struct weston_test *test, struct wl_resource *resource)
 	struct weston_seat *seat = get_seat(test);
 	struct weston_pointer *pointer = seat->pointer;
 
+	/* The headless backend's seat has no pointer. */
+	if (!pointer)
+		return;
+
 	wl_test_send_pointer_position(resource, pointer->x, pointer->y);
 }
 
@@ -229,6 +233,22 @@ get_n_buffers(struct wl_client *client, struct wl_resource *resource)
 	wl_test_send_n_egl_buffers(resource, n_buffers);
 }
 
+static void
+advance_clock(struct wl_client *client, struct wl_resource *resource,
+	      uint32_t msecs)
+{
+	struct weston_test *test = wl_resource_get_user_data(resource);
+	struct weston_compositor *ec = test->compositor;
+
+	if (!ec->advance_clock) {
+		wl_resource_post_error(resource, 0,
+				       "backend has no virtual clock");
+		return;
+	}
+
+	ec->advance_clock(ec, msecs);
+}
+
 static const struct wl_test_interface test_implementation = {
 	move_surface,
 	move_pointer,
@@ -236,6 +256,7 @@ static const struct wl_test_interface test_implementation = {
 	activate_surface,
 	send_key,
 	get_n_buffers,
+	advance_clock,
 };
 
 static void
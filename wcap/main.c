@@ -33,6 +33,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <cairo.h>
 
@@ -53,24 +55,13 @@ write_png(struct wcap_decoder *decoder, const char *filename)
 }
 
 static inline int
-rgb_to_yuv(uint32_t format, uint32_t p, int *u, int *v)
+rgb_to_yuv(uint32_t p, int rshift, int bshift, int *u, int *v)
 {
 	int r, g, b, y;
 
-	switch (format) {
-	case WCAP_FORMAT_XRGB8888:
-		r = (p >> 16) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 0) & 0xff;
-		break;
-	case WCAP_FORMAT_XBGR8888:
-		r = (p >> 0) & 0xff;
-		g = (p >> 8) & 0xff;
-		b = (p >> 16) & 0xff;
-		break;
-	default:
-		assert(0);
-	}
+	r = (p >> rshift) & 0xff;
+	g = (p >> 8) & 0xff;
+	b = (p >> bshift) & 0xff;
 
 	y = (19595 * r + 38469 * g + 7472 * b) >> 16;
 	if (y > 255)
@@ -95,32 +86,42 @@ int clamp_uv(int u)
 		return clamp;
 }
 
+struct convert_job {
+	const uint32_t *frame;
+	unsigned char *out;
+	int width, height;
+	int rshift, bshift;
+};
+
+/* Convert rows [row, end) of the frame, row must be even.  The channel
+ * positions are resolved once per frame so that the loops are straight
+ * integer arithmetic the compiler can vectorize. */
 static void
-convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
+convert_rows_yv12(const struct convert_job *job, int row, int end)
 {
-	unsigned char *y1, *y2, *u, *v;
-	uint32_t *p1, *p2, *end;
+	unsigned char *y1, *y2, *u, *v, *out = job->out;
+	const uint32_t *p1, *p2, *pend;
 	int i, u_accum, v_accum, stride0, stride1;
-	uint32_t format = decoder->format;
+	int rs = job->rshift, bs = job->bshift;
 
-	stride0 = decoder->width;
-	stride1 = decoder->width / 2;
-	for (i = 0; i < decoder->height; i += 2) {
+	stride0 = job->width;
+	stride1 = job->width / 2;
+	for (i = row; i < end; i += 2) {
 		y1 = out + stride0 * i;
 		y2 = y1 + stride0;
-		v = out + stride0 * decoder->height + stride1 * i / 2;
-		u = v + stride1 * decoder->height / 2;
-		p1 = decoder->frame + decoder->width * i;
-		p2 = p1 + decoder->width;
-		end = p1 + decoder->width;
+		v = out + stride0 * job->height + stride1 * i / 2;
+		u = v + stride1 * job->height / 2;
+		p1 = job->frame + job->width * i;
+		p2 = p1 + job->width;
+		pend = p1 + job->width;
 
-		while (p1 < end) {
+		while (p1 < pend) {
 			u_accum = 0;
 			v_accum = 0;
-			y1[0] = rgb_to_yuv(format, p1[0], &u_accum, &v_accum);
-			y1[1] = rgb_to_yuv(format, p1[1], &u_accum, &v_accum);
-			y2[0] = rgb_to_yuv(format, p2[0], &u_accum, &v_accum);
-			y2[1] = rgb_to_yuv(format, p2[1], &u_accum, &v_accum);
+			y1[0] = rgb_to_yuv(p1[0], rs, bs, &u_accum, &v_accum);
+			y1[1] = rgb_to_yuv(p1[1], rs, bs, &u_accum, &v_accum);
+			y2[0] = rgb_to_yuv(p2[0], rs, bs, &u_accum, &v_accum);
+			y2[1] = rgb_to_yuv(p2[1], rs, bs, &u_accum, &v_accum);
 			u[0] = clamp_uv(u_accum);
 			v[0] = clamp_uv(v_accum);
 
@@ -135,59 +136,360 @@ convert_to_yv12(struct wcap_decoder *decoder, unsigned char *out)
 }
 
 static void
-convert_to_yuv444(struct wcap_decoder *decoder, unsigned char *out)
+convert_rows_yuv444(const struct convert_job *job, int row, int end)
 {
-
 	unsigned char *yp, *up, *vp;
-	uint32_t *rp, *end;
-	int u, v;
-	int i, stride, psize;
-	uint32_t format = decoder->format;
-
-	stride = decoder->width;
-	psize = stride * decoder->height;
-	for (i = 0; i < decoder->height; i++) {
-		yp = out + stride * i;
+	const uint32_t *rp;
+	int u, v, x, i, stride, psize;
+	int rs = job->rshift, bs = job->bshift;
+
+	stride = job->width;
+	psize = stride * job->height;
+	for (i = row; i < end; i++) {
+		yp = job->out + stride * i;
 		up = yp + (psize * 2);
 		vp = yp + (psize * 1);
-		rp = decoder->frame + decoder->width * i;
-		end = rp + decoder->width;	
-		while (rp < end) {
+		rp = job->frame + job->width * i;
+		for (x = 0; x < job->width; x++) {
 			u = 0;
 			v = 0;
-			yp[0] = rgb_to_yuv(format, rp[0], &u, &v);
-			up[0] = clamp_uv(u/.3);
-			vp[0] = clamp_uv(v/.3);
-			up++;
-			vp++;
-			yp++;
-			rp++;
+			yp[x] = rgb_to_yuv(rp[x], rs, bs, &u, &v);
+			up[x] = clamp_uv(u/.3);
+			vp[x] = clamp_uv(v/.3);
+		}
+	}
+}
+
+/* The yuv4mpeg2 output is produced in three stages: the main thread
+ * decodes frames and copies them into a slot, a pool of workers
+ * converts the slots in bands of rows and a writer thread writes the
+ * converted slots out in order. */
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_CONVERTING,
+	SLOT_CONVERTED
+};
+
+struct convert_slot {
+	struct convert_job job;
+	uint32_t *frame;
+	unsigned char *out;
+	enum slot_state state;
+	int next_band, bands_done;
+};
+
+struct yuv_pipeline {
+	int depth;
+	size_t out_size;
+	int band_rows, band_count;
+
+	struct convert_slot *slots;
+	int slot_count;
+	pthread_t *workers;
+	int worker_count;
+	pthread_t writer;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t convert_cond;
+	pthread_cond_t write_cond;
+	pthread_cond_t free_cond;
+
+	/* Frame sequence numbers, protected by mutex */
+	uint32_t next_decode, next_convert, next_write;
+	int done;
+
+	/* Writer thread only */
+	uint64_t bytes_written;
+	int write_error;
+};
+
+static struct convert_slot *
+pipeline_slot(struct yuv_pipeline *pipeline, uint32_t seq)
+{
+	return &pipeline->slots[seq % pipeline->slot_count];
+}
+
+static void *
+pipeline_worker(void *data)
+{
+	struct yuv_pipeline *pipeline = data;
+	struct convert_slot *slot;
+	int band, row, end;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	for (;;) {
+		while (pipeline->next_convert == pipeline->next_decode &&
+		       !pipeline->done)
+			pthread_cond_wait(&pipeline->convert_cond,
+					  &pipeline->mutex);
+		if (pipeline->next_convert == pipeline->next_decode)
+			break;
+
+		slot = pipeline_slot(pipeline, pipeline->next_convert);
+		band = slot->next_band++;
+		if (slot->next_band == pipeline->band_count)
+			pipeline->next_convert++;
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		row = band * pipeline->band_rows;
+		end = row + pipeline->band_rows;
+		if (end > slot->job.height)
+			end = slot->job.height;
+
+		if (pipeline->depth == 444)
+			convert_rows_yuv444(&slot->job, row, end);
+		else
+			convert_rows_yv12(&slot->job, row, end);
+
+		pthread_mutex_lock(&pipeline->mutex);
+		if (++slot->bands_done == pipeline->band_count) {
+			slot->state = SLOT_CONVERTED;
+			pthread_cond_signal(&pipeline->write_cond);
 		}
 	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	return NULL;
+}
+
+static void *
+pipeline_writer(void *data)
+{
+	struct yuv_pipeline *pipeline = data;
+	struct convert_slot *slot;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	for (;;) {
+		while (pipeline->next_write == pipeline->next_decode &&
+		       !pipeline->done)
+			pthread_cond_wait(&pipeline->write_cond,
+					  &pipeline->mutex);
+		if (pipeline->next_write == pipeline->next_decode)
+			break;
+
+		slot = pipeline_slot(pipeline, pipeline->next_write);
+		while (slot->state != SLOT_CONVERTED)
+			pthread_cond_wait(&pipeline->write_cond,
+					  &pipeline->mutex);
+		pthread_mutex_unlock(&pipeline->mutex);
+
+		if (!pipeline->write_error) {
+			if (fputs("FRAME\n", stdout) == EOF ||
+			    fwrite(slot->out, 1, pipeline->out_size, stdout) !=
+			    pipeline->out_size)
+				pipeline->write_error = 1;
+			else
+				pipeline->bytes_written +=
+					pipeline->out_size + 6;
+		}
+
+		pthread_mutex_lock(&pipeline->mutex);
+		slot->state = SLOT_FREE;
+		pipeline->next_write++;
+		pthread_cond_signal(&pipeline->free_cond);
+	}
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	fflush(stdout);
+
+	return NULL;
+}
+
+/* Queue the current frame of the decoder for conversion, blocking while
+ * all slots are in use. */
+static void
+pipeline_queue_frame(struct yuv_pipeline *pipeline,
+		     struct wcap_decoder *decoder)
+{
+	struct convert_slot *slot;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	while (pipeline->next_decode - pipeline->next_write >=
+	       (uint32_t) pipeline->slot_count)
+		pthread_cond_wait(&pipeline->free_cond, &pipeline->mutex);
+	slot = pipeline_slot(pipeline, pipeline->next_decode);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	memcpy(slot->frame, decoder->frame,
+	       decoder->width * decoder->height * 4);
+
+	pthread_mutex_lock(&pipeline->mutex);
+	slot->state = SLOT_CONVERTING;
+	slot->next_band = 0;
+	slot->bands_done = 0;
+	pipeline->next_decode++;
+	pthread_cond_broadcast(&pipeline->convert_cond);
+	pthread_cond_signal(&pipeline->write_cond);
+	pthread_mutex_unlock(&pipeline->mutex);
 }
 
 static void
-output_yuv_frame(struct wcap_decoder *decoder, int depth)
+pipeline_destroy(struct yuv_pipeline *pipeline)
 {
-	static unsigned char *out;
-	int size;
+	int i;
+
+	pthread_mutex_lock(&pipeline->mutex);
+	pipeline->done = 1;
+	pthread_cond_broadcast(&pipeline->convert_cond);
+	pthread_cond_broadcast(&pipeline->write_cond);
+	pthread_mutex_unlock(&pipeline->mutex);
+
+	pthread_join(pipeline->writer, NULL);
+	for (i = 0; i < pipeline->worker_count; i++)
+		pthread_join(pipeline->workers[i], NULL);
+
+	for (i = 0; i < pipeline->slot_count; i++) {
+		free(pipeline->slots[i].frame);
+		free(pipeline->slots[i].out);
+	}
+
+	pthread_cond_destroy(&pipeline->free_cond);
+	pthread_cond_destroy(&pipeline->write_cond);
+	pthread_cond_destroy(&pipeline->convert_cond);
+	pthread_mutex_destroy(&pipeline->mutex);
+	free(pipeline->workers);
+	free(pipeline->slots);
+}
+
+static int
+pipeline_init(struct yuv_pipeline *pipeline, struct wcap_decoder *decoder,
+	      int depth, int threads)
+{
+	struct convert_slot *slot;
+	int i, rshift, bshift;
+
+	switch (decoder->format) {
+	case WCAP_FORMAT_XRGB8888:
+		rshift = 16;
+		bshift = 0;
+		break;
+	case WCAP_FORMAT_XBGR8888:
+		rshift = 0;
+		bshift = 16;
+		break;
+	default:
+		fprintf(stderr, "unsupported wcap pixel format 0x%08x\n",
+			decoder->format);
+		return -1;
+	}
+
+	memset(pipeline, 0, sizeof *pipeline);
+	pipeline->depth = depth;
+	if (depth == 444)
+		pipeline->out_size = decoder->width * decoder->height * 3;
+	else
+		pipeline->out_size = decoder->width * decoder->height * 3 / 2;
+
+	/* A few bands per worker balance the load, an even row count
+	 * keeps the chroma row pairs of yv12 within a band. */
+	pipeline->band_rows = decoder->height / (threads * 4);
+	if (pipeline->band_rows < 16)
+		pipeline->band_rows = 16;
+	pipeline->band_rows &= ~1;
+	pipeline->band_count = (decoder->height + pipeline->band_rows - 1) /
+		pipeline->band_rows;
+
+	pthread_mutex_init(&pipeline->mutex, NULL);
+	pthread_cond_init(&pipeline->convert_cond, NULL);
+	pthread_cond_init(&pipeline->write_cond, NULL);
+	pthread_cond_init(&pipeline->free_cond, NULL);
+
+	pipeline->slot_count = threads + 2;
+	pipeline->slots = calloc(pipeline->slot_count, sizeof *slot);
+	pipeline->workers = calloc(threads, sizeof *pipeline->workers);
+	if (pipeline->slots == NULL || pipeline->workers == NULL)
+		goto err;
+
+	for (i = 0; i < pipeline->slot_count; i++) {
+		slot = &pipeline->slots[i];
+		slot->frame = malloc(decoder->width * decoder->height * 4);
+		slot->out = malloc(pipeline->out_size);
+		if (slot->frame == NULL || slot->out == NULL)
+			goto err;
+
+		slot->job.frame = slot->frame;
+		slot->job.out = slot->out;
+		slot->job.width = decoder->width;
+		slot->job.height = decoder->height;
+		slot->job.rshift = rshift;
+		slot->job.bshift = bshift;
+	}
+
+	if (pthread_create(&pipeline->writer, NULL,
+			   pipeline_writer, pipeline) != 0)
+		goto err;
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pipeline->workers[i], NULL,
+				   pipeline_worker, pipeline) != 0)
+			break;
+		pipeline->worker_count++;
+	}
 
-	if (depth == 444) {
-		size = decoder->width * decoder->height * 3;
-	} else {
-		size = decoder->width * decoder->height * 3 / 2;
+	if (pipeline->worker_count == 0) {
+		pipeline_destroy(pipeline);
+		return -1;
 	}
-	if (out == NULL)
-		out = malloc(size);
 
-	if (depth == 444) {
-		convert_to_yuv444(decoder, out);
-	} else {
-		convert_to_yv12(decoder, out);
+	return 0;
+
+err:
+	if (pipeline->slots)
+		for (i = 0; i < pipeline->slot_count; i++) {
+			free(pipeline->slots[i].frame);
+			free(pipeline->slots[i].out);
+		}
+	free(pipeline->slots);
+	free(pipeline->workers);
+	pthread_cond_destroy(&pipeline->free_cond);
+	pthread_cond_destroy(&pipeline->write_cond);
+	pthread_cond_destroy(&pipeline->convert_cond);
+	pthread_mutex_destroy(&pipeline->mutex);
+
+	return -1;
+}
+
+static double
+elapsed_seconds(const struct timespec *begin)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - begin->tv_sec) +
+		(end.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/* Find the wcap frame the main loop would show as the given replay
+ * frame, using only the frame index.  Also counts the replay frames. */
+static int
+find_replay_frame(struct wcap_decoder *decoder, int output_frame,
+		  uint32_t frame_time, int *count)
+{
+	struct wcap_index_entry *index = decoder->index;
+	uint32_t k = 0, msecs = 0;
+	int i = 0, has_frame, frame = -1;
+
+	has_frame = decoder->frame_count > 0;
+	if (has_frame)
+		msecs = index[0].msecs;
+	while (has_frame) {
+		if (i == output_frame)
+			frame = k;
+		i++;
+		msecs += frame_time;
+		while (index[k].msecs < msecs && has_frame) {
+			if (k + 1 < decoder->frame_count)
+				k++;
+			else
+				has_frame = 0;
+		}
 	}
 
-	printf("FRAME\n");
-	fwrite(out, 1, size, stdout);
+	*count = i;
+
+	return frame;
 }
 
 static void
@@ -195,14 +497,16 @@ usage(int exit_code)
 {
 	fprintf(stderr, "usage: wcap-decode "
 		"[--help] [--yuv4mpeg2] [--frame=<frame>] [--all] \n"
-		"\t[--rate=<num:denom>] <wcap file>\n\n"
+		"\t[--rate=<num:denom>] [--threads=<n>] <wcap file>\n\n"
 		"\t--help\t\t\tthis help text\n"
 		"\t--yuv4mpeg2\t\tdump wcap file to stdout in yuv4mpeg2 format\n"
 		"\t--yuv4mpeg2-444\t\tdump wcap file to stdout in yuv4mpeg2 444 format\n"
 		"\t--frame=<frame>\t\twrite out the given frame number as png\n"
 		"\t--all\t\t\twrite all frames as pngs\n"
 		"\t--rate=<num:denom>\treplay frame rate for yuv4mpeg2,\n"
-		"\t\t\t\tspecified as an integer fraction\n\n");
+		"\t\t\t\tspecified as an integer fraction\n"
+		"\t--threads=<n>\t\tyuv4mpeg2 conversion threads,\n"
+		"\t\t\t\tdefaults to the number of CPUs\n\n");
 
 	exit(exit_code);
 }
@@ -210,11 +514,14 @@ usage(int exit_code)
 int main(int argc, char *argv[])
 {
 	struct wcap_decoder *decoder;
+	struct yuv_pipeline pipeline;
+	struct timespec begin;
 	int i, j, output_frame = -1, yuv4mpeg2 = 0, all = 0, has_frame;
-	int num = 30, denom = 1;
+	int num = 30, denom = 1, threads = 0;
 	char filename[200];
 	char *mode;
 	uint32_t msecs, frame_time;
+	double seconds;
 
 	for (i = 1, j = 1; i < argc; i++) {
 		if (strcmp(argv[i], "--yuv4mpeg2-444") == 0) {
@@ -227,6 +534,8 @@ int main(int argc, char *argv[])
 			all = 1;
 		} else if (sscanf(argv[i], "--frame=%d", &output_frame) == 1) {
 			;
+		} else if (sscanf(argv[i], "--threads=%d", &threads) == 1) {
+			;
 		} else if (sscanf(argv[i], "--rate=%d", &num) == 1) {
 			;
 		} else if (sscanf(argv[i], "--rate=%d:%d", &num, &denom) == 2) {
@@ -251,6 +560,10 @@ int main(int argc, char *argv[])
 	}
 
 	decoder = wcap_decoder_create(argv[1]);
+	if (decoder == NULL) {
+		fprintf(stderr, "failed to open wcap file %s\n", argv[1]);
+		exit(EXIT_FAILURE);
+	}
 
 	if (yuv4mpeg2 && isatty(1)) {
 		fprintf(stderr, "Not dumping yuv4mpeg2 data to terminal.  Pipe output to a file or a process.\n");
@@ -272,10 +585,43 @@ int main(int argc, char *argv[])
 		fflush(stdout);
 	}
 
+	frame_time = 1000 * denom / num;
+
+	/* A single frame only needs decoding from the keyframe before it. */
+	if (output_frame >= 0 && !all && !yuv4mpeg2 &&
+	    wcap_decoder_load_index(decoder) == 0) {
+		j = find_replay_frame(decoder, output_frame, frame_time, &i);
+		if (j >= 0 && wcap_decoder_seek(decoder, j)) {
+			snprintf(filename, sizeof filename,
+				 "wcap-frame-%d.png", output_frame);
+			write_png(decoder, filename);
+			fprintf(stderr, "wrote %s\n", filename);
+		}
+
+		fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
+			decoder->width, decoder->height, i);
+
+		wcap_decoder_destroy(decoder);
+
+		return EXIT_SUCCESS;
+	}
+
+	if (yuv4mpeg2) {
+		if (threads <= 0)
+			threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (threads <= 0)
+			threads = 1;
+		if (pipeline_init(&pipeline, decoder, yuv4mpeg2, threads) < 0) {
+			fprintf(stderr, "failed to set up conversion\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
 	i = 0;
 	has_frame = wcap_decoder_get_frame(decoder);
 	msecs = decoder->msecs;
-	frame_time = 1000 * denom / num;
 	while (has_frame) {
 		if (all || i == output_frame) {
 			snprintf(filename, sizeof filename,
@@ -284,13 +630,25 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "wrote %s\n", filename);
 		}
 		if (yuv4mpeg2)
-			output_yuv_frame(decoder, yuv4mpeg2);
+			pipeline_queue_frame(&pipeline, decoder);
 		i++;
 		msecs += frame_time;
 		while (decoder->msecs < msecs && has_frame)
 			has_frame = wcap_decoder_get_frame(decoder);
 	}
 
+	if (yuv4mpeg2) {
+		pipeline_destroy(&pipeline);
+		seconds = elapsed_seconds(&begin);
+		if (pipeline.write_error)
+			fprintf(stderr, "writing yuv4mpeg2 stream failed\n");
+		fprintf(stderr, "converted %d frames on %d threads in %.2f s: "
+			"%.1f frames/s, %.1f MB/s in, %.1f MB/s out\n",
+			i, pipeline.worker_count, seconds, i / seconds,
+			decoder->size / seconds / (1024 * 1024),
+			pipeline.bytes_written / seconds / (1024 * 1024));
+	}
+
 	fprintf(stderr, "wcap file: size %dx%d, %d frames\n",
 		decoder->width, decoder->height, i);
 
@@ -37,26 +37,47 @@
 
 #include "wcap-decode.h"
 
-static void
+static int
+wcap_rectangle_valid(struct wcap_decoder *decoder,
+		     const struct wcap_rectangle *rect)
+{
+	return rect->x1 >= 0 && rect->x1 < rect->x2 &&
+	       rect->x2 <= decoder->width &&
+	       rect->y1 >= 0 && rect->y1 < rect->y2 &&
+	       rect->y2 <= decoder->height;
+}
+
+static int
+wcap_run_length(uint32_t v)
+{
+	int l = v >> 24;
+
+	if (l < 0xe0)
+		return l + 1;
+	else
+		return 1 << (l - 0xe0 + 7);
+}
+
+static int
 wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 			      struct wcap_rectangle *rect)
 {
-	uint32_t v, *p = decoder->p, *d;
+	uint32_t v, *p = decoder->p, *end = decoder->end, *d;
 	int width = rect->x2 - rect->x1, height = rect->y2 - rect->y1;
-	int x, i, j, k, l, count = width * height;
+	int x, i, j, k, count = width * height;
 	unsigned char r, g, b, dr, dg, db;
 
 	d = decoder->frame + (rect->y2 - 1) * decoder->width;
 	x = rect->x1;
 	i = 0;
 	while (i < count) {
+		if (p >= end)
+			return -1;
+
 		v = *p++;
-		l = v >> 24;
-		if (l < 0xe0) {
-			j = l + 1;
-		} else {
-			j = 1 << (l - 0xe0 + 7);
-		}
+		j = wcap_run_length(v);
+		if (j > count - i)
+			break;
 
 		dr = (v >> 16);
 		dg = (v >>  8);
@@ -77,9 +98,75 @@ wcap_decoder_decode_rectangle(struct wcap_decoder *decoder,
 
 	if (i != count)
 		printf("rle encoding longer than expected (%d expected %d)\n",
-		       i, count);
+		       i + j, count);
 
 	decoder->p = p;
+
+	return i == count ? 0 : -1;
+}
+
+static void *
+wcap_decoder_first_frame(struct wcap_decoder *decoder)
+{
+	return (char *) decoder->map + sizeof (struct wcap_header);
+}
+
+/* Check that a complete frame starts at p and return the start of the
+ * next one, or NULL if the frame is truncated or corrupt.  Version 1
+ * frames carry no size, the run-length encoded pixels are walked. */
+static void *
+wcap_decoder_skip_frame(struct wcap_decoder *decoder, void *p,
+			uint32_t *msecs, uint32_t *flags)
+{
+	struct wcap_frame_header *header;
+	struct wcap_frame_header_v2 *header_v2;
+	struct wcap_rectangle *rects;
+	uint32_t *w, i, nrects;
+	size_t left = (char *) decoder->end - (char *) p;
+	int count;
+
+	if (decoder->version == 2) {
+		header_v2 = p;
+		if (left < sizeof *header_v2 ||
+		    left - sizeof *header_v2 < header_v2->size ||
+		    header_v2->size / sizeof *rects < header_v2->nrects)
+			return NULL;
+
+		*msecs = header_v2->msecs;
+		*flags = header_v2->flags;
+
+		return (char *) (header_v2 + 1) + header_v2->size;
+	}
+
+	header = p;
+	if (left < sizeof *header)
+		return NULL;
+	nrects = header->nrects;
+	if ((left - sizeof *header) / sizeof *rects < nrects)
+		return NULL;
+
+	*msecs = header->msecs;
+	*flags = p == wcap_decoder_first_frame(decoder) ?
+		WCAP_FRAME_KEYFRAME : 0;
+
+	rects = (void *) (header + 1);
+	w = (uint32_t *) (rects + nrects);
+	for (i = 0; i < nrects; i++) {
+		if (!wcap_rectangle_valid(decoder, &rects[i]))
+			return NULL;
+
+		count = (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+		while (count > 0) {
+			if ((void *) w >= decoder->end)
+				return NULL;
+			count -= wcap_run_length(*w++);
+		}
+		if (count < 0)
+			return NULL;
+	}
+
+	return w;
 }
 
 int
@@ -87,19 +174,162 @@ wcap_decoder_get_frame(struct wcap_decoder *decoder)
 {
 	struct wcap_rectangle *rects;
 	struct wcap_frame_header *header;
-	uint32_t i;
+	struct wcap_frame_header_v2 *header_v2;
+	uint32_t i, nrects, flags = 0;
+	void *next = NULL;
 
-	if (decoder->p == decoder->end)
+	if (decoder->p >= decoder->end)
 		return 0;
 
-	header = decoder->p;
-	decoder->msecs = header->msecs;
+	if (decoder->version == 2) {
+		next = wcap_decoder_skip_frame(decoder, decoder->p,
+					       &decoder->msecs, &flags);
+		if (next == NULL)
+			return 0;
+
+		header_v2 = decoder->p;
+		nrects = header_v2->nrects;
+		rects = (void *) (header_v2 + 1);
+	} else {
+		header = decoder->p;
+		if ((size_t) ((char *) decoder->end - (char *) decoder->p) <
+		    sizeof *header)
+			return 0;
+
+		decoder->msecs = header->msecs;
+		nrects = header->nrects;
+		rects = (void *) (header + 1);
+		if (((char *) decoder->end - (char *) rects) / sizeof *rects <
+		    nrects)
+			return 0;
+	}
+
+	if (flags & WCAP_FRAME_KEYFRAME)
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+
 	decoder->count++;
 
-	rects = (void *) (header + 1);
-	decoder->p = (uint32_t *) (rects + header->nrects);
-	for (i = 0; i < header->nrects; i++)
-		wcap_decoder_decode_rectangle(decoder, &rects[i]);
+	decoder->p = (uint32_t *) (rects + nrects);
+	for (i = 0; i < nrects; i++) {
+		if (!wcap_rectangle_valid(decoder, &rects[i]) ||
+		    wcap_decoder_decode_rectangle(decoder, &rects[i]) < 0) {
+			decoder->p = decoder->end;
+			return 0;
+		}
+	}
+
+	if (next)
+		decoder->p = next;
+
+	return 1;
+}
+
+/* Version 2 files written to completion end in a frame index followed
+ * by a trailer pointing at it. */
+static int
+wcap_decoder_read_trailer(struct wcap_decoder *decoder,
+			  struct wcap_index_trailer *trailer)
+{
+	size_t first = sizeof (struct wcap_header);
+
+	if (decoder->version != 2 || decoder->size < first + sizeof *trailer)
+		return 0;
+
+	memcpy(trailer, (char *) decoder->map + decoder->size - sizeof *trailer,
+	       sizeof *trailer);
+
+	return trailer->magic == WCAP_INDEX_MAGIC &&
+		trailer->offset >= first &&
+		trailer->offset <= decoder->size - sizeof *trailer &&
+		(decoder->size - sizeof *trailer - trailer->offset) /
+			sizeof (struct wcap_index_entry) == trailer->count &&
+		(decoder->size - sizeof *trailer - trailer->offset) %
+			sizeof (struct wcap_index_entry) == 0;
+}
+
+/* Use the index stored in the file, or build one by walking the frames.
+ * A file cut short is walked up to its last complete frame. */
+int
+wcap_decoder_load_index(struct wcap_decoder *decoder)
+{
+	struct wcap_index_trailer trailer;
+	struct wcap_index_entry *index;
+	uint32_t alloc, msecs, flags;
+	void *p, *next;
+
+	if (decoder->index)
+		return 0;
+
+	if (wcap_decoder_read_trailer(decoder, &trailer)) {
+		decoder->index = malloc(trailer.count * sizeof *index +
+					sizeof *index);
+		if (decoder->index == NULL)
+			return -1;
+
+		memcpy(decoder->index,
+		       (char *) decoder->map + trailer.offset,
+		       trailer.count * sizeof *index);
+		decoder->frame_count = trailer.count;
+
+		return 0;
+	}
+
+	alloc = 64;
+	decoder->index = malloc(alloc * sizeof *index);
+	if (decoder->index == NULL)
+		return -1;
+
+	decoder->frame_count = 0;
+	p = wcap_decoder_first_frame(decoder);
+	while ((next = wcap_decoder_skip_frame(decoder, p, &msecs, &flags))) {
+		if (decoder->frame_count == alloc) {
+			alloc *= 2;
+			index = realloc(decoder->index, alloc * sizeof *index);
+			if (index == NULL)
+				return -1;
+			decoder->index = index;
+		}
+
+		index = &decoder->index[decoder->frame_count++];
+		index->offset = (char *) p - (char *) decoder->map;
+		index->msecs = msecs;
+		index->flags = flags;
+		p = next;
+	}
+
+	decoder->end = p;
+
+	return 0;
+}
+
+/* Decode the given frame, starting from the closest keyframe before it
+ * unless the frames decoded so far already lead up to it. */
+int
+wcap_decoder_seek(struct wcap_decoder *decoder, uint32_t frame)
+{
+	uint32_t key;
+
+	if (wcap_decoder_load_index(decoder) < 0 ||
+	    frame >= decoder->frame_count)
+		return 0;
+
+	for (key = frame; key > 0; key--)
+		if (decoder->index[key].flags & WCAP_FRAME_KEYFRAME)
+			break;
+
+	if (decoder->count == 0 ||
+	    decoder->count - 1 < key || decoder->count - 1 > frame) {
+		decoder->p = (char *) decoder->map +
+			decoder->index[key].offset;
+		decoder->count = key;
+		memset(decoder->frame, 0,
+		       decoder->width * decoder->height * 4);
+	}
+
+	while (decoder->count <= frame)
+		if (!wcap_decoder_get_frame(decoder))
+			return 0;
 
 	return 1;
 }
@@ -109,10 +339,11 @@ wcap_decoder_create(const char *filename)
 {
 	struct wcap_decoder *decoder;
 	struct wcap_header *header;
+	struct wcap_index_trailer trailer;
 	int frame_size;
 	struct stat buf;
 
-	decoder = malloc(sizeof *decoder);
+	decoder = calloc(1, sizeof *decoder);
 	if (decoder == NULL)
 		return NULL;
 
@@ -122,24 +353,55 @@ wcap_decoder_create(const char *filename)
 		return NULL;
 	}
 
-	fstat(decoder->fd, &buf);
+	if (fstat(decoder->fd, &buf) < 0 ||
+	    (size_t) buf.st_size < sizeof *header)
+		goto err_fd;
+
 	decoder->size = buf.st_size;
 	decoder->map = mmap(NULL, decoder->size,
 			    PROT_READ, MAP_PRIVATE, decoder->fd, 0);
-		
+	if (decoder->map == MAP_FAILED)
+		goto err_fd;
+
+	/* Frames are mostly decoded front to back. */
+	madvise(decoder->map, decoder->size, MADV_SEQUENTIAL);
+
 	header = decoder->map;
+	switch (header->magic) {
+	case WCAP_HEADER_MAGIC:
+		decoder->version = 1;
+		break;
+	case WCAP_HEADER_MAGIC_V2:
+		decoder->version = 2;
+		break;
+	default:
+		goto err_map;
+	}
+
 	decoder->format = header->format;
 	decoder->count = 0;
 	decoder->width = header->width;
 	decoder->height = header->height;
 	decoder->p = header + 1;
 	decoder->end = decoder->map + decoder->size;
+	if (wcap_decoder_read_trailer(decoder, &trailer))
+		decoder->end = decoder->map + trailer.offset;
 
 	frame_size = header->width * header->height * 4;
 	decoder->frame = malloc(frame_size);
+	if (decoder->frame == NULL)
+		goto err_map;
 	memset(decoder->frame, 0, frame_size);
 
 	return decoder;
+
+err_map:
+	munmap(decoder->map, decoder->size);
+err_fd:
+	close(decoder->fd);
+	free(decoder);
+
+	return NULL;
 }
 
 void
@@ -147,6 +409,7 @@ wcap_decoder_destroy(struct wcap_decoder *decoder)
 {
 	munmap(decoder->map, decoder->size);
 	close(decoder->fd);
+	free(decoder->index);
 	free(decoder->frame);
 	free(decoder);
 }
@@ -33,6 +33,7 @@
 #include <signal.h>
 #include <X11/Xcursor/Xcursor.h>
 #include <linux/input.h>
+#include <xcb/xcbext.h>
 
 #include "xwayland.h"
 
@@ -116,6 +117,21 @@ struct motif_wm_hints {
 #define _NET_WM_MOVERESIZE_MOVE_KEYBOARD    10   /* move via keyboard */
 #define _NET_WM_MOVERESIZE_CANCEL           11   /* cancel operation */
 
+/* Window properties the window manager keeps track of. */
+#define WM_WINDOW_PROPERTY_COUNT 11
+
+struct wm_window_property {
+	xcb_atom_t atom;
+	xcb_atom_t type;
+	int offset;
+};
+
+enum wm_decoration_mode {
+	WM_DECORATION_MODE_NONE,
+	WM_DECORATION_MODE_FRAME,
+	WM_DECORATION_MODE_SHADOW,
+};
+
 struct weston_wm_window {
 	struct weston_wm *wm;
 	xcb_window_t id;
@@ -129,6 +145,27 @@ struct weston_wm_window {
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
 	int properties_dirty;
+
+	/* Property and geometry requests in flight; their replies are
+	 * picked up from the event handler as they arrive. */
+	struct wl_list fetch_link;
+	int fetch_pending;
+	uint32_t fetch_done;
+	xcb_get_property_cookie_t fetch_cookie[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_reply_t *fetch_reply[WM_WINDOW_PROPERTY_COUNT];
+	int geometry_pending;
+	xcb_get_geometry_cookie_t geometry_cookie;
+
+	/* Work waiting for the fetch to complete. */
+	int map_pending;
+	int shell_pending;
+
+	/* What the frame window shows, so unchanged frames aren't redrawn. */
+	int decoration_valid;
+	enum wm_decoration_mode decoration_mode;
+	int decoration_width, decoration_height;
+	uint32_t decoration_flags;
+
 	int pid;
 	char *machine;
 	char *class;
@@ -154,6 +191,10 @@ get_wm_window(struct weston_surface *surface);
 static void
 weston_wm_window_schedule_repaint(struct weston_wm_window *window);
 
+static void
+xserver_map_shell_surface(struct weston_wm *wm,
+			  struct weston_wm_window *window);
+
 static int __attribute__ ((format (printf, 1, 2)))
 wm_log(const char *fmt, ...)
 {
@@ -345,9 +386,11 @@ static void
 read_and_dump_property(struct weston_wm *wm,
 		       xcb_window_t window, xcb_atom_t property)
 {
+#ifdef WM_DEBUG
 	xcb_get_property_reply_t *reply;
 	xcb_get_property_cookie_t cookie;
 
+	/* Not worth a round trip when nobody looks at the log. */
 	cookie = xcb_get_property(wm->conn, 0, window,
 				  property, XCB_ATOM_ANY, 0, 2048);
 	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
@@ -355,6 +398,7 @@ read_and_dump_property(struct weston_wm *wm,
 	dump_property(wm, property, reply);
 
 	free(reply);
+#endif
 }
 
 /* We reuse some predefined, but otherwise useles atoms */
@@ -364,18 +408,11 @@ read_and_dump_property(struct weston_wm *wm,
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_window_get_property_table(struct weston_wm *wm,
+				    struct wm_window_property *props)
 {
-	struct weston_wm *wm = window->wm;
-	struct weston_shell_interface *shell_interface =
-		&wm->server->compositor->shell_interface;
-
 #define F(field) offsetof(struct weston_wm_window, field)
-	const struct {
-		xcb_atom_t atom;
-		xcb_atom_t type;
-		int offset;
-	} props[] = {
+	const struct wm_window_property table[] = {
 		{ XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, F(class) },
 		{ XCB_ATOM_WM_NAME, XCB_ATOM_STRING, F(name) },
 		{ XCB_ATOM_WM_TRANSIENT_FOR, XCB_ATOM_WINDOW, F(transient_for) },
@@ -390,31 +427,79 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
-	xcb_get_property_reply_t *reply;
-	void *p;
-	uint32_t *xid;
-	xcb_atom_t *atom;
+	memcpy(props, table, sizeof table);
+}
+
+static int
+weston_wm_is_window_property(struct weston_wm *wm, xcb_atom_t atom)
+{
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	int i;
+
+	weston_wm_window_get_property_table(wm, props);
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++)
+		if (props[i].atom == atom)
+			return 1;
+
+	return 0;
+}
+
+/* Send the property requests if anything changed since the last time.
+ * Never waits for the replies, see weston_wm_poll_fetches(). */
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
 	uint32_t i;
 
-	if (!window->properties_dirty)
+	/* Fetched again once the current round is in. */
+	if (!window->properties_dirty || window->fetch_pending)
 		return;
 	window->properties_dirty = 0;
 
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
+	weston_wm_window_get_property_table(wm, props);
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++) {
+		window->fetch_cookie[i] = xcb_get_property(wm->conn,
+							   0, /* delete */
+							   window->id,
+							   props[i].atom,
+							   XCB_ATOM_ANY,
+							   0, 2048);
+		window->fetch_reply[i] = NULL;
+	}
+
+	window->fetch_pending = 1;
+	window->fetch_done = 0;
+	if (!window->geometry_pending)
+		wl_list_insert(&wm->fetch_list, &window->fetch_link);
+
+	xcb_flush(wm->conn);
+}
+
+static void
+weston_wm_window_apply_properties(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_shell_interface *shell_interface =
+		&wm->server->compositor->shell_interface;
+	struct wm_window_property props[WM_WINDOW_PROPERTY_COUNT];
+	xcb_get_property_reply_t *reply;
+	void *p;
+	uint32_t *xid;
+	xcb_atom_t *atom;
+	uint32_t i, j;
+
+	weston_wm_window_get_property_table(wm, props);
 
 	window->decorate = !window->override_redirect;
 	window->size_hints.flags = 0;
 	window->motif_hints.flags = 0;
 	window->delete_window = 0;
 
-	for (i = 0; i < ARRAY_LENGTH(props); i++)  {
-		reply = xcb_get_property_reply(wm->conn, cookie[i], NULL);
+	for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++)  {
+		reply = window->fetch_reply[i];
+		window->fetch_reply[i] = NULL;
 		if (!reply)
 			/* Bad window, typically */
 			continue;
@@ -450,12 +535,10 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 			break;
 		case TYPE_WM_PROTOCOLS:
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window)
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.wm_delete_window)
 					window->delete_window = 1;
 			break;
-
-			break;
 		case TYPE_WM_NORMAL_HINTS:
 			memcpy(&window->size_hints,
 			       xcb_get_property_value(reply),
@@ -464,8 +547,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		case TYPE_NET_WM_STATE:
 			window->fullscreen = 0;
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.net_wm_state_fullscreen)
 					window->fullscreen = 1;
 			break;
 		case TYPE_MOTIF_WM_HINTS:
@@ -488,6 +571,34 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		frame_set_title(window->frame, window->name);
 }
 
+/* Drop whatever is still in flight, for a window going away. */
+static void
+weston_wm_window_cancel_fetch(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+	uint32_t i;
+
+	if (!window->fetch_pending && !window->geometry_pending)
+		return;
+
+	if (window->fetch_pending) {
+		for (i = 0; i < WM_WINDOW_PROPERTY_COUNT; i++) {
+			if (window->fetch_done & (1 << i))
+				free(window->fetch_reply[i]);
+			else
+				xcb_discard_reply(wm->conn,
+						  window->fetch_cookie[i].sequence);
+			window->fetch_reply[i] = NULL;
+		}
+	}
+	if (window->geometry_pending)
+		xcb_discard_reply(wm->conn, window->geometry_cookie.sequence);
+
+	window->fetch_pending = 0;
+	window->geometry_pending = 0;
+	wl_list_remove(&window->fetch_link);
+}
+
 static void
 weston_wm_window_get_frame_size(struct weston_wm_window *window,
 				int *width, int *height)
@@ -833,6 +944,26 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 	hash_table_insert(wm->window_hash, window->frame_id, window);
 }
 
+static void
+weston_wm_window_map(struct weston_wm_window *window)
+{
+	struct weston_wm *wm = window->wm;
+
+	window->map_pending = 0;
+
+	if (window->frame_id == XCB_WINDOW_NONE)
+		weston_wm_window_create_frame(window);
+
+	wm_log("XCB_MAP_REQUEST (window %d, %p, frame %d)\n",
+	       window->id, window, window->frame_id);
+
+	weston_wm_window_set_wm_state(window, ICCCM_NORMAL_STATE);
+	weston_wm_window_set_net_wm_state(window);
+
+	xcb_map_window(wm->conn, window->id);
+	xcb_map_window(wm->conn, window->frame_id);
+}
+
 static void
 weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 {
@@ -848,19 +979,16 @@ weston_wm_handle_map_request(struct weston_wm *wm, xcb_generic_event_t *event)
 
 	window = hash_table_lookup(wm->window_hash, map_request->window);
 
-	weston_wm_window_read_properties(window);
-
-	if (window->frame_id == XCB_WINDOW_NONE)
-		weston_wm_window_create_frame(window);
-
-	wm_log("XCB_MAP_REQUEST (window %d, %p, frame %d)\n",
-	       window->id, window, window->frame_id);
-
-	weston_wm_window_set_wm_state(window, ICCCM_NORMAL_STATE);
-	weston_wm_window_set_net_wm_state(window);
+	/* The frame depends on the properties, map once they are in. */
+	weston_wm_window_fetch_properties(window);
+	if (window->fetch_pending || window->geometry_pending) {
+		wm_log("XCB_MAP_REQUEST (window %d, waiting for properties)\n",
+		       window->id);
+		window->map_pending = 1;
+		return;
+	}
 
-	xcb_map_window(wm->conn, map_request->window);
-	xcb_map_window(wm->conn, window->frame_id);
+	weston_wm_window_map(window);
 }
 
 static void
@@ -898,8 +1026,16 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 		return;
 
 	window = hash_table_lookup(wm->window_hash, unmap_notify->window);
-	if (wm->focus_window == window)
+	if (wm->focus_window == window) {
+		/* Or the frame would come back looking focused. */
+		if (window->frame)
+			frame_unset_flag(window->frame, FRAME_FLAG_ACTIVE);
 		wm->focus_window = NULL;
+	}
+	window->map_pending = 0;
+	window->shell_pending = 0;
+	/* The frame's contents are lost with its backing pixmap. */
+	window->decoration_valid = 0;
 	if (window->surface)
 		wl_list_remove(&window->surface_destroy_listener.link);
 	window->surface = NULL;
@@ -908,46 +1044,325 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	xcb_unmap_window(wm->conn, window->frame_id);
 }
 
+/* Rendered pieces of decorations, shared by all frames: the strips
+ * around a decorated window and the shadow of an undecorated one.  They
+ * are pixmaps on the X server, so reusing one is a server side copy. */
+enum wm_decoration_part {
+	WM_DECORATION_TOP,
+	WM_DECORATION_BOTTOM,
+	WM_DECORATION_LEFT,
+	WM_DECORATION_RIGHT,
+	WM_DECORATION_STRIP_COUNT,
+	WM_DECORATION_SHADOW = WM_DECORATION_STRIP_COUNT,
+};
+
+#define WM_DECORATION_CACHE_PIXELS (4 * 1024 * 1024)
+
+struct wm_decoration {
+	struct wl_list link;		/* weston_wm::decoration_cache */
+	enum wm_decoration_part part;
+	int frame_width, frame_height;
+	uint32_t flags;
+	int titled;
+	char *title;			/* only for the title bar */
+	int width, height;
+	cairo_surface_t *surface;
+};
+
+static void
+wm_decoration_destroy(struct weston_wm *wm, struct wm_decoration *decoration)
+{
+	wm->decoration_cache_pixels -= decoration->width * decoration->height;
+	wl_list_remove(&decoration->link);
+	cairo_surface_destroy(decoration->surface);
+	free(decoration->title);
+	free(decoration);
+}
+
+static void
+weston_wm_decoration_cache_release(struct weston_wm *wm)
+{
+	struct wm_decoration *decoration, *next;
+
+	wl_list_for_each_safe(decoration, next, &wm->decoration_cache, link)
+		wm_decoration_destroy(wm, decoration);
+}
+
+static struct wm_decoration *
+weston_wm_decoration_lookup(struct weston_wm *wm,
+			    enum wm_decoration_part part,
+			    int frame_width, int frame_height,
+			    uint32_t flags, const char *title)
+{
+	struct wm_decoration *decoration;
+
+	wl_list_for_each(decoration, &wm->decoration_cache, link) {
+		if (decoration->part != part ||
+		    decoration->frame_width != frame_width ||
+		    decoration->frame_height != frame_height ||
+		    decoration->flags != flags ||
+		    decoration->titled != (title != NULL))
+			continue;
+
+		if (part == WM_DECORATION_TOP && title &&
+		    strcmp(decoration->title, title) != 0)
+			continue;
+
+		wl_list_remove(&decoration->link);
+		wl_list_insert(&wm->decoration_cache, &decoration->link);
+
+		return decoration;
+	}
+
+	return NULL;
+}
+
+/* Adds an empty piece for the caller to render, evicting the least
+ * recently used ones over the budget.  Pieces too big to be worth
+ * keeping aren't cached at all. */
+static struct wm_decoration *
+weston_wm_decoration_create(struct weston_wm *wm, cairo_surface_t *similar,
+			    enum wm_decoration_part part,
+			    int frame_width, int frame_height,
+			    uint32_t flags, const char *title,
+			    int width, int height)
+{
+	struct wm_decoration *decoration, *last;
+
+	if (width <= 0 || height <= 0 ||
+	    width * height > WM_DECORATION_CACHE_PIXELS / 4)
+		return NULL;
+
+	decoration = zalloc(sizeof *decoration);
+	if (decoration == NULL)
+		return NULL;
+
+	if (part == WM_DECORATION_TOP && title) {
+		decoration->title = strdup(title);
+		if (decoration->title == NULL) {
+			free(decoration);
+			return NULL;
+		}
+	}
+
+	decoration->surface =
+		cairo_surface_create_similar(similar,
+					     CAIRO_CONTENT_COLOR_ALPHA,
+					     width, height);
+	if (cairo_surface_status(decoration->surface) !=
+	    CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(decoration->surface);
+		free(decoration->title);
+		free(decoration);
+		return NULL;
+	}
+
+	decoration->part = part;
+	decoration->frame_width = frame_width;
+	decoration->frame_height = frame_height;
+	decoration->flags = flags;
+	decoration->titled = title != NULL;
+	decoration->width = width;
+	decoration->height = height;
+
+	wl_list_insert(&wm->decoration_cache, &decoration->link);
+	wm->decoration_cache_pixels += width * height;
+
+	while (wm->decoration_cache_pixels > WM_DECORATION_CACHE_PIXELS) {
+		last = container_of(wm->decoration_cache.prev,
+				    struct wm_decoration, link);
+		wm_decoration_destroy(wm, last);
+	}
+
+	return decoration;
+}
+
+/* Copies the cached strips into the frame and renders only the missing
+ * ones, clipped, which then go into the cache.  A title change thus
+ * redraws just the title bar, and a focus change between windows of
+ * the same size is all copies. */
+static void
+weston_wm_window_draw_frame(struct weston_wm_window *window, cairo_t *cr,
+			    int width, int height, uint32_t flags)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_decoration *cached[WM_DECORATION_STRIP_COUNT];
+	struct wm_decoration *decoration;
+	cairo_rectangle_int_t strip[WM_DECORATION_STRIP_COUNT];
+	const char *title = window->name;
+	int32_t x, y, w, h;
+	int i, missing = 0, idle;
+	cairo_t *dcr;
+
+	frame_interior(window->frame, &x, &y, &w, &h);
+	strip[WM_DECORATION_TOP] =
+		(cairo_rectangle_int_t) { 0, 0, width, y };
+	strip[WM_DECORATION_BOTTOM] =
+		(cairo_rectangle_int_t) { 0, y + h, width, height - y - h };
+	strip[WM_DECORATION_LEFT] =
+		(cairo_rectangle_int_t) { 0, y, x, h };
+	strip[WM_DECORATION_RIGHT] =
+		(cairo_rectangle_int_t) { x + w, y, width - x - w, h };
+
+	/* A hovered or pressed button is specific to this window. */
+	idle = frame_buttons_idle(window->frame);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	for (i = 0; i < WM_DECORATION_STRIP_COUNT; i++) {
+		cached[i] = NULL;
+		if (strip[i].width <= 0 || strip[i].height <= 0)
+			continue;
+
+		if (i != WM_DECORATION_TOP || idle)
+			cached[i] = weston_wm_decoration_lookup(wm, i,
+								width, height,
+								flags, title);
+		if (cached[i] == NULL) {
+			missing = 1;
+			continue;
+		}
+
+		cairo_set_source_surface(cr, cached[i]->surface,
+					 strip[i].x, strip[i].y);
+		cairo_rectangle(cr, strip[i].x, strip[i].y,
+				strip[i].width, strip[i].height);
+		cairo_fill(cr);
+	}
+
+	if (!missing) {
+		frame_status_clear(window->frame, FRAME_STATUS_REPAINT);
+		return;
+	}
+
+	cairo_save(cr);
+	for (i = 0; i < WM_DECORATION_STRIP_COUNT; i++)
+		if (cached[i] == NULL)
+			cairo_rectangle(cr, strip[i].x, strip[i].y,
+					strip[i].width, strip[i].height);
+	cairo_clip(cr);
+	frame_repaint(window->frame, cr);
+	cairo_restore(cr);
+
+	for (i = 0; i < WM_DECORATION_STRIP_COUNT; i++) {
+		if (cached[i] || (i == WM_DECORATION_TOP && !idle))
+			continue;
+
+		decoration = weston_wm_decoration_create(wm,
+							 window->cairo_surface,
+							 i, width, height,
+							 flags, title,
+							 strip[i].width,
+							 strip[i].height);
+		if (decoration == NULL)
+			continue;
+
+		dcr = cairo_create(decoration->surface);
+		cairo_set_operator(dcr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(dcr, window->cairo_surface,
+					 -strip[i].x, -strip[i].y);
+		cairo_paint(dcr);
+		cairo_destroy(dcr);
+	}
+}
+
+static void
+weston_wm_paint_shadow(struct theme *t, cairo_t *cr, int width, int height)
+{
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, 0, 0, 0, 0);
+	cairo_paint(cr);
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+	cairo_set_source_rgba(cr, 0, 0, 0, 0.45);
+	tile_mask(cr, t->shadow, 2, 2, width + 8, height + 8, 64, 64);
+}
+
+static void
+weston_wm_window_draw_shadow(struct weston_wm_window *window, cairo_t *cr,
+			     int width, int height)
+{
+	struct weston_wm *wm = window->wm;
+	struct wm_decoration *decoration;
+	cairo_t *dcr;
+
+	decoration = weston_wm_decoration_lookup(wm, WM_DECORATION_SHADOW,
+						 width, height, 0, NULL);
+	if (decoration == NULL) {
+		decoration =
+			weston_wm_decoration_create(wm, window->cairo_surface,
+						    WM_DECORATION_SHADOW,
+						    width, height, 0, NULL,
+						    width, height);
+		if (decoration == NULL) {
+			weston_wm_paint_shadow(wm->theme, cr, width, height);
+			return;
+		}
+
+		dcr = cairo_create(decoration->surface);
+		weston_wm_paint_shadow(wm->theme, dcr, width, height);
+		cairo_destroy(dcr);
+	}
+
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, decoration->surface, 0, 0);
+	cairo_paint(cr);
+}
+
 static void
 weston_wm_window_draw_decoration(void *data)
 {
 	struct weston_wm_window *window = data;
 	struct weston_wm *wm = window->wm;
-	struct theme *t = wm->theme;
+	enum wm_decoration_mode mode;
 	cairo_t *cr;
 	int x, y, width, height;
 	int32_t input_x, input_y, input_w, input_h;
 
 	uint32_t flags = 0;
 
-	weston_wm_window_read_properties(window);
-
 	window->repaint_source = NULL;
 
 	weston_wm_window_get_frame_size(window, &width, &height);
 	weston_wm_window_get_child_position(window, &x, &y);
 
-	cairo_xcb_surface_set_size(window->cairo_surface, width, height);
-	cr = cairo_create(window->cairo_surface);
-
 	if (window->fullscreen) {
-		/* nothing */
+		mode = WM_DECORATION_MODE_NONE;
 	} else if (window->decorate) {
+		mode = WM_DECORATION_MODE_FRAME;
 		if (wm->focus_window == window)
 			flags |= THEME_FRAME_ACTIVE;
-
-		frame_repaint(window->frame, cr);
 	} else {
-		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-		cairo_set_source_rgba(cr, 0, 0, 0, 0);
-		cairo_paint(cr);
-
-		cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
-		cairo_set_source_rgba(cr, 0, 0, 0, 0.45);
-		tile_mask(cr, t->shadow, 2, 2, width + 8, height + 8, 64, 64);
+		mode = WM_DECORATION_MODE_SHADOW;
 	}
 
-	cairo_destroy(cr);
+	/* Repaints are scheduled for all kinds of reasons, most of which
+	 * leave what the frame window shows as it is. */
+	if (!window->decoration_valid ||
+	    window->decoration_mode != mode ||
+	    window->decoration_width != width ||
+	    window->decoration_height != height ||
+	    window->decoration_flags != flags ||
+	    (mode == WM_DECORATION_MODE_FRAME &&
+	     frame_status(window->frame) & FRAME_STATUS_REPAINT)) {
+		cairo_xcb_surface_set_size(window->cairo_surface,
+					   width, height);
+		cr = cairo_create(window->cairo_surface);
+
+		if (mode == WM_DECORATION_MODE_FRAME)
+			weston_wm_window_draw_frame(window, cr,
+						    width, height, flags);
+		else if (mode == WM_DECORATION_MODE_SHADOW)
+			weston_wm_window_draw_shadow(window, cr,
+						     width, height);
+
+		cairo_destroy(cr);
+
+		window->decoration_valid = 1;
+		window->decoration_mode = mode;
+		window->decoration_width = width;
+		window->decoration_height = height;
+		window->decoration_flags = flags;
+	}
 
 	if (window->surface) {
 		pixman_region32_fini(&window->surface->pending.opaque);
@@ -1024,8 +1439,6 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	if (!window)
 		return;
 
-	window->properties_dirty = 1;
-
 	wm_log("XCB_PROPERTY_NOTIFY: window %d, ", property_notify->window);
 	if (property_notify->state == XCB_PROPERTY_DELETE)
 		wm_log("deleted\n");
@@ -1033,9 +1446,13 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 		read_and_dump_property(wm, property_notify->window,
 				       property_notify->atom);
 
-	if (property_notify->atom == wm->atom.net_wm_name ||
-	    property_notify->atom == XCB_ATOM_WM_NAME)
-		weston_wm_window_schedule_repaint(window);
+	/* Properties we don't track, like _NET_WM_USER_TIME, change
+	 * all the time; don't refetch for those. */
+	if (!weston_wm_is_window_property(wm, property_notify->atom))
+		return;
+
+	window->properties_dirty = 1;
+	weston_wm_window_fetch_properties(window);
 }
 
 static void
@@ -1044,8 +1461,6 @@ weston_wm_window_create(struct weston_wm *wm,
 {
 	struct weston_wm_window *window;
 	uint32_t values[1];
-	xcb_get_geometry_cookie_t geometry_cookie;
-	xcb_get_geometry_reply_t *geometry_reply;
 
 	window = zalloc(sizeof *window);
 	if (window == NULL) {
@@ -1053,7 +1468,8 @@ weston_wm_window_create(struct weston_wm *wm,
 		return;
 	}
 
-	geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->geometry_cookie = xcb_get_geometry(wm->conn, id);
+	window->geometry_pending = 1;
 
 	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE;
 	xcb_change_window_attributes(wm->conn, id, XCB_CW_EVENT_MASK, values);
@@ -1067,14 +1483,12 @@ weston_wm_window_create(struct weston_wm *wm,
 	window->x = x;
 	window->y = y;
 
-	geometry_reply = xcb_get_geometry_reply(wm->conn, geometry_cookie, NULL);
-	/* technically we should use XRender and check the visual format's
-	alpha_mask, but checking depth is simpler and works in all known cases */
-	if(geometry_reply != NULL)
-		window->has_alpha = geometry_reply->depth == 32;
-	free(geometry_reply);
-
 	hash_table_insert(wm->window_hash, id, window);
+
+	/* Get the properties going now, they are usually in by the time
+	 * the window is mapped. */
+	wl_list_insert(&wm->fetch_list, &window->fetch_link);
+	weston_wm_window_fetch_properties(window);
 }
 
 static void
@@ -1082,6 +1496,8 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 {
 	struct weston_wm *wm = window->wm;
 
+	weston_wm_window_cancel_fetch(window);
+
 	if (window->repaint_source)
 		wl_event_source_remove(window->repaint_source);
 	if (window->cairo_surface)
@@ -1603,6 +2019,83 @@ weston_wm_handle_leave(struct weston_wm *wm, xcb_generic_event_t *event)
 	weston_wm_window_set_cursor(wm, window->frame_id, XWM_CURSOR_LEFT_PTR);
 }
 
+/* Everything the window was waiting for came in. */
+static void
+weston_wm_window_fetch_done(struct weston_wm_window *window)
+{
+	weston_wm_window_apply_properties(window);
+
+	if (window->map_pending)
+		weston_wm_window_map(window);
+
+	if (window->shell_pending && window->surface) {
+		window->shell_pending = 0;
+		xserver_map_shell_surface(window->wm, window);
+	}
+
+	/* Title, decorations or alpha may have changed. */
+	weston_wm_window_schedule_repaint(window);
+
+	/* Changed while this round was in flight. */
+	weston_wm_window_fetch_properties(window);
+}
+
+/* Collect the property and geometry replies that have arrived, without
+ * ever waiting for the X server. */
+static void
+weston_wm_poll_fetches(struct weston_wm *wm)
+{
+	struct weston_wm_window *window, *next;
+	xcb_get_geometry_reply_t *geometry;
+	xcb_generic_error_t *error;
+	void *reply;
+	uint32_t i, all;
+
+	all = (1 << WM_WINDOW_PROPERTY_COUNT) - 1;
+
+	wl_list_for_each_safe(window, next, &wm->fetch_list, fetch_link) {
+		if (window->geometry_pending &&
+		    xcb_poll_for_reply(wm->conn,
+				       window->geometry_cookie.sequence,
+				       &reply, &error)) {
+			geometry = reply;
+			/* technically we should use XRender and check the
+			 * visual format's alpha_mask, but checking depth is
+			 * simpler and works in all known cases */
+			if (geometry != NULL)
+				window->has_alpha = geometry->depth == 32;
+			free(geometry);
+			free(error);
+			window->geometry_pending = 0;
+		}
+
+		for (i = 0; window->fetch_pending &&
+			    i < WM_WINDOW_PROPERTY_COUNT; i++) {
+			if (window->fetch_done & (1 << i))
+				continue;
+			/* Replies come in order, stop at the first one
+			 * that isn't there yet. */
+			if (!xcb_poll_for_reply(wm->conn,
+						window->fetch_cookie[i].sequence,
+						&reply, &error))
+				break;
+			window->fetch_reply[i] = reply;
+			window->fetch_done |= 1 << i;
+			free(error);
+		}
+
+		if (window->geometry_pending ||
+		    (window->fetch_pending && window->fetch_done != all))
+			continue;
+
+		wl_list_remove(&window->fetch_link);
+		if (window->fetch_pending) {
+			window->fetch_pending = 0;
+			weston_wm_window_fetch_done(window);
+		}
+	}
+}
+
 static int
 weston_wm_handle_event(int fd, uint32_t mask, void *data)
 {
@@ -1676,6 +2169,8 @@ weston_wm_handle_event(int fd, uint32_t mask, void *data)
 		count++;
 	}
 
+	weston_wm_poll_fetches(wm);
+
 	xcb_flush(wm->conn);
 
 	return count;
@@ -1913,6 +2408,8 @@ weston_wm_create(struct weston_xserver *wxs)
 		return NULL;
 
 	wm->server = wxs;
+	wl_list_init(&wm->fetch_list);
+	wl_list_init(&wm->decoration_cache);
 	wm->window_hash = hash_table_create();
 	if (wm->window_hash == NULL) {
 		free(wm);
@@ -2007,6 +2504,7 @@ weston_wm_destroy(struct weston_wm *wm)
 {
 	/* FIXME: Free windows in hash. */
 	hash_table_destroy(wm->window_hash);
+	weston_wm_decoration_cache_release(wm);
 	weston_wm_destroy_cursors(wm);
 	xcb_disconnect(wm->conn);
 	wl_event_source_remove(wm->source);
@@ -2032,6 +2530,7 @@ surface_destroy(struct wl_listener *listener, void *data)
 	window->shsurf = NULL;
 	window->surface = NULL;
 	window->view = NULL;
+	window->shell_pending = 0;
 }
 
 static struct weston_wm_window *
@@ -2246,7 +2745,7 @@ xserver_set_window_id(struct wl_client *client, struct wl_resource *resource,
 
 	wm_log("set_window_id %d for surface %p\n", id, surface);
 
-	weston_wm_window_read_properties(window);
+	weston_wm_window_fetch_properties(window);
 
 	/* A weston_wm_window may have many different surfaces assigned
 	 * throughout its life, so we must make sure to remove the listener
@@ -2260,7 +2759,12 @@ xserver_set_window_id(struct wl_client *client, struct wl_resource *resource,
 		      &window->surface_destroy_listener);
 
 	weston_wm_window_schedule_repaint(window);
-	xserver_map_shell_surface(wm, window);
+
+	/* Fullscreen, transient and title all come from the properties. */
+	if (window->fetch_pending || window->geometry_pending)
+		window->shell_pending = 1;
+	else
+		xserver_map_shell_surface(wm, window);
 }
 
 const struct xserver_interface xserver_implementation = {
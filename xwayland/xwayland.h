@@ -54,6 +54,9 @@ struct weston_wm {
 	struct wl_event_source *source;
 	xcb_screen_t *screen;
 	struct hash_table *window_hash;
+	struct wl_list fetch_list;	/* windows waiting for replies */
+	struct wl_list decoration_cache;	/* most recently used first */
+	int decoration_cache_pixels;
 	struct weston_xserver *server;
 	xcb_window_t wm_window;
 	struct weston_wm_window *focus_window;